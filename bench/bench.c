@@ -0,0 +1,545 @@
+/*
+ * End-to-end benchmark of libcutter on synthetic clips.
+ *
+ * The clips are encoded locally with libavcodec from deterministic content,
+ * so every machine benchmarks the same pictures without shipping videos:
+ *
+ *     ./build.sh bench
+ *     ./build/bench --quick -o results.csv --label before
+ *
+ * Each clip is run through every extraction mode and one CSV row is appended
+ * per clip and mode with frames/s, nanoseconds per frame of every stage and
+ * PNG bytes per frame. Rows of several runs (--label) can share one file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+
+#include "libcutter/cutter.h"
+#include "libcutter/internal.h"
+
+#define CLIP_FPS 30
+#define DEFAULT_FRAMES 120
+#define DEFAULT_REPEAT 3
+
+// Timestamps requested by the seek mode
+#define SEEK_TARGETS 16
+
+typedef struct ClipCodec {
+    const char *name;
+    // Encoders tried in order, the codec is skipped when none is available
+    const char *encoders[3];
+    const char *extension;
+} ClipCodec;
+
+static const ClipCodec codecs[] = {
+    { "h264",  { "libx264", "h264", NULL },     "mp4"  },
+    { "mpeg4", { "mpeg4", NULL },               "mp4"  },
+    { "vp9",   { "libvpx-vp9", "vp9", NULL },   "webm" },
+};
+
+static const int resolutions[][2] = {
+    { 640, 360 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 },
+};
+
+static const int gop_sizes[] = { 12, 60 };
+
+// Static clips move a small box over a still gradient, motion clips scroll
+// a pattern under per-pixel noise, the worst case of the inter prediction
+static const char *const contents[] = { "static", "motion" };
+
+typedef struct ClipSpec {
+    const ClipCodec *codec;
+    int width;
+    int height;
+    int gop_size;
+    int motion;
+    int frames;
+    char path[1024];
+} ClipSpec;
+
+typedef struct BenchOptions {
+    const char *clip_dir;
+    const char *csv_path;
+    const char *label;
+    int frames;
+    int repeat;
+    // Only the two smaller resolutions
+    int quick;
+} BenchOptions;
+
+typedef struct BenchRun {
+    int64_t frames;
+    // Where the png modes write, NULL for the other modes
+    const char *png_path;
+    // zlib level of the PNG files, -1 for the libpng default
+    int png_level;
+} BenchRun;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift32, the same noise on every run
+static uint32_t next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void fill_picture(AVFrame *frame, const ClipSpec *clip, int n)
+{
+    uint32_t seed = 0x9e3779b9u ^ (uint32_t) n;
+
+    for (int y = 0; y < clip->height; y++) {
+        uint8_t *row = frame->data[0] + (size_t) y * frame->linesize[0];
+
+        for (int x = 0; x < clip->width; x++) {
+            if (clip->motion)
+                row[x] = (((x + 7 * n) ^ (y + 5 * n)) & 0xff) / 2 + (next_random(&seed) & 0x7f);
+            else
+                row[x] = (x + y) * 255 / (clip->width + clip->height);
+        }
+    }
+
+    for (int plane = 1; plane < 3; plane++) {
+        for (int y = 0; y < clip->height / 2; y++) {
+            uint8_t *row = frame->data[plane] + (size_t) y * frame->linesize[plane];
+
+            for (int x = 0; x < clip->width / 2; x++)
+                row[x] = clip->motion ? (uint8_t) (x + y * plane + 3 * n) : 128 + 32 * (plane - 1);
+        }
+    }
+
+    if (!clip->motion) {
+        int size = clip->height / 10;
+        int bx = (n * 4) % (clip->width - size), by = clip->height / 3;
+
+        for (int y = by; y < by + size; y++)
+            memset(frame->data[0] + (size_t) y * frame->linesize[0] + bx, 235, size);
+    }
+}
+
+static int write_packets(AVFormatContext *output, AVCodecContext *encoder, AVStream *stream, AVPacket *packet)
+{
+    int ret;
+
+    while ((ret = avcodec_receive_packet(encoder, packet)) >= 0) {
+        av_packet_rescale_ts(packet, encoder->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+        ret = av_interleaved_write_frame(output, packet);
+        if (ret < 0)
+            return ret;
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static const AVCodec *find_encoder(const ClipCodec *codec)
+{
+    const AVCodec *encoder = NULL;
+
+    for (int i = 0; !encoder && codec->encoders[i]; i++)
+        encoder = avcodec_find_encoder_by_name(codec->encoders[i]);
+    return encoder;
+}
+
+// Encode the clip into a temporary file renamed once complete
+static int encode_clip(const ClipSpec *clip)
+{
+    AVFormatContext *output = NULL;
+    AVCodecContext *encoder = NULL;
+    AVFrame *frame = NULL;
+    AVPacket *packet = NULL;
+    const AVCodec *codec = find_encoder(clip->codec);
+    char tmp_path[1100];
+    int ret;
+
+    if (!codec)
+        return AVERROR_ENCODER_NOT_FOUND;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%s", clip->path, clip->codec->extension);
+    ret = avformat_alloc_output_context2(&output, NULL, NULL, tmp_path);
+    if (ret < 0)
+        return ret;
+
+    AVStream *stream = avformat_new_stream(output, NULL);
+    encoder = avcodec_alloc_context3(codec);
+    frame = av_frame_alloc();
+    packet = av_packet_alloc();
+    if (!stream || !encoder || !frame || !packet) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    encoder->width = clip->width;
+    encoder->height = clip->height;
+    encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+    encoder->time_base = (AVRational) { 1, CLIP_FPS };
+    encoder->framerate = (AVRational) { CLIP_FPS, 1 };
+    encoder->gop_size = clip->gop_size;
+    encoder->max_b_frames = codec->id == AV_CODEC_ID_VP9 ? 0 : 2;
+    // About 0.1 bit per pixel, a typical streaming rate
+    encoder->bit_rate = (int64_t) clip->width * clip->height * CLIP_FPS / 10;
+    if (output->oformat->flags & AVFMT_GLOBALHEADER)
+        encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    // Fast presets, the clips only need to be representative
+    av_opt_set(encoder->priv_data, "preset", "veryfast", 0);
+    av_opt_set(encoder->priv_data, "deadline", "realtime", 0);
+    av_opt_set_int(encoder->priv_data, "cpu-used", 8, 0);
+
+    ret = avcodec_open2(encoder, codec, NULL);
+    if (ret < 0)
+        goto end;
+    ret = avcodec_parameters_from_context(stream->codecpar, encoder);
+    if (ret < 0)
+        goto end;
+    stream->time_base = encoder->time_base;
+
+    if (!(output->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&output->pb, tmp_path, AVIO_FLAG_WRITE);
+        if (ret < 0)
+            goto end;
+    }
+    ret = avformat_write_header(output, NULL);
+    if (ret < 0)
+        goto end;
+
+    frame->format = encoder->pix_fmt;
+    frame->width = encoder->width;
+    frame->height = encoder->height;
+    ret = av_frame_get_buffer(frame, 0);
+    if (ret < 0)
+        goto end;
+
+    for (int n = 0; n < clip->frames; n++) {
+        ret = av_frame_make_writable(frame);
+        if (ret < 0)
+            goto end;
+        fill_picture(frame, clip, n);
+        frame->pts = n;
+
+        ret = avcodec_send_frame(encoder, frame);
+        if (ret >= 0)
+            ret = write_packets(output, encoder, stream, packet);
+        if (ret < 0)
+            goto end;
+    }
+
+    // Drain the delayed frames
+    ret = avcodec_send_frame(encoder, NULL);
+    if (ret >= 0)
+        ret = write_packets(output, encoder, stream, packet);
+    if (ret >= 0)
+        ret = av_write_trailer(output);
+
+end:
+    if (output && !(output->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&output->pb);
+    avformat_free_context(output);
+    avcodec_free_context(&encoder);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+
+    if (ret >= 0 && rename(tmp_path, clip->path) < 0)
+        ret = AVERROR(errno);
+    if (ret < 0)
+        unlink(tmp_path);
+    return ret;
+}
+
+static int count_frame(const CutterImage *image, void *opaque)
+{
+    BenchRun *run = opaque;
+
+    run->frames++;
+    if (run->png_path && cutter_png_save_level(image, run->png_path, run->png_level) < 0)
+        return -1;
+    return 0;
+}
+
+// Every frame decoded and converted
+static int run_decode(CutterExtractor *ex, const ClipSpec *clip, BenchRun *run)
+{
+    (void) clip;
+    return cutter_iterate_frames(ex, count_frame, run);
+}
+
+// Seeks to the first frame of each GOP through the planner, every target is a
+// keyframe. The frames are still fully decoded, the decoder discards nothing.
+static int run_gop_start(CutterExtractor *ex, const ClipSpec *clip, BenchRun *run)
+{
+    int64_t targets[DEFAULT_FRAMES * 64];
+    size_t count = 0;
+
+    for (int n = 0; n < clip->frames && count < FF_ARRAY_ELEMS(targets); n += clip->gop_size)
+        targets[count++] = (int64_t) n * 1000 / CLIP_FPS;
+    int ret = cutter_extract_many(ex, targets, count, count_frame, run);
+    return ret < 0 ? ret : 0;
+}
+
+// Timestamps spread over the clip, mostly in the middle of a GOP
+static int run_seek(CutterExtractor *ex, const ClipSpec *clip, BenchRun *run)
+{
+    int64_t targets[SEEK_TARGETS];
+    int64_t duration_ms = (int64_t) clip->frames * 1000 / CLIP_FPS;
+
+    for (int i = 0; i < SEEK_TARGETS; i++)
+        targets[i] = duration_ms * (2 * i + 1) / (2 * SEEK_TARGETS);
+    int ret = cutter_extract_many(ex, targets, SEEK_TARGETS, count_frame, run);
+    return ret < 0 ? ret : 0;
+}
+
+// One frame out of ten through the selection engine
+static int run_every(CutterExtractor *ex, const ClipSpec *clip, BenchRun *run)
+{
+    CutterSelection *selection = NULL;
+
+    (void) clip;
+    int ret = cutter_selection_alloc(&selection);
+    if (ret < 0)
+        return ret;
+    cutter_selection_set_every(selection, 10);
+    cutter_set_selection(ex, selection);
+    ret = cutter_iterate_frames(ex, count_frame, run);
+    cutter_set_selection(ex, NULL);
+    cutter_selection_free(&selection);
+    return ret;
+}
+
+// Every frame written as a PNG file, at the zlib level of the mode
+static int run_png(CutterExtractor *ex, const ClipSpec *clip, BenchRun *run)
+{
+    (void) clip;
+    return cutter_iterate_frames(ex, count_frame, run);
+}
+
+typedef struct BenchMode {
+    const char *name;
+    int (*run)(CutterExtractor *ex, const ClipSpec *clip, BenchRun *run);
+    int writes_png;
+    int png_level;
+} BenchMode;
+
+static const BenchMode modes[] = {
+    { "decode",    run_decode,    0, -1 },
+    { "gop-start", run_gop_start, 0, -1 },
+    { "seek",      run_seek,      0, -1 },
+    { "every10",   run_every,     0, -1 },
+    { "png",       run_png,       1, -1 },
+    // Fastest and smallest deflate, the bytes_per_frame column shows the trade
+    { "png-z1",    run_png,       1, 1 },
+    { "png-z9",    run_png,       1, 9 },
+};
+
+static const char *const stage_names[] = { "demux", "decode", "convert", "encode", "write" };
+
+typedef struct BenchResult {
+    int64_t frames;
+    int64_t elapsed_ns;
+    uint64_t stage_ns[FF_ARRAY_ELEMS(stage_names)];
+    uint64_t bytes;
+} BenchResult;
+
+static int run_mode(const BenchOptions *bench, const ClipSpec *clip, const BenchMode *mode, BenchResult *best)
+{
+    char png_path[1100];
+
+    snprintf(png_path, sizeof(png_path), "%s/bench-frame.png", bench->clip_dir);
+    best->elapsed_ns = 0;
+
+    // The fastest repetition is kept, the others carry the scheduling noise
+    for (int r = 0; r < bench->repeat; r++) {
+        CutterExtractor *ex = NULL;
+        BenchRun run = { 0, mode->writes_png ? png_path : NULL, mode->png_level };
+        BenchResult result = { 0 };
+
+        cutter_metrics_reset();
+        int64_t start = now_ns();
+        int ret = cutter_open(&ex, clip->path, NULL);
+        if (ret >= 0)
+            ret = mode->run(ex, clip, &run);
+        result.elapsed_ns = now_ns() - start;
+        cutter_close(&ex);
+        if (ret < 0)
+            return ret;
+
+        result.frames = run.frames;
+        result.bytes = cutter_metrics_bytes();
+        for (size_t s = 0; s < FF_ARRAY_ELEMS(stage_names); s++) {
+            uint64_t count;
+            cutter_metrics_stage(stage_names[s], &count, &result.stage_ns[s]);
+        }
+
+        if (!best->elapsed_ns || result.elapsed_ns < best->elapsed_ns)
+            *best = result;
+    }
+
+    unlink(png_path);
+    return 0;
+}
+
+static void write_row(FILE *csv, const BenchOptions *bench, const ClipSpec *clip,
+                      const BenchMode *mode, const BenchResult *result)
+{
+    double frames = result->frames ? result->frames : 1;
+
+    fprintf(csv, "%s,%s,%d,%d,%d,%s,%s,%" PRId64 ",%.6f,%.2f",
+            bench->label, clip->codec->name, clip->width, clip->height, clip->gop_size,
+            contents[clip->motion], mode->name, result->frames, result->elapsed_ns / 1e9,
+            result->elapsed_ns ? result->frames * 1e9 / result->elapsed_ns : 0.0);
+    for (size_t s = 0; s < FF_ARRAY_ELEMS(stage_names); s++)
+        fprintf(csv, ",%.0f", result->stage_ns[s] / frames);
+    fprintf(csv, ",%.0f\n", result->bytes / frames);
+    fflush(csv);
+}
+
+static FILE *open_csv(const char *path)
+{
+    struct stat st;
+    int exists = stat(path, &st) == 0 && st.st_size > 0;
+
+    // Appended to, so the runs to compare end up side by side
+    FILE *csv = fopen(path, "a");
+    if (csv && !exists) {
+        fprintf(csv, "label,codec,width,height,gop,content,mode,frames,seconds,frames_per_s");
+        for (size_t s = 0; s < FF_ARRAY_ELEMS(stage_names); s++)
+            fprintf(csv, ",%s_ns_per_frame", stage_names[s]);
+        fprintf(csv, ",bytes_per_frame\n");
+    }
+    return csv;
+}
+
+static int parse_options(BenchOptions *bench, int argc, const char *argv[])
+{
+    bench->clip_dir = "bench/clips";
+    bench->csv_path = "bench-results.csv";
+    bench->label = "run";
+    bench->frames = DEFAULT_FRAMES;
+    bench->repeat = DEFAULT_REPEAT;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if (!strcmp(arg, "--quick")) {
+            bench->quick = 1;
+        } else if (!strcmp(arg, "--clips") && i + 1 < argc) {
+            bench->clip_dir = argv[++i];
+        } else if (!strcmp(arg, "-o") && i + 1 < argc) {
+            bench->csv_path = argv[++i];
+        } else if (!strcmp(arg, "--label") && i + 1 < argc) {
+            bench->label = argv[++i];
+        } else if (!strcmp(arg, "--frames") && i + 1 < argc) {
+            bench->frames = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--repeat") && i + 1 < argc) {
+            bench->repeat = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s [--quick] [--clips <dir>] [-o <csv>] [--label <name>]"
+                   " [--frames <n>] [--repeat <n>]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    if (bench->frames < 1 || bench->frames > DEFAULT_FRAMES * 64 || bench->repeat < 1) {
+        printf("Invalid number of frames or repetitions\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void bench_clip(const BenchOptions *bench, FILE *csv, ClipSpec *clip)
+{
+    struct stat st;
+
+    snprintf(clip->path, sizeof(clip->path), "%s/%s-%dx%d-g%d-%s-%d.%s", bench->clip_dir,
+             clip->codec->name, clip->width, clip->height, clip->gop_size, contents[clip->motion],
+             clip->frames, clip->codec->extension);
+
+    // Generated once, later runs benchmark the very same files
+    if (stat(clip->path, &st) < 0) {
+        fprintf(stderr, "Encoding %s\n", clip->path);
+        int ret = encode_clip(clip);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to encode %s: %s\n", clip->path, av_err2str(ret));
+            return;
+        }
+    }
+
+    for (size_t m = 0; m < FF_ARRAY_ELEMS(modes); m++) {
+        BenchResult result;
+
+        if (run_mode(bench, clip, &modes[m], &result) < 0) {
+            fprintf(stderr, "%s failed on %s\n", modes[m].name, clip->path);
+            continue;
+        }
+        write_row(csv, bench, clip, &modes[m], &result);
+        fprintf(stderr, "%-9s %s: %.1f frames/s\n", modes[m].name, clip->path,
+                result.elapsed_ns ? result.frames * 1e9 / result.elapsed_ns : 0.0);
+    }
+}
+
+int main(int argc, const char *argv[])
+{
+    BenchOptions bench = { 0 };
+
+    if (parse_options(&bench, argc, argv) < 0)
+        return 1;
+    if (mkdir(bench.clip_dir, 0777) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s\n", bench.clip_dir);
+        return 1;
+    }
+
+    FILE *csv = open_csv(bench.csv_path);
+    if (!csv) {
+        fprintf(stderr, "Cannot open %s\n", bench.csv_path);
+        return 1;
+    }
+
+    cutter_log_set_level(CUTTER_LOG_ERROR);
+    cutter_metrics_enable(1);
+
+    size_t nb_resolutions = bench.quick ? 2 : FF_ARRAY_ELEMS(resolutions);
+    for (size_t c = 0; c < FF_ARRAY_ELEMS(codecs); c++) {
+        if (!find_encoder(&codecs[c])) {
+            fprintf(stderr, "No %s encoder, skipping the codec\n", codecs[c].name);
+            continue;
+        }
+
+        for (size_t r = 0; r < nb_resolutions; r++) {
+            for (size_t g = 0; g < FF_ARRAY_ELEMS(gop_sizes); g++) {
+                for (int motion = 0; motion < 2; motion++) {
+                    ClipSpec clip = {
+                        .codec = &codecs[c],
+                        .width = resolutions[r][0],
+                        .height = resolutions[r][1],
+                        .gop_size = gop_sizes[g],
+                        .motion = motion,
+                        .frames = bench.frames,
+                    };
+                    bench_clip(&bench, csv, &clip);
+                }
+            }
+        }
+    }
+
+    fclose(csv);
+    return 0;
+}
@@ -0,0 +1,506 @@
+/*
+ * Microbenchmarks of the per-frame kernels of libcutter.
+ *
+ * A few frames are decoded once up front, then every kernel runs on them in
+ * a loop on a single pinned CPU, so a change to one stage can be measured
+ * without the decoder or the scheduler in the numbers:
+ *
+ *     ./build.sh bench
+ *     ./build/micro input.mp4 -o micro.csv --label before
+ *
+ * Kernels: the YUV -> RGB24 sws_scale() call configured as in the extractor,
+ * the luma kernels of the analysis stages, and the PNG encoder at every zlib
+ * level into memory and into a file. GB/s counts the bytes each kernel reads.
+ */
+
+// sched_setaffinity() and sched_getcpu()
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "libcutter/internal.h"
+
+#define DEFAULT_FRAMES 8
+// Each kernel runs at least MIN_PASSES passes and MIN_TIME_NS over all the frames
+#define MIN_PASSES 3
+#define MIN_TIME_NS 500000000
+
+typedef struct MicroOptions {
+    const char *input;
+    const char *csv_path;
+    const char *label;
+    const char *png_path;
+    int frames;
+    // CPU to pin to, -1 keeps the current one
+    int cpu;
+} MicroOptions;
+
+typedef struct MicroContext {
+    // Decoded frames, in the decoder pixel format
+    AVFrame **frames;
+    int nb_frames;
+    // Their RGB24 conversion, input of the encoder kernels
+    uint8_t **rgb;
+    int rgb_linesize;
+    int width;
+    int height;
+    int sws_flags;
+    struct SwsContext *sws_ctx;
+    uint8_t *scratch;
+    CutterThumb thumb;
+    const char *png_path;
+    // Encoded size of the first frame, reported for the PNG kernels
+    size_t output_bytes;
+} MicroContext;
+
+typedef struct Kernel {
+    const char *name;
+    int (*run)(MicroContext *ctx, int i, int level);
+    int level;
+    // Bytes read per pixel
+    double bytes_per_pixel;
+} Kernel;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Core cycles from the PMU when allowed, TSC ticks on x86 otherwise
+typedef struct CycleCounter {
+    int fd;
+    const char *source;
+} CycleCounter;
+
+static void cycles_open(CycleCounter *counter)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_hv = 1;
+
+    counter->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    counter->source = "pmu";
+    if (counter->fd < 0) {
+        // perf_event_paranoid 2 only allows user-space counting
+        attr.exclude_kernel = 1;
+        counter->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        counter->source = "pmu-user";
+    }
+    if (counter->fd < 0) {
+#if defined(__x86_64__) || defined(__i386__)
+        counter->source = "tsc";
+#else
+        counter->source = "none";
+#endif
+    }
+}
+
+static uint64_t cycles_read(const CycleCounter *counter)
+{
+    uint64_t value = 0;
+
+    if (counter->fd >= 0) {
+        if (read(counter->fd, &value, sizeof(value)) != sizeof(value))
+            return 0;
+        return value;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int pin_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+        cpu = sched_getcpu();
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        return -1;
+    return cpu;
+}
+
+static int convert(MicroContext *ctx, int i, int level)
+{
+    const AVFrame *frame = ctx->frames[i];
+    uint8_t *dst[4] = { ctx->scratch };
+    int dst_linesize[4] = { ctx->rgb_linesize };
+
+    (void) level;
+    // Same context parameters as convert_frame() in the extractor
+    ctx->sws_ctx = sws_getCachedContext(ctx->sws_ctx, frame->width, frame->height, frame->format,
+                                        frame->width, frame->height, AV_PIX_FMT_RGB24,
+                                        ctx->sws_flags, NULL, NULL, NULL);
+    if (!ctx->sws_ctx)
+        return AVERROR(EINVAL);
+    return sws_scale(ctx->sws_ctx, (const uint8_t *const *) frame->data, frame->linesize,
+                     0, frame->height, dst, dst_linesize) < 0 ? AVERROR_EXTERNAL : 0;
+}
+
+static int luma_downsample(MicroContext *ctx, int i, int level)
+{
+    const AVFrame *frame = ctx->frames[i];
+
+    (void) level;
+    return cutter_luma_downsample(frame->data[0], frame->linesize[0], frame->width, frame->height, &ctx->thumb);
+}
+
+static int luma_stats(MicroContext *ctx, int i, int level)
+{
+    const AVFrame *frame = ctx->frames[i];
+    CutterLumaStats stats;
+
+    (void) level;
+    cutter_luma_stats(frame->data[0], frame->linesize[0], frame->width, frame->height, &stats);
+    return 0;
+}
+
+static int luma_laplacian(MicroContext *ctx, int i, int level)
+{
+    const AVFrame *frame = ctx->frames[i];
+
+    (void) level;
+    cutter_luma_laplacian_variance(frame->data[0], frame->linesize[0], frame->width, frame->height);
+    return 0;
+}
+
+static int luma_sad(MicroContext *ctx, int i, int level)
+{
+    const AVFrame *a = ctx->frames[i], *b = ctx->frames[(i + 1) % ctx->nb_frames];
+
+    (void) level;
+    // Rows compared one by one, the planes may be padded
+    for (int y = 0; y < a->height; y++)
+        cutter_luma_sad(a->data[0] + (size_t) y * a->linesize[0], b->data[0] + (size_t) y * b->linesize[0], a->width);
+    return 0;
+}
+
+static void rgb_image(const MicroContext *ctx, int i, CutterImage *image)
+{
+    memset(image, 0, sizeof(*image));
+    image->data = ctx->rgb[i];
+    image->linesize = ctx->rgb_linesize;
+    image->width = ctx->width;
+    image->height = ctx->height;
+    image->requested_ms = -1;
+    image->frame_index = -1;
+}
+
+static int png_memory(MicroContext *ctx, int i, int level)
+{
+    CutterImage image;
+    uint8_t *data;
+    size_t size;
+
+    rgb_image(ctx, i, &image);
+    int ret = cutter_png_encode_buffer(&image, level, &data, &size);
+    if (ret < 0)
+        return ret;
+    if (!ctx->output_bytes)
+        ctx->output_bytes = size;
+    free(data);
+    return 0;
+}
+
+static int png_file(MicroContext *ctx, int i, int level)
+{
+    CutterImage image;
+    struct stat st;
+
+    rgb_image(ctx, i, &image);
+    int ret = cutter_png_save_level(&image, ctx->png_path, level);
+    if (ret < 0)
+        return ret;
+    // Only once, the stat() would be timed with the kernel
+    if (!ctx->output_bytes && stat(ctx->png_path, &st) == 0)
+        ctx->output_bytes = st.st_size;
+    return 0;
+}
+
+static const Kernel kernels[] = {
+    { "sws_scale",       convert,         0, 1.5 },
+    { "luma_downsample", luma_downsample, 0, 1.0 },
+    { "luma_stats",      luma_stats,      0, 1.0 },
+    { "luma_laplacian",  luma_laplacian,  0, 1.0 },
+    { "luma_sad",        luma_sad,        0, 2.0 },
+};
+
+// Decode the first frames of the input, kept in their native pixel format
+static int decode_frames(MicroContext *ctx, const MicroOptions *options)
+{
+    AVFormatContext *format_context = NULL;
+    AVCodecContext *codec_context = NULL;
+    AVCodec *codec = NULL;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int ret;
+
+    ctx->frames = calloc(options->frames, sizeof(*ctx->frames));
+    if (!packet || !frame || !ctx->frames) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    ret = avformat_open_input(&format_context, options->input, NULL, NULL);
+    if (ret < 0)
+        goto end;
+    ret = avformat_find_stream_info(format_context, NULL);
+    if (ret < 0)
+        goto end;
+    int stream_index = ret = av_find_best_stream(format_context, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (ret < 0)
+        goto end;
+
+    codec_context = avcodec_alloc_context3(codec);
+    if (!codec_context) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ret = avcodec_parameters_to_context(codec_context, format_context->streams[stream_index]->codecpar);
+    if (ret >= 0)
+        ret = avcodec_open2(codec_context, codec, NULL);
+    if (ret < 0)
+        goto end;
+
+    while (ctx->nb_frames < options->frames) {
+        int eof = av_read_frame(format_context, packet) < 0;
+
+        if (!eof && packet->stream_index != stream_index) {
+            av_packet_unref(packet);
+            continue;
+        }
+        ret = avcodec_send_packet(codec_context, eof ? NULL : packet);
+        av_packet_unref(packet);
+        if (ret < 0)
+            goto end;
+
+        while (ctx->nb_frames < options->frames && avcodec_receive_frame(codec_context, frame) >= 0) {
+            ctx->frames[ctx->nb_frames] = av_frame_clone(frame);
+            av_frame_unref(frame);
+            if (!ctx->frames[ctx->nb_frames]) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            ctx->nb_frames++;
+        }
+        if (eof)
+            break;
+    }
+    ret = ctx->nb_frames ? 0 : AVERROR_INVALIDDATA;
+
+end:
+    avcodec_free_context(&codec_context);
+    avformat_close_input(&format_context);
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    return ret;
+}
+
+// The encoder kernels all start from the same RGB24 pictures
+static int prepare_rgb(MicroContext *ctx)
+{
+    ctx->width = ctx->frames[0]->width;
+    ctx->height = ctx->frames[0]->height;
+    ctx->rgb_linesize = FFALIGN(ctx->width * 3, 64);
+
+    ctx->scratch = av_malloc((size_t) ctx->rgb_linesize * ctx->height);
+    ctx->rgb = calloc(ctx->nb_frames, sizeof(*ctx->rgb));
+    if (!ctx->scratch || !ctx->rgb)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < ctx->nb_frames; i++) {
+        ctx->rgb[i] = av_malloc((size_t) ctx->rgb_linesize * ctx->height);
+        if (!ctx->rgb[i])
+            return AVERROR(ENOMEM);
+        int ret = convert(ctx, i, 0);
+        if (ret < 0)
+            return ret;
+        memcpy(ctx->rgb[i], ctx->scratch, (size_t) ctx->rgb_linesize * ctx->height);
+    }
+    return 0;
+}
+
+static int run_kernel(MicroContext *ctx, const MicroOptions *options, const Kernel *kernel,
+                      const CycleCounter *counter, FILE *csv)
+{
+    int64_t best_ns = 0, total_ns = 0;
+    uint64_t best_cycles = 0;
+    int ret;
+
+    // Warm-up pass, fills the caches and the lazily allocated state
+    for (int i = 0; i < ctx->nb_frames; i++) {
+        ret = kernel->run(ctx, i, kernel->level);
+        if (ret < 0)
+            return ret;
+    }
+
+    for (int pass = 0; pass < MIN_PASSES || total_ns < MIN_TIME_NS; pass++) {
+        uint64_t cycles = cycles_read(counter);
+        int64_t start = now_ns();
+
+        for (int i = 0; i < ctx->nb_frames; i++) {
+            ret = kernel->run(ctx, i, kernel->level);
+            if (ret < 0)
+                return ret;
+        }
+
+        int64_t elapsed = now_ns() - start;
+        cycles = cycles_read(counter) - cycles;
+        total_ns += elapsed;
+        // The fastest pass is the least disturbed one
+        if (!best_ns || elapsed < best_ns) {
+            best_ns = elapsed;
+            best_cycles = cycles;
+        }
+    }
+
+    double pixels = (double) ctx->width * ctx->height * ctx->nb_frames;
+    double ns_per_frame = (double) best_ns / ctx->nb_frames;
+    double cycles_per_pixel = best_cycles / pixels;
+    double gb_per_s = kernel->bytes_per_pixel * pixels / best_ns;
+
+    fprintf(stderr, "%-20s %12.0f ns/frame %8.2f cycles/pixel %8.3f GB/s\n",
+            kernel->name, ns_per_frame, cycles_per_pixel, gb_per_s);
+    fprintf(csv, "%s,%s,%d,%d,%d,%.0f,%.3f,%.3f,%zu,%s\n", options->label, kernel->name,
+            ctx->width, ctx->height, ctx->nb_frames, ns_per_frame, cycles_per_pixel, gb_per_s,
+            ctx->output_bytes, counter->source);
+    fflush(csv);
+    ctx->output_bytes = 0;
+    return 0;
+}
+
+static int parse_options(MicroOptions *options, int argc, const char *argv[])
+{
+    options->input = "input.mp4";
+    options->csv_path = "bench-micro.csv";
+    options->label = "run";
+    options->png_path = "bench-micro.png";
+    options->frames = DEFAULT_FRAMES;
+    options->cpu = -1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if (!strcmp(arg, "-o") && i + 1 < argc) {
+            options->csv_path = argv[++i];
+        } else if (!strcmp(arg, "--label") && i + 1 < argc) {
+            options->label = argv[++i];
+        } else if (!strcmp(arg, "--png") && i + 1 < argc) {
+            options->png_path = argv[++i];
+        } else if (!strcmp(arg, "--frames") && i + 1 < argc) {
+            options->frames = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--cpu") && i + 1 < argc) {
+            options->cpu = atoi(argv[++i]);
+        } else if (arg[0] == '-') {
+            printf("Usage: %s [<media file>] [-o <csv>] [--label <name>] [--png <path>]"
+                   " [--frames <n>] [--cpu <n>]\n", argv[0]);
+            return -1;
+        } else {
+            options->input = arg;
+        }
+    }
+
+    if (options->frames < 1) {
+        printf("Invalid number of frames\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, const char *argv[])
+{
+    MicroOptions options;
+    MicroContext ctx = { 0 };
+    CutterOptions defaults;
+    CycleCounter counter;
+    struct stat st;
+    int ret;
+
+    if (parse_options(&options, argc, argv) < 0)
+        return 1;
+
+    cutter_log_set_level(CUTTER_LOG_ERROR);
+    cutter_options_default(&defaults);
+    ctx.sws_flags = defaults.sws_flags;
+    ctx.png_path = options.png_path;
+
+    ret = decode_frames(&ctx, &options);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot decode %s: %s\n", options.input, av_err2str(ret));
+        return 1;
+    }
+    ret = prepare_rgb(&ctx);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot convert the frames: %s\n", av_err2str(ret));
+        return 1;
+    }
+    if (!cutter_luma_supported(ctx.frames[0]))
+        fprintf(stderr, "The luma kernels do not support this pixel format, skipping them\n");
+
+    int cpu = pin_cpu(options.cpu);
+    if (cpu < 0)
+        fprintf(stderr, "Cannot pin the CPU, the results will be noisier\n");
+    cycles_open(&counter);
+    fprintf(stderr, "%s: %d frames of %dx%d, CPU %d, cycles from %s\n",
+            options.input, ctx.nb_frames, ctx.width, ctx.height, cpu, counter.source);
+
+    int exists = stat(options.csv_path, &st) == 0 && st.st_size > 0;
+    FILE *csv = fopen(options.csv_path, "a");
+    if (!csv) {
+        fprintf(stderr, "Cannot open %s\n", options.csv_path);
+        return 1;
+    }
+    if (!exists)
+        fprintf(csv, "label,kernel,width,height,frames,ns_per_frame,cycles_per_pixel,gb_per_s,"
+                     "output_bytes,cycles_source\n");
+
+    for (size_t k = 0; k < FF_ARRAY_ELEMS(kernels) && ret >= 0; k++) {
+        if (kernels[k].run != convert && !cutter_luma_supported(ctx.frames[0]))
+            continue;
+        ret = run_kernel(&ctx, &options, &kernels[k], &counter, csv);
+    }
+
+    // Memory sink against file sink at each zlib level, the difference is the filesystem
+    for (int level = 0; level <= 9 && ret >= 0; level++) {
+        char memory_name[32], file_name[32];
+        Kernel memory = { memory_name, png_memory, level, 3.0 };
+        Kernel file = { file_name, png_file, level, 3.0 };
+
+        snprintf(memory_name, sizeof(memory_name), "png_memory_%d", level);
+        snprintf(file_name, sizeof(file_name), "png_file_%d", level);
+        ret = run_kernel(&ctx, &options, &memory, &counter, csv);
+        if (ret >= 0)
+            ret = run_kernel(&ctx, &options, &file, &counter, csv);
+    }
+    if (ret < 0)
+        fprintf(stderr, "Kernel failed: %s\n", av_err2str(ret));
+
+    fclose(csv);
+    unlink(options.png_path);
+    return ret < 0;
+}
@@ -1 +1,27 @@
-/usr/bin/cc -v cutter.c -o cutter -L/usr/local/ffmpeg/lib -Wl,-rpath,/usr/local/ffmpeg/lib -lavcodec -lavformat -lavutil -lswscale -lpng 
+#!/bin/sh
+# Build libcutter as a static library and link the command line tool against it
+
+set -e
+
+FFMPEG_LIBS="-L/usr/local/ffmpeg/lib -Wl,-rpath,/usr/local/ffmpeg/lib -lavcodec -lavformat -lavutil -lswscale -lpng -lm -lpthread"
+
+mkdir -p build
+for src in libcutter/*.c; do
+    /usr/bin/cc -c "$src" -I. -o "build/$(basename "${src%.c}").o"
+done
+ar rcs build/libcutter.a build/*.o
+
+/usr/bin/cc -v cutter.c -o cutter -I. build/libcutter.a $FFMPEG_LIBS
+
+# ./build.sh bench also builds the benchmarks, see bench/bench.c and bench/micro.c
+if [ "$1" = "bench" ]; then
+    /usr/bin/cc bench/bench.c -o build/bench -I. build/libcutter.a $FFMPEG_LIBS
+    /usr/bin/cc bench/micro.c -o build/micro -I. build/libcutter.a $FFMPEG_LIBS
+fi
+
+# ./build.sh test runs the end to end checks of tests/ on input.mp4
+if [ "$1" = "test" ]; then
+    for test in tests/*.sh; do
+        sh "$test"
+    done
+fi
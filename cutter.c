@@ -1,14 +1,8 @@
 /*
- * http://ffmpeg.org/doxygen/trunk/index.html
+ * Command line front-end of libcutter.
  *
- * Main components
- *
- * Format (Container) - a wrapper, providing sync, metadata and muxing for the streams.
- * Stream - a continuous stream (audio or video) of data over time.
- * Codec - defines how data are enCOded (from Frame to Packet)
- *        and DECoded (from Packet to Frame).
- * Packet - are the data (kind of slices of the stream data) to be decoded as raw frames.
- * Frame - a decoded raw frame (to be encoded or filtered).
+ * Extracts frames of a media file into output/frame-N.png, or the files
+ * named by --output
  */
 
 #include <stdio.h>
@@ -16,352 +10,1026 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
 
-#include <libavcodec/avcodec.h>
-#include <libavformat/avformat.h>
-#include <libswscale/swscale.h>
-
-// Required to create the PNG files
-#include <png.h>
+#include "libcutter/cutter.h"
 
 // Print out the steps and errors
 static void logging(const char *fmt, ...);
-// Decode packets into frames
-static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext, AVFrame *pFrame);
-// Save a frame into a .png file
-static int save_frame_to_png(AVFrame *frame, const char *filename);
+// Save every delivered frame into a .png file
+static int save_frame(const CutterImage *image, void *opaque);
+// Completion of a file of the async sink
+static void output_written(void *opaque, const char *filename, int ret);
+// A file renamed into place by the publisher
+static void output_published(void *opaque, const char *filename, int ret);
 
 // Number of images to create
 #define IMAGES_TOTAL 10
 
-int main(int argc, const char *argv[])
+// Maximum number of --at timestamps
+#define MAX_TIMESTAMPS 1024
+
+// Names of the outputs, see cutter_path_template_parse()
+#define DEFAULT_OUTPUT "output/frame-{n}.png"
+
+// Frames between two keyframes of --sequence, the longest delta chain a read decodes
+#define SEQUENCE_KEYFRAME_INTERVAL 30
+
+// Checkpoints of the iterate mode, read back by --resume,
+// kept in the directory holding the outputs
+#define MANIFEST_NAME "manifest.txt"
+
+typedef struct CliOptions {
+    const char *input;
+    CutterOptions options;
+    // Only write the keyframe index sidecar and exit
+    int build_index;
+    // Sidecar to load, NULL tries <input>.cutidx
+    const char *index_path;
+    // Explicit timestamps to extract, in milliseconds
+    int64_t timestamps[MAX_TIMESTAMPS];
+    int nb_timestamps;
+    // Only write the best of this many candidates, 0 disables the picker
+    int best_candidates;
+    // Write one sprite sheet of columns x rows tiles instead of one file per frame
+    int mosaic_columns;
+    int mosaic_rows;
+    int mosaic_tile_width;
+    // Budget of the frame cache in bytes, 0 disables it
+    size_t cache_bytes;
+    // Directory of the on-disk output cache, NULL disables it
+    const char *cache_dir;
+    // Record the completed outputs in the manifest, for a later --resume
+    int checkpoint;
+    // Continue after the last output recorded in the manifest
+    int resume;
+    // Print the stage metrics as JSON on stdout at exit
+    int metrics;
+    // Chrome trace-event file of the stage timeline, NULL disables it
+    const char *trace_path;
+    // Write every output into this tar file ("-" for stdout) instead of output/
+    const char *tar_path;
+    // Write the outputs as the frames of this animated PNG instead
+    const char *apng_path;
+    // Or into this frame sequence, with a keyframe every sequence_interval frames
+    const char *sequence_path;
+    int sequence_interval;
+    // Template of the output names and their spreading over sub-directories
+    const char *output_template;
+    CutterFanout fanout;
+    int fanout_size;
+    // Write the files in the background instead of from the extracting thread
+    int async_io;
+    // Write the files under temporary names and rename them, -1 writes them in place
+    int sync_mode;
+    int sync_batch;
+    // -q, -v and -vv around the default CUTTER_LOG_INFO
+    CutterLogLevel log_level;
+    // Only extract slice shard of nb_shards, nb_shards 0 extracts everything
+    int shard;
+    int nb_shards;
+    // Frame selection of the iterate mode, NULL keeps the first IMAGES_TOTAL frames
+    CutterSelection *selection;
+} CliOptions;
+
+enum OutputState {
+    OUTPUT_WRITING,
+    // Written under its temporary name, waiting for the publisher
+    OUTPUT_WRITTEN,
+    OUTPUT_COMPLETE,
+};
+
+// Output handed to the async sink or the publisher, recorded once its file is complete
+typedef struct QueuedOutput {
+    int number;
+    int64_t pts;
+    int64_t requested_ms;
+    char *filename;
+    enum OutputState state;
+    // Linked from the output cache, not to be stored back
+    int cached;
+} QueuedOutput;
+
+typedef struct SaveContext {
+    int saved;
+    // Stop after this many images, 0 means no limit
+    int limit;
+    // Outputs of earlier runs, NULL if none
+    CutterOutputCache *output_cache;
+    // Completed outputs of the iterate mode, NULL if none
+    CutterManifest *manifest;
+    // Names of the outputs
+    CutterPathTemplate *paths;
+    // Tar stream receiving the outputs, NULL to write them as files
+    CutterSink *archive;
+    // Animated PNG receiving the outputs as its frames, NULL if none
+    CutterApng *animation;
+    // Frame sequence receiving them, NULL if none
+    CutterSequenceWriter *sequence;
+    // Background writer of the files, NULL to write them synchronously
+    CutterSink *async;
+    // Renames the files into place, NULL to write them under their final name
+    CutterPublisher *publisher;
+    // Outputs queued on them in output order, [done, count) are not recorded yet
+    QueuedOutput *queued;
+    int nb_queued;
+    int queued_done;
+    int queued_allocated;
+    int write_error;
+    // Number the outputs after their position in the stream
+    int by_frame_index;
+    // Sorted --at timestamps left to decode and the output number of each
+    const int64_t *pending;
+    const int *numbers;
+    int nb_pending;
+    int cursor;
+} SaveContext;
+
+static void usage(const char *program)
 {
-    if (argc < 2) {
-        printf("You need to specify a media file.\n");
-        return -1;
+    printf("Usage: %s [options] <media file>\n"
+           "  -q, -v, -vv          only log errors, log every output, log every packet and frame\n"
+           "  --fast-probe         trust the container header instead of probing the streams\n"
+           "  --build-index        walk the packets once and write <media file>.cutidx\n"
+           "  --index <path>       keyframe index to use instead of <media file>.cutidx\n"
+           "  --at <ms>[,<ms>...]  extract the frames displayed at these timestamps\n"
+           "  --cache <MiB>        keep decoded frames and their PNG in memory for repeated timestamps\n"
+           "  --cache-dir <dir>    link the outputs of earlier runs from this directory and store the new ones\n"
+           "  --checkpoint         record each output and its checksum in " MANIFEST_NAME " next to the outputs,\n"
+           "                       manifest-<i>-of-<n>.txt with --shard\n"
+           "  --resume             continue an interrupted --checkpoint extraction, given the same\n"
+           "                       --output and --shard, from its manifest\n"
+           "  --shard <i>/<n>      only extract slice i (0-based) of n, outputs are numbered by frame\n"
+           "  --metrics=json       print per-stage timings, throughput and peak RSS at exit\n"
+           "  -o, --output <template>  name the outputs after {stem}, {n}, {n:06}, {pts}, {ts_ms}, {w} and {h},\n"
+           "                       default " DEFAULT_OUTPUT "\n"
+           "  --fanout <n>         spread the outputs over sub-directories of n files each\n"
+           "  --fanout hash:<n>    spread the outputs over n sub-directories by the hash of their name\n"
+           "  --tar <file>         write the PNG images into one tar file, - for stdout\n"
+           "  --apng <file>        write the frames into one animated PNG, storing only what changed\n"
+           "  --sequence <file>    store the frames losslessly in one indexed file (.cutseq)\n"
+           "  --keyframes <n>      keyframe interval of --sequence, default 30\n"
+           "  --async-io           write the PNG files in the background (io_uring or threads)\n"
+           "  --sync=<mode>        write the PNG files aside and rename them, then sync them:\n"
+           "                       none, end (once at exit) or batch:<n> (every n files, before renaming)\n"
+           "  --trace <file>       write the stage timeline in Chrome trace-event format (Perfetto)\n"
+           "  --best <k>           score k candidates spread over the file and keep the best one\n"
+           "  --mosaic <c>x<r>[,<w>]  write one sprite sheet of c x r tiles w pixels wide (160) with a\n"
+           "                       WebVTT and a JSON map, at the --at timestamps or spread over the file\n"
+           "  --every <n>          keep one frame out of every n\n"
+           "  --fps <rate>         resample the frames to this rate\n"
+           "  --range <ms>-<ms>    keep the frames displayed in this range, may be repeated\n"
+           "  --frames <list>      keep these frame numbers, comma separated or @file\n"
+           "  --scene <threshold>  only keep the first frame of each shot (0-1, try 0.1)\n"
+           "  --skip-blank <mean>[,<range>]  skip frames darker or flatter than these luma limits\n"
+           "  --dedupe <bits>      drop frames less than this many hash bits away from the last kept one (1-64)\n",
+           program);
+}
+
+static int output_filename(SaveContext *save, int number, const CutterImage *image, char *filename, size_t size)
+{
+    int ret = cutter_path_format(save->paths, number, image, filename, size);
+    if (ret < 0)
+        return ret;
+    // The members of an archive need no directory
+    return save->archive ? 0 : cutter_path_mkdir(save->paths, filename);
+}
+
+// Deepest directory holding every output of the template, and how many levels
+// of sub-directories below it the fields and the fan-out may add
+static int output_root(const char *template, char *root, size_t size)
+{
+    size_t fixed = strcspn(template, "{");
+    size_t length = 0;
+    int depth = 0;
+
+    for (size_t i = 0; i < fixed; i++) {
+        if (template[i] == '/')
+            length = i + 1;
     }
+    for (const char *p = template + length; *p; p++)
+        depth += *p == '/';
 
-    logging("*** Initializing all the containers, codecs and protocols...");
+    if (!length)
+        snprintf(root, size, ".");
+    else
+        snprintf(root, size, "%.*s", length > 1 ? (int) length - 1 : 1, template);
+    return depth;
+}
+
+static int compare_timestamps(const void *a, const void *b)
+{
+    int64_t ta = *(const int64_t *) a, tb = *(const int64_t *) b;
+
+    return (ta > tb) - (ta < tb);
+}
+
+static int parse_timestamps(CliOptions *cli, const char *list)
+{
+    char *end;
 
-    // AVFormatContext holds the header information from the format (Container)
-    // Allocating memory for this component
-    // http://ffmpeg.org/doxygen/trunk/structAVFormatContext.html
-    AVFormatContext *format_context = avformat_alloc_context();
-    if (!format_context) {
-        logging("ERROR could not allocate memory for Format Context");
+    while (*list) {
+        if (cli->nb_timestamps == MAX_TIMESTAMPS)
+            return -1;
+        cli->timestamps[cli->nb_timestamps++] = strtoll(list, &end, 10);
+        if (end == list || (*end && *end != ','))
+            return -1;
+        list = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Frame numbers separated by commas or white space, read from a file with @path
+static int parse_frames(CutterSelection *selection, const char *list)
+{
+    int64_t frame;
+    int ret = 0;
+
+    if (list[0] == '@') {
+        FILE *fp = fopen(list + 1, "r");
+        if (!fp)
+            return -1;
+        while (ret >= 0 && fscanf(fp, " %" SCNd64 " ,", &frame) == 1)
+            ret = cutter_selection_add_frames(selection, &frame, 1);
+        if (!feof(fp))
+            ret = -1;
+        fclose(fp);
+        return ret;
+    }
+
+    char *end;
+    while (*list && ret >= 0) {
+        frame = strtoll(list, &end, 10);
+        if (end == list || (*end && *end != ','))
+            return -1;
+        ret = cutter_selection_add_frames(selection, &frame, 1);
+        list = *end ? end + 1 : end;
+    }
+    return ret;
+}
+
+static int parse_selection(CliOptions *cli, const char *option, const char *value)
+{
+    long long start, end;
+    int consumed = 0;
+
+    if (!cli->selection && cutter_selection_alloc(&cli->selection) < 0)
         return -1;
+
+    if (!strcmp(option, "--every"))
+        return cutter_selection_set_every(cli->selection, atoi(value));
+    if (!strcmp(option, "--fps"))
+        return cutter_selection_set_fps(cli->selection, atof(value));
+    if (!strcmp(option, "--range")) {
+        if (sscanf(value, "%lld-%lld%n", &start, &end, &consumed) != 2 || value[consumed])
+            return -1;
+        return cutter_selection_add_range(cli->selection, start, end);
     }
+    return parse_frames(cli->selection, value);
+}
+
+// <c>x<r>[,<w>], at most 1024 columns and rows, the library rejects atlases too large
+static int parse_mosaic(CliOptions *cli, const char *value)
+{
+    char *end;
+    long columns = strtol(value, &end, 10), rows = 0, width = 0;
 
-    logging("*** Opening the input file (%s) and loading format (container) header", argv[1]);
-    // Open the file and read its header. The codecs are not opened.
-    // The function arguments are:
-    // AVFormatContext (the component we allocated memory for),
-    // url (filename),
-    // AVInputFormat (if you pass NULL it'll do the auto detect)
-    // and AVDictionary (which are options to the demuxer)
-    // http://ffmpeg.org/doxygen/trunk/group__lavf__decoding.html
-    if (avformat_open_input(&format_context, argv[1], NULL, NULL) != 0) {
-        logging("ERROR could not open the file");
+    if (end != value && *end == 'x') {
+        const char *p = end + 1;
+        rows = strtol(p, &end, 10);
+        if (end == p)
+            return -1;
+    }
+    if (*end == ',') {
+        const char *p = end + 1;
+        width = strtol(p, &end, 10);
+        if (end == p || width < 1 || width > INT_MAX)
+            return -1;
+    }
+    if (*end || columns < 1 || columns > 1024 || rows < 1 || rows > 1024)
         return -1;
+
+    cli->mosaic_columns = columns;
+    cli->mosaic_rows = rows;
+    cli->mosaic_tile_width = width;
+    return 0;
+}
+
+static int parse_options(CliOptions *cli, int argc, const char *argv[])
+{
+    memset(cli, 0, sizeof(*cli));
+    cutter_options_default(&cli->options);
+    cli->sync_mode = -1;
+    cli->sequence_interval = SEQUENCE_KEYFRAME_INTERVAL;
+    cli->output_template = DEFAULT_OUTPUT;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if (!strcmp(arg, "-q")) {
+            cli->log_level = CUTTER_LOG_ERROR;
+        } else if (!strcmp(arg, "-v")) {
+            cli->log_level = CUTTER_LOG_VERBOSE;
+        } else if (!strcmp(arg, "-vv")) {
+            cli->log_level = CUTTER_LOG_DEBUG;
+        } else if (!strcmp(arg, "--fast-probe")) {
+            cli->options.fast_probe = 1;
+        } else if (!strcmp(arg, "--scene") && i + 1 < argc) {
+            char *end;
+            // A mean absolute difference relative to full scale, 1 is the largest possible
+            cli->options.scene_threshold = strtod(argv[++i], &end);
+            if (end == argv[i] || *end || !(cli->options.scene_threshold > 0 && cli->options.scene_threshold <= 1)) {
+                printf("Invalid scene threshold: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(arg, "--skip-blank") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d", &cli->options.blank_mean, &cli->options.blank_range) < 1) {
+                printf("Invalid blank limits: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(arg, "--dedupe") && i + 1 < argc) {
+            char *end;
+            // Hamming distance between two 64-bit hashes
+            long distance = strtol(argv[++i], &end, 10);
+            if (end == argv[i] || *end || distance < 1 || distance > 64) {
+                printf("Invalid dedupe distance: %s\n", argv[i]);
+                return -1;
+            }
+            cli->options.dedupe_distance = distance;
+        } else if (!strcmp(arg, "--best") && i + 1 < argc) {
+            cli->best_candidates = atoi(argv[++i]);
+            if (cli->best_candidates < 1) {
+                printf("Invalid number of candidates: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(arg, "--mosaic") && i + 1 < argc) {
+            if (parse_mosaic(cli, argv[++i]) < 0) {
+                printf("Invalid mosaic: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(arg, "--cache") && i + 1 < argc) {
+            char *end;
+            long mib = strtol(argv[++i], &end, 10);
+            if (end == argv[i] || *end || mib < 0 || (unsigned long) mib > SIZE_MAX >> 20) {
+                printf("Invalid cache size: %s\n", argv[i]);
+                return -1;
+            }
+            cli->cache_bytes = (size_t) mib << 20;
+        } else if (!strcmp(arg, "--cache-dir") && i + 1 < argc) {
+            cli->cache_dir = argv[++i];
+        } else if (!strcmp(arg, "--metrics=json")) {
+            cli->metrics = 1;
+        } else if ((!strcmp(arg, "-o") || !strcmp(arg, "--output")) && i + 1 < argc) {
+            cli->output_template = argv[++i];
+        } else if (!strcmp(arg, "--fanout") && i + 1 < argc) {
+            const char *value = argv[++i];
+            cli->fanout = strncmp(value, "hash:", 5) ? CUTTER_FANOUT_NUMERIC : CUTTER_FANOUT_HASHED;
+            cli->fanout_size = atoi(cli->fanout == CUTTER_FANOUT_HASHED ? value + 5 : value);
+            if (cli->fanout_size < 1) {
+                printf("Invalid fan-out: %s\n", value);
+                return -1;
+            }
+        } else if (!strcmp(arg, "--tar") && i + 1 < argc) {
+            cli->tar_path = argv[++i];
+        } else if (!strcmp(arg, "--apng") && i + 1 < argc) {
+            cli->apng_path = argv[++i];
+        } else if (!strcmp(arg, "--sequence") && i + 1 < argc) {
+            cli->sequence_path = argv[++i];
+        } else if (!strcmp(arg, "--keyframes") && i + 1 < argc) {
+            cli->sequence_interval = atoi(argv[++i]);
+            if (cli->sequence_interval < 1) {
+                printf("Invalid keyframe interval: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (!strncmp(arg, "--sync=", 7)) {
+            const char *mode = arg + 7;
+            int consumed = 0;
+            if (!strcmp(mode, "none")) {
+                cli->sync_mode = CUTTER_SYNC_NONE;
+            } else if (!strcmp(mode, "end")) {
+                cli->sync_mode = CUTTER_SYNC_END;
+            } else if (sscanf(mode, "batch:%d%n", &cli->sync_batch, &consumed) == 1 && !mode[consumed] &&
+                       cli->sync_batch > 0) {
+                cli->sync_mode = CUTTER_SYNC_BATCH;
+            } else {
+                printf("Invalid sync mode: %s\n", mode);
+                return -1;
+            }
+        } else if (!strcmp(arg, "--async-io")) {
+            cli->async_io = 1;
+        } else if (!strcmp(arg, "--trace") && i + 1 < argc) {
+            cli->trace_path = argv[++i];
+        } else if (!strcmp(arg, "--checkpoint")) {
+            cli->checkpoint = 1;
+        } else if (!strcmp(arg, "--resume")) {
+            cli->resume = 1;
+        } else if (!strcmp(arg, "--shard") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d/%d", &cli->shard, &cli->nb_shards) != 2 ||
+                cli->nb_shards < 1 || cli->shard < 0 || cli->shard >= cli->nb_shards) {
+                printf("Invalid shard: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(arg, "--build-index")) {
+            cli->build_index = 1;
+        } else if (!strcmp(arg, "--index") && i + 1 < argc) {
+            cli->index_path = argv[++i];
+        } else if (!strcmp(arg, "--at") && i + 1 < argc) {
+            if (parse_timestamps(cli, argv[++i]) < 0) {
+                printf("Invalid timestamp list: %s\n", argv[i]);
+                return -1;
+            }
+        } else if ((!strcmp(arg, "--every") || !strcmp(arg, "--fps") ||
+                    !strcmp(arg, "--range") || !strcmp(arg, "--frames")) && i + 1 < argc) {
+            if (parse_selection(cli, arg, argv[i + 1]) < 0) {
+                printf("Invalid value for %s: %s\n", arg, argv[i + 1]);
+                return -1;
+            }
+            i++;
+        } else if (arg[0] == '-' && arg[1] == '-') {
+            printf("Unknown option: %s\n", arg);
+            return -1;
+        } else {
+            cli->input = arg;
+        }
     }
 
-    // now we have access to some information about our file
-    // since we read its header we can say what format (container) it's
-    // and some other information related to the format itself.
-    logging("*** Format: %s, Duration: %lld us, Bitrate: %lld", format_context->iformat->name, format_context->duration, format_context->bit_rate);
-
-    logging("*** Finding stream info from format...");
-    // read Packets from the Format to get stream information
-    // this function populates pFormatContext->streams
-    // (of size equals to pFormatContext->nb_streams)
-    // the arguments are:
-    // the AVFormatContext
-    // and options contains options for codec corresponding to i-th stream.
-    // On return each dictionary will be filled with options that were not found.
-    // https://ffmpeg.org/doxygen/trunk/group__lavf__decoding.html
-    if (avformat_find_stream_info(format_context,  NULL) < 0) {
-        logging("ERROR could not get the stream info");
+    if (!cli->input) {
+        printf("You need to specify a media file.\n");
+        return -1;
+    }
+    if (cli->tar_path && (cli->resume || cli->cache_dir)) {
+        printf("--tar cannot be combined with --resume nor --cache-dir.\n");
+        return -1;
+    }
+    if (cli->tar_path && (cli->async_io || cli->sync_mode >= 0)) {
+        printf("--tar cannot be combined with --async-io nor --sync.\n");
+        return -1;
+    }
+    if (cli->mosaic_columns && (cli->tar_path || cli->best_candidates || cli->async_io || cli->sync_mode >= 0)) {
+        printf("--mosaic cannot be combined with --tar, --best, --async-io nor --sync.\n");
+        return -1;
+    }
+    if ((cli->apng_path || cli->sequence_path) &&
+        (cli->tar_path || cli->mosaic_columns || cli->resume || cli->cache_dir || cli->async_io ||
+         cli->sync_mode >= 0 || (cli->apng_path && cli->sequence_path))) {
+        printf("--apng and --sequence cannot be combined with each other, --tar, --mosaic, --resume,\n"
+               "--cache-dir, --async-io nor --sync.\n");
         return -1;
     }
+    if (cli->tar_path && !strcmp(cli->tar_path, "-") && cli->metrics) {
+        printf("--tar - and --metrics=json both write to stdout.\n");
+        return -1;
+    }
+    return 0;
+}
 
-    // The component that knows how to enCOde and DECode the stream
-    // it's the codec (audio or video)
-    // http://ffmpeg.org/doxygen/trunk/structAVCodec.html
-    AVCodec *input_codec = NULL;
-    // this component describes the properties of a codec used by the stream i
-    // https://ffmpeg.org/doxygen/trunk/structAVCodecParameters.html
-    AVCodecParameters *input_codec_parameters =  NULL;
-    int video_stream_index = -1;
-
-    // Loop though all the streams and print its main information
-    for (int i = 0; i < format_context->nb_streams; i++) {
-        AVCodecParameters *local_codec_parameters = NULL;
-        local_codec_parameters = format_context->streams[i]->codecpar;
-        logging("    AVStream->time_base before open coded %d/%d", format_context->streams[i]->time_base.num, format_context->streams[i]->time_base.den);
-        logging("    AVStream->r_frame_rate before open coded %d/%d", format_context->streams[i]->r_frame_rate.num, format_context->streams[i]->r_frame_rate.den);
-        logging("    AVStream->start_time %" PRId64, format_context->streams[i]->start_time);
-        logging("    AVStream->duration %" PRId64, format_context->streams[i]->duration);
-
-        logging("Finding the proper decoder (CODEC)");
-        logging("---");
-
-        AVCodec *local_codec = NULL;
-
-        // Finds the registered decoder for a codec ID
-        // https://ffmpeg.org/doxygen/trunk/group__lavc__decoding.html
-        local_codec = avcodec_find_decoder(local_codec_parameters->codec_id);
-
-        if (local_codec==NULL) {
-            logging("ERROR unsupported codec!");
-            // In this example if the codec is not found we just skip it
-            continue;
-        }
+// Outputs are numbered after the sorted timestamps, whether they come from the cache or the decoder
+static int extract_timestamps(CutterExtractor *extractor, CliOptions *cli, SaveContext *save)
+{
+    static int64_t pending[MAX_TIMESTAMPS];
+    static int numbers[MAX_TIMESTAMPS];
+    char filename[1024];
+    int nb_pending = 0;
+    CutterProbe probe;
 
-        // When the stream is a video we store its index, codec parameters and codec
-        if (local_codec_parameters->codec_type == AVMEDIA_TYPE_VIDEO) {
-            if (video_stream_index == -1) {
-                video_stream_index = i;
-                input_codec = local_codec;
-                input_codec_parameters = local_codec_parameters;
-            }
+    // Names with the timestamps of the frames are only known once they are decoded
+    int prefetch = save->output_cache && !cutter_path_template_frame_dependent(save->paths);
+    cutter_probe(extractor, &probe);
 
-            logging("Video Codec: resolution %d x %d", local_codec_parameters->width, local_codec_parameters->height);
-        } else if (local_codec_parameters->codec_type == AVMEDIA_TYPE_AUDIO) {
-            logging("Audio Codec: %d channels, sample rate %d", local_codec_parameters->channels, local_codec_parameters->sample_rate);
+    qsort(cli->timestamps, cli->nb_timestamps, sizeof(*cli->timestamps), compare_timestamps);
+    for (int i = 0; i < cli->nb_timestamps; i++) {
+        if (prefetch) {
+            CutterImage image = { .width = probe.width, .height = probe.height, .requested_ms = cli->timestamps[i] };
+            int ret = output_filename(save, i + 1, &image, filename, sizeof(filename));
+            if (ret < 0)
+                return ret;
+            ret = cutter_output_cache_fetch_at(save->output_cache, cli->timestamps[i], filename);
+            if (ret < 0)
+                return ret;
+            if (ret > 0) {
+                save->saved++;
+                continue;
+            }
         }
-
-        // Print its name, id and bitrate
-        logging("\tCodec %s ID %d bit_rate %lld", local_codec->name, local_codec->id, local_codec_parameters->bit_rate);
+        pending[nb_pending] = cli->timestamps[i];
+        numbers[nb_pending++] = i + 1;
     }
 
-    if (video_stream_index == -1) {
-        logging("File %s does not contain a video stream!", argv[1]);
+    save->pending = pending;
+    save->numbers = numbers;
+    save->nb_pending = nb_pending;
+    return cutter_extract_many(extractor, pending, nb_pending, save_frame, save);
+}
+
+// Write the map of the sheet next to it, with its extension replaced
+static int write_mosaic_map(const CutterMosaic *mosaic, const char *atlas, const char *extension)
+{
+    char path[1024];
+    const char *slash = strrchr(atlas, '/');
+    const char *name = slash ? slash + 1 : atlas;
+    const char *dot = strrchr(name, '.');
+    int length = dot && dot != name ? (int) (dot - atlas) : (int) strlen(atlas);
+
+    if (snprintf(path, sizeof(path), "%.*s.%s", length, atlas, extension) >= (int) sizeof(path))
         return -1;
-    }
 
-    // https://ffmpeg.org/doxygen/trunk/structAVCodecContext.html
-    AVCodecContext *codec_context = avcodec_alloc_context3(input_codec);
-    if (!codec_context) {
-        logging("Failed to allocated memory for AVCodecContext");
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Could not create %s\n", path);
         return -1;
     }
+    // The maps sit in the directory of the sheet, the sheet is named relatively
+    int ret = strcmp(extension, "vtt") ? cutter_mosaic_write_json(mosaic, fp, name)
+                                       : cutter_mosaic_write_vtt(mosaic, fp, name);
+    if (fclose(fp) && ret >= 0)
+        ret = -1;
+    if (ret >= 0)
+        logging("Creating map -> %s", path);
+    return ret;
+}
+
+static int extract_mosaic(CutterExtractor *extractor, CliOptions *cli, SaveContext *save)
+{
+    CutterMosaic *mosaic = NULL;
+    CutterImage image;
+    char filename[1024];
+
+    int ret = cutter_mosaic_alloc(&mosaic, cli->mosaic_columns, cli->mosaic_rows, cli->mosaic_tile_width, 0);
+    if (ret < 0)
+        return ret;
+
+    if (cli->nb_timestamps)
+        qsort(cli->timestamps, cli->nb_timestamps, sizeof(*cli->timestamps), compare_timestamps);
+    ret = cutter_extract_mosaic(extractor, mosaic, cli->nb_timestamps ? cli->timestamps : NULL, cli->nb_timestamps);
+    if (ret <= 0)
+        goto end;
 
-    // Fill the codec context based on the values from the supplied codec parameters
-    // https://ffmpeg.org/doxygen/trunk/group__lavc__core.html
-    if (avcodec_parameters_to_context(codec_context, input_codec_parameters) < 0) {
-        logging("Failed to copy codec params to codec context");
+    // One output, named like the first frame would be
+    cutter_mosaic_image(mosaic, &image);
+    ret = output_filename(save, 1, &image, filename, sizeof(filename));
+    if (ret >= 0)
+        ret = cutter_save_png(&image, filename);
+    if (ret >= 0)
+        ret = write_mosaic_map(mosaic, filename, "vtt");
+    if (ret >= 0)
+        ret = write_mosaic_map(mosaic, filename, "json");
+    if (ret >= 0)
+        save->saved++;
+
+end:
+    cutter_mosaic_free(&mosaic);
+    return ret;
+}
+
+int main(int argc, const char *argv[])
+{
+    static CliOptions cli;
+
+    cli.log_level = CUTTER_LOG_INFO;
+    if (parse_options(&cli, argc, argv) < 0) {
+        usage(argv[0]);
         return -1;
     }
 
-    // Initialize the AVCodecContext to use the given AVCodec.
-    // https://ffmpeg.org/doxygen/trunk/group__lavc__core.html
-    if (avcodec_open2(codec_context, input_codec, NULL) < 0) {
-        logging("Failed to open codec through avcodec_open2");
+    // Formatted on the extracting thread, written out by a background one.
+    // Flushed at exit, whichever way main() returns.
+    cutter_log_set_level(cli.log_level);
+    if (cutter_log_start_async() == 0)
+        atexit(cutter_log_stop_async);
+
+    // Started before opening so the probe is part of the elapsed time
+    if (cli.metrics)
+        cutter_metrics_enable(1);
+    if (cli.trace_path)
+        cutter_trace_enable(0);
+
+    CutterExtractor *extractor = NULL;
+    if (cutter_open(&extractor, cli.input, &cli.options) < 0)
         return -1;
+
+    CutterProbe probe;
+    cutter_probe(extractor, &probe);
+    logging("*** %s / %s: %d x %d, %" PRId64 " ms, %.3f fps",
+            probe.format_name, probe.codec_name, probe.width, probe.height,
+            probe.duration_ms, probe.frame_rate);
+
+    SaveContext save = { 0 };
+    CutterCache *cache = NULL;
+    CutterSink *tar_output = NULL;
+    int ret = 0;
+
+    if (cutter_path_template_parse(&save.paths, cli.output_template, cli.input, cli.fanout, cli.fanout_size) < 0) {
+        fprintf(stderr, "Invalid output template %s\n", cli.output_template);
+        cutter_close(&extractor);
+        return -1;
+    }
+
+    if (cli.cache_bytes) {
+        if (cutter_cache_alloc(&cache, cli.cache_bytes) < 0) {
+            cutter_path_template_free(&save.paths);
+            cutter_close(&extractor);
+            return -1;
+        }
+        cutter_set_cache(extractor, cache);
+    }
+
+    if (cli.tar_path) {
+        CutterSink *output = NULL;
+        if (!strcmp(cli.tar_path, "-"))
+            ret = cutter_sink_alloc_fd(&output, STDOUT_FILENO, 0);
+        else
+            ret = cutter_sink_open_file(&output, cli.tar_path, 0);
+        if (ret >= 0)
+            ret = cutter_sink_alloc_tar(&save.archive, output);
+        if (ret < 0) {
+            fprintf(stderr, "Could not open the archive %s\n", cli.tar_path);
+            cutter_sink_close(&output);
+            cutter_path_template_free(&save.paths);
+            cutter_close(&extractor);
+            cutter_cache_free(&cache);
+            return -1;
+        }
+        tar_output = output;
     }
 
-    // https://ffmpeg.org/doxygen/trunk/structAVFrame.html
-    AVFrame *input_frame = av_frame_alloc();
-    if (!input_frame) {
-        logging("Failed to allocate memory for AVFrame");
+    // Frames without timestamps last one frame period
+    if (cli.apng_path) {
+        int delay_ms = probe.frame_rate > 0 && probe.frame_rate <= 1000 ? (int) (1000 / probe.frame_rate + 0.5) : 100;
+        if (cutter_apng_open(&save.animation, cli.apng_path, delay_ms, 0) < 0) {
+            fprintf(stderr, "Could not create the animation %s\n", cli.apng_path);
+            cutter_path_template_free(&save.paths);
+            cutter_close(&extractor);
+            cutter_cache_free(&cache);
+            return -1;
+        }
+    }
+
+    if (cli.sequence_path && cutter_sequence_writer_open(&save.sequence, cli.sequence_path, cli.sequence_interval) < 0) {
+        fprintf(stderr, "Could not create the sequence %s\n", cli.sequence_path);
+        cutter_apng_close(&save.animation);
+        cutter_path_template_free(&save.paths);
+        cutter_close(&extractor);
+        cutter_cache_free(&cache);
         return -1;
     }
 
-    // https://ffmpeg.org/doxygen/trunk/structAVPacket.html
-    AVPacket *input_packet = av_packet_alloc();
-    if (!input_packet) {
-        logging("Failed to allocate memory for AVPacket");
+    if ((cli.async_io && cutter_sink_open_async(&save.async, 0, 0, output_written, &save) < 0) ||
+        (cli.sync_mode >= 0 &&
+         cutter_publisher_open(&save.publisher, cli.sync_mode, cli.sync_batch, output_published, &save) < 0)) {
+        fprintf(stderr, "Could not set up the output files\n");
+        cutter_sink_close(&save.async);
+        cutter_path_template_free(&save.paths);
+        cutter_close(&extractor);
+        cutter_cache_free(&cache);
         return -1;
     }
 
-    int ret = 0;
-    int counter = 0;
-
-    // Fill the Packet with data from the Stream
-    // https://ffmpeg.org/doxygen/trunk/group__lavf__decoding.html
-    while (av_read_frame(format_context, input_packet) >= 0) {
-        // If it's the video stream
-        if (input_packet->stream_index == video_stream_index) {
-            logging("---");
-            logging("AVPacket->pts %" PRId64, input_packet->pts);
-            ret = decode_packet(input_packet, codec_context, input_frame);
-            if (ret < 0)
-                break;
-            // Stop it, otherwise we'll be saving hundreds of frames
-            if (counter > IMAGES_TOTAL)
-                break;
-            counter++;
+    if (cli.cache_dir && cutter_output_cache_open(&save.output_cache, extractor, cli.cache_dir) < 0)
+        logging("Could not use the cache directory %s, writing every output", cli.cache_dir);
+
+    if (cli.build_index) {
+        ret = cutter_index_build(extractor, cli.index_path);
+    } else {
+        // A missing or stale index only costs speed, seeks still work without it
+        if (cutter_index_load(extractor, cli.index_path) < 0 && cli.index_path)
+            logging("Could not use the index %s, seeking without it", cli.index_path);
+
+        if (cli.mosaic_columns) {
+            ret = extract_mosaic(extractor, &cli, &save);
+        } else if (cli.best_candidates) {
+            ret = cutter_extract_best(extractor, cli.best_candidates, save_frame, &save);
+        } else if (cli.nb_timestamps) {
+            ret = extract_timestamps(extractor, &cli, &save);
+        } else {
+            // Selections and content filters decide how many frames are kept,
+            // otherwise keep the first IMAGES_TOTAL ones (that are not blank).
+            // Shards always extract their whole slice.
+            if (!cli.selection && cli.options.scene_threshold <= 0 && cli.options.dedupe_distance <= 0 &&
+                !cli.nb_shards)
+                save.limit = IMAGES_TOTAL;
+            cutter_set_selection(extractor, cli.selection);
+
+            // Concurrent shards each keep their own manifest
+            char root[1024], manifest_path[1024 + 32];
+            int depth = output_root(cli.output_template, root, sizeof(root));
+            if (cli.nb_shards)
+                snprintf(manifest_path, sizeof(manifest_path), "%s/manifest-%d-of-%d.txt", root, cli.shard, cli.nb_shards);
+            else
+                snprintf(manifest_path, sizeof(manifest_path), "%s/" MANIFEST_NAME, root);
+
+            // An archive, an animation or a sequence has no files to check on resume
+            int64_t resume_pts;
+            if (!save.archive && !save.animation && !save.sequence) {
+                // Checksumming reads every output once more, only paid for when asked.
+                // A resumed run carries on recording.
+                if (cli.checkpoint || cli.resume) {
+                    ret = cutter_mkdirs(root);
+                    if (ret >= 0)
+                        ret = cutter_manifest_open(&save.manifest, manifest_path, cli.resume);
+                } else {
+                    // A manifest of an earlier run describes outputs about to be replaced
+                    unlink(manifest_path);
+                }
+            }
+            int resumed = ret >= 0 && cli.resume && cutter_manifest_last(save.manifest, &save.saved, &resume_pts);
+
+            // The outputs the killed run had not renamed yet are written again
+            if (resumed) {
+                int removed = cutter_publisher_remove_stale(root, depth + (cli.fanout != CUTTER_FANOUT_NONE));
+                if (removed > 0)
+                    logging("Removed %d temporary files of the interrupted run", removed);
+            }
+            if (ret >= 0 && cli.nb_shards) {
+                // A resumed shard keeps its slice and its numbering
+                save.by_frame_index = 1;
+                if (resumed)
+                    ret = cutter_iterate_shard_from(extractor, cli.shard, cli.nb_shards, resume_pts, save_frame, &save);
+                else
+                    ret = cutter_iterate_shard(extractor, cli.shard, cli.nb_shards, save_frame, &save);
+            } else if (resumed) {
+                // The earlier run may have stopped right at the limit
+                if (!save.limit || save.saved < save.limit)
+                    ret = cutter_iterate_frames_from(extractor, resume_pts, save_frame, &save);
+            } else if (ret >= 0) {
+                ret = cutter_iterate_frames(extractor, save_frame, &save);
+            }
         }
-        // https://ffmpeg.org/doxygen/trunk/group__lavc__packet.html
-        av_packet_unref(input_packet);
     }
 
     logging("---");
     logging("Releasing all the resources...");
 
-    avformat_close_input(&format_context);
-    av_packet_free(&input_packet);
-    av_frame_free(&input_frame);
-    avcodec_free_context(&codec_context);
+    // The last files complete into the manifest and the cache, written then published
+    int async_ret = cutter_sink_close(&save.async);
+    int publish_ret = cutter_publisher_close(&save.publisher);
+    if (async_ret < 0 || publish_ret < 0 || save.write_error) {
+        fprintf(stderr, "Failed to write PNG file\n");
+        ret = -1;
+    }
+    for (int i = save.queued_done; i < save.nb_queued; i++)
+        free(save.queued[i].filename);
+    free(save.queued);
+    cutter_manifest_close(&save.manifest);
+    cutter_output_cache_close(&save.output_cache);
+    if (cutter_apng_close(&save.animation) < 0) {
+        fprintf(stderr, "Failed to write the animation %s\n", cli.apng_path);
+        ret = -1;
+    }
+    if (cutter_sequence_writer_close(&save.sequence) < 0) {
+        fprintf(stderr, "Failed to write the sequence %s\n", cli.sequence_path);
+        ret = -1;
+    }
+    // Ends the archive before its file is closed
+    int archive_ret = cutter_sink_close(&save.archive);
+    if (cutter_sink_close(&tar_output) < 0 || archive_ret < 0) {
+        fprintf(stderr, "Failed to write the archive %s\n", cli.tar_path);
+        ret = -1;
+    }
+    cutter_close(&extractor);
+    cutter_cache_free(&cache);
+    cutter_selection_free(&cli.selection);
+    cutter_path_template_free(&save.paths);
 
-    return 0;
+    if (cli.metrics)
+        cutter_metrics_write_json(stdout);
+    if (cli.trace_path && cutter_trace_write(cli.trace_path) < 0)
+        logging("Failed to write the trace %s", cli.trace_path);
+
+    return ret < 0 ? -1 : 0;
 }
 
 static void logging(const char *fmt, ...)
 {
     va_list args;
 
-    fprintf( stderr, "LOG: " );
+    // Through the library so the lines stay in order with its own
     va_start( args, fmt );
-    vfprintf( stderr, fmt, args );
+    cutter_log_vprintf( CUTTER_LOG_INFO, fmt, args );
     va_end( args );
-    fprintf( stderr, "\n" );
 }
 
-static int decode_packet(AVPacket *input_packet, AVCodecContext *codec_context, AVFrame *input_frame)
+static int queue_output(SaveContext *save, int number, const CutterImage *image, const char *filename,
+                        enum OutputState state)
 {
-    // Supply raw packet data as input to a decoder
-    // https://ffmpeg.org/doxygen/trunk/group__lavc__decoding.html
-    int ret = avcodec_send_packet(codec_context, input_packet);
-
-    if (ret < 0) {
-        logging("Error while sending a packet to the decoder: %s", av_err2str(ret));
-        return ret;
+    if (save->nb_queued == save->queued_allocated) {
+        int allocated = save->queued_allocated ? save->queued_allocated * 2 : 64;
+        QueuedOutput *queued = realloc(save->queued, allocated * sizeof(*queued));
+        if (!queued)
+            return -1;
+        save->queued = queued;
+        save->queued_allocated = allocated;
     }
 
-    while (ret >= 0) {
-        // Return decoded output data (into a frame) from a decoder
-        // https://ffmpeg.org/doxygen/trunk/group__lavc__decoding.html
-        ret = avcodec_receive_frame(codec_context, input_frame);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            break;
-        } else if (ret < 0) {
-            logging("Error while receiving a frame from the decoder: %s", av_err2str(ret));
-            return ret;
-        }
-
-        if (ret >= 0) {
-            logging(
-                "Frame %d (type=%c, size=%d bytes, format=%d) pts %d key_frame %d [DTS %d]",
-                codec_context->frame_number,
-                av_get_picture_type_char(input_frame->pict_type),
-                input_frame->pkt_size,
-                input_frame->format,
-                input_frame->pts,
-                input_frame->key_frame,
-                input_frame->coded_picture_number);
-
-            char frame_filename[1024];
-            snprintf(frame_filename, sizeof(frame_filename), "output/%s-%d.png", "frame", codec_context->frame_number);
-
-            // Check if the frame is a planar YUV 4:2:0, 12bpp
-            // That is the format of the provided .mp4 file
-            // RGB formats will definitely not give a gray image
-            // Other YUV image may do so, but untested, so give a warning
-            if (input_frame->format != AV_PIX_FMT_YUV420P) {
-                logging("Warning: the generated file may not be a grayscale image, but could e.g. be just the R component if the video format is RGB");
-            }
-
-            // To create the PNG files, the AVFrame data must be translated from YUV420P format into RGB24
-            struct SwsContext *sws_ctx = sws_getContext(
-                input_frame->width, input_frame->height, input_frame->format,
-                input_frame->width, input_frame->height, AV_PIX_FMT_RGB24,
-                SWS_BILINEAR, NULL, NULL, NULL);
-
-            // Allocate a new AVFrame for the output RGB24 image
-            AVFrame* rgb_frame = av_frame_alloc();
+    QueuedOutput *output = &save->queued[save->nb_queued];
+    output->filename = strdup(filename);
+    if (!output->filename)
+        return -1;
+    output->number = number;
+    output->pts = image->pts;
+    output->requested_ms = image->requested_ms;
+    output->state = state;
+    output->cached = state == OUTPUT_COMPLETE;
+    save->nb_queued++;
+    return 0;
+}
 
-            // Set the properties of the output AVFrame
-            rgb_frame->format = AV_PIX_FMT_RGB24;
-            rgb_frame->width = input_frame->width;
-            rgb_frame->height = input_frame->height;
+static int record_output(SaveContext *save, int number, const CutterImage *image, const char *filename, int cached)
+{
+    // A failed store only costs the next run some work
+    if (save->output_cache && !cached)
+        cutter_output_cache_store(save->output_cache, image, filename);
 
-            int ret = av_frame_get_buffer(rgb_frame, 0);
-            if (ret < 0) {
-                logging("Error while preparing RGB frame: %s", av_err2str(ret));
-                return ret;
-            }
+    if (save->manifest && cutter_manifest_append(save->manifest, number, image->pts, filename) < 0) {
+        fprintf(stderr, "Failed to update the manifest\n");
+        return -1;
+    }
+    return 0;
+}
 
-            logging("Transforming frame format from YUV420P into RGB24...");
-            ret = sws_scale(sws_ctx, input_frame->data, input_frame->linesize, 0, input_frame->height, rgb_frame->data, rgb_frame->linesize);
-            if (ret < 0) {
-                logging("Error while translating the frame format from YUV420P into RGB24: %s", av_err2str(ret));
-                return ret;
-            }
+// Record the complete outputs at the head of the queue, the manifest stays in output order
+static void record_completed(SaveContext *save)
+{
+    while (save->queued_done < save->nb_queued && save->queued[save->queued_done].state == OUTPUT_COMPLETE) {
+        QueuedOutput *output = &save->queued[save->queued_done++];
 
-            // save a frame into a .PNG file
-            ret = save_frame_to_png(rgb_frame, frame_filename);
-            if (ret < 0) {
-                fprintf(stderr, "Failed to write PNG file\n");
-                return -1;
-            }
+        // After a failure the manifest ends with the last output before it
+        if (!save->write_error) {
+            // The cache only looks at the timestamps of the image
+            CutterImage image = { .pts = output->pts, .requested_ms = output->requested_ms };
 
-            av_frame_free(&rgb_frame);
+            if (record_output(save, output->number, &image, output->filename, output->cached) < 0)
+                save->write_error = 1;
         }
+        free(output->filename);
     }
 
-    return 0;
+    // The queue restarts once it is drained
+    if (save->queued_done == save->nb_queued)
+        save->queued_done = save->nb_queued = 0;
 }
 
-// Function to save an AVFrame to a PNG file
-int save_frame_to_png(AVFrame *frame, const char *filename)
+// Oldest queued output in the given state, the writers complete them in order
+static QueuedOutput *oldest_output(SaveContext *save, enum OutputState state)
 {
-    int ret = 0;
+    for (int i = save->queued_done; i < save->nb_queued; i++) {
+        if (save->queued[i].state == state)
+            return &save->queued[i];
+    }
+    return NULL;
+}
 
-    logging("Creating PNG file -> %s", filename);
+static int save_frame(const CutterImage *image, void *opaque)
+{
+    SaveContext *save = opaque;
+    char frame_filename[1024];
+    char temp_filename[1100];
+    int number = save->saved + 1;
 
-    // Open the PNG file for writing
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        fprintf(stderr, "Failed to open file '%s'\n", filename);
+    if (save->by_frame_index && image->frame_index >= 0)
+        number = image->frame_index + 1;
+    if (save->pending && image->requested_ms >= 0) {
+        // Timestamps past the end of the stream are never delivered
+        while (save->cursor < save->nb_pending && save->pending[save->cursor] != image->requested_ms)
+            save->cursor++;
+        if (save->cursor < save->nb_pending)
+            number = save->numbers[save->cursor++];
+    }
+    // Every output is a frame of the animation, without a file of its own
+    if (save->animation) {
+        if (cutter_apng_add_frame(save->animation, image) < 0) {
+            fprintf(stderr, "Failed to add frame %d to the animation\n", number);
+            return -1;
+        }
+        save->saved++;
+        return save->limit && save->saved >= save->limit;
+    }
+
+    // Or a frame of the sequence
+    if (save->sequence) {
+        if (cutter_sequence_write(save->sequence, image) < 0) {
+            fprintf(stderr, "Failed to add frame %d to the sequence\n", number);
+            return -1;
+        }
+        save->saved++;
+        return save->limit && save->saved >= save->limit;
+    }
+
+    if (output_filename(save, number, image, frame_filename, sizeof(frame_filename)) < 0)
         return -1;
+
+    // Every output goes into the archive instead of a file of its own
+    if (save->archive) {
+        if (cutter_encode_png(image, frame_filename, -1, save->archive) < 0) {
+            fprintf(stderr, "Failed to write %s into the archive\n", frame_filename);
+            return -1;
+        }
+        save->saved++;
+        return save->limit && save->saved >= save->limit;
     }
 
-    // Create the PNG write struct and info struct
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr) {
-        fprintf(stderr, "Failed to create PNG write struct\n");
-        fclose(fp);
+    if (save->write_error)
         return -1;
+
+    int cached = 0;
+    if (save->output_cache) {
+        cached = cutter_output_cache_fetch(save->output_cache, image, frame_filename);
+        if (cached < 0)
+            return -1;
+        // An earlier output may be linked with the cache, replace it instead of rewriting it
+        if (!cached)
+            unlink(frame_filename);
     }
 
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-        fprintf(stderr, "Failed to create PNG info struct\n");
-        png_destroy_write_struct(&png_ptr, NULL);
-        fclose(fp);
+    if (cached) {
+        // Recorded after the outputs still being written or published
+        if (save->nb_queued > save->queued_done) {
+            if (queue_output(save, number, image, frame_filename, OUTPUT_COMPLETE) < 0)
+                return -1;
+        } else if (record_output(save, number, image, frame_filename, 1) < 0) {
+            return -1;
+        }
+        save->saved++;
+        return save->limit && save->saved >= save->limit;
+    }
+
+    // Written aside, output_published() records it once it is renamed into place
+    const char *path = frame_filename;
+    if (save->publisher) {
+        if (cutter_publisher_temp_name(save->publisher, frame_filename, temp_filename, sizeof(temp_filename)) < 0)
+            return -1;
+        path = temp_filename;
+    }
+
+    if (save->async) {
+        // Recorded by output_written() once the file is complete
+        if (queue_output(save, number, image, frame_filename, OUTPUT_WRITING) < 0) {
+            fprintf(stderr, "Failed to write PNG file\n");
+            return -1;
+        }
+        if (cutter_encode_png(image, path, -1, save->async) < 0) {
+            fprintf(stderr, "Failed to write PNG file\n");
+            // Never queued, nothing will complete it
+            free(save->queued[--save->nb_queued].filename);
+            return -1;
+        }
+        save->saved++;
+        return save->limit && save->saved >= save->limit;
+    }
+
+    // save a frame into a .PNG file
+    if (cutter_save_png(image, path) < 0) {
+        fprintf(stderr, "Failed to write PNG file\n");
+        if (save->publisher)
+            unlink(path);
         return -1;
     }
 
-    // Set up error handling for libpng
-    if (setjmp(png_jmpbuf(png_ptr))) {
-        fprintf(stderr, "Error writing PNG file\n");
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        fclose(fp);
+    if (save->publisher) {
+        if (queue_output(save, number, image, frame_filename, OUTPUT_WRITTEN) < 0 ||
+            cutter_publisher_commit(save->publisher, path, frame_filename) < 0 || save->write_error) {
+            fprintf(stderr, "Failed to publish %s\n", frame_filename);
+            unlink(path);
+            return -1;
+        }
+    } else if (record_output(save, number, image, frame_filename, 0) < 0) {
         return -1;
     }
 
-    // Set the PNG file as the output for libpng
-    png_init_io(png_ptr, fp);
+    // Stop it, otherwise we'll be saving hundreds of frames
+    save->saved++;
+    return save->limit && save->saved >= save->limit;
+}
 
-    // Set the PNG image attributes
-    png_set_IHDR(png_ptr, info_ptr, frame->width, frame->height, 8, PNG_COLOR_TYPE_RGB,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+static void output_written(void *opaque, const char *filename, int ret)
+{
+    SaveContext *save = opaque;
+    QueuedOutput *output = oldest_output(save, OUTPUT_WRITING);
 
-    // Allocate memory for the row pointers and fill them with the AVFrame data
-    png_bytep *row_pointers = (png_bytep *) malloc(sizeof(png_bytep) * frame->height);
-    for (int y = 0; y < frame->height; y++) {
-        row_pointers[y] = (png_bytep) (frame->data[0] + y * frame->linesize[0]);
+    if (ret < 0 || !save->publisher) {
+        output->state = OUTPUT_COMPLETE;
+    } else {
+        // filename is the temporary name the file was written to
+        output->state = OUTPUT_WRITTEN;
+        ret = cutter_publisher_commit(save->publisher, filename, output->filename);
     }
 
-    // Write the PNG file
-    png_set_rows(png_ptr, info_ptr, row_pointers);
-    png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+    if (ret < 0) {
+        if (save->publisher)
+            unlink(filename);
+        save->write_error = 1;
+    }
+    record_completed(save);
+}
 
-    // Clean up
-    free(row_pointers);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    fclose(fp);
+static void output_published(void *opaque, const char *filename, int ret)
+{
+    SaveContext *save = opaque;
+    QueuedOutput *output = oldest_output(save, OUTPUT_WRITTEN);
 
-    return ret;
+    (void) filename;
+    output->state = OUTPUT_COMPLETE;
+    if (ret < 0)
+        save->write_error = 1;
+    record_completed(save);
 }
@@ -0,0 +1,143 @@
+/*
+ * Content analysis stages run on the decoded frames before conversion.
+ * Each stage decides whether a frame is worth converting and encoding,
+ * so rejected frames never reach sws_scale() nor the PNG encoder.
+ */
+
+#include <inttypes.h>
+#include <math.h>
+
+#include "internal.h"
+
+// Best-frame scoring: exposure peaks at mid grey, pictures darker, brighter
+// or flatter than these limits are penalised below any regular picture
+#define SCORE_MID_GREY 128.0
+#define SCORE_BLACK_MEAN 16.0
+#define SCORE_WHITE_MEAN 240.0
+#define SCORE_SOLID_STDDEV 8.0
+#define SCORE_PENALTY 100.0
+
+void cutter_analysis_reset(CutterExtractor *ex)
+{
+    ex->thumb_primed = 0;
+    ex->thumb_ready = 0;
+    ex->has_last_hash = 0;
+}
+
+void cutter_analysis_free(CutterExtractor *ex)
+{
+    cutter_thumb_free(&ex->thumbs[0]);
+    cutter_thumb_free(&ex->thumbs[1]);
+}
+
+void cutter_analysis_begin(CutterExtractor *ex)
+{
+    // The thumbnail of the previous frame becomes the reference. A frame
+    // dropped as blank computes none: the last non-blank one stays the
+    // reference, so the picture after a fade is compared with the one before.
+    if (ex->thumb_ready) {
+        ex->thumb_current ^= 1;
+        ex->thumb_primed = 1;
+    }
+    ex->thumb_ready = 0;
+}
+
+// Thumbnail of the frame being analysed, computed once and shared by the stages.
+// NULL when the frame has no luma plane the kernels can read.
+static const CutterThumb *frame_thumb(CutterExtractor *ex, const AVFrame *frame, int *error)
+{
+    CutterThumb *thumb = &ex->thumbs[ex->thumb_current];
+
+    *error = 0;
+    if (ex->thumb_ready)
+        return thumb;
+    if (!cutter_luma_supported(frame))
+        return NULL;
+
+    *error = cutter_luma_downsample(frame->data[0], frame->linesize[0], frame->width, frame->height, thumb);
+    if (*error < 0)
+        return NULL;
+
+    ex->thumb_ready = 1;
+    return thumb;
+}
+
+int cutter_blank_check(CutterExtractor *ex, const AVFrame *frame)
+{
+    CutterLumaStats stats;
+
+    if (!cutter_luma_supported(frame))
+        return 1;
+
+    cutter_luma_stats(frame->data[0], frame->linesize[0], frame->width, frame->height, &stats);
+    if (stats.mean < ex->options.blank_mean || stats.max - stats.min < ex->options.blank_range) {
+        cutter_log_verbose("Blank frame at pts %" PRId64 " (mean %.1f, range %d-%d)",
+                   frame->best_effort_timestamp, stats.mean, stats.min, stats.max);
+        return 0;
+    }
+    return 1;
+}
+
+int cutter_scene_check(CutterExtractor *ex, const AVFrame *frame)
+{
+    int ret;
+    const CutterThumb *current = frame_thumb(ex, frame, &ret);
+    const CutterThumb *previous = &ex->thumbs[!ex->thumb_current];
+
+    // Without a usable luma plane every frame is kept
+    if (!current)
+        return ret < 0 ? ret : 1;
+
+    // The first frame opens the first shot
+    int keep = 1;
+    if (ex->thumb_primed && previous->width == current->width && previous->height == current->height) {
+        size_t size = (size_t) current->width * current->height;
+        double score = cutter_luma_sad(current->data, previous->data, size) / (size * 255.0);
+
+        keep = score >= ex->options.scene_threshold;
+        if (keep)
+            cutter_log_verbose("Scene change at pts %" PRId64 " (score %.3f)", frame->best_effort_timestamp, score);
+    }
+
+    return keep;
+}
+
+int cutter_dedupe_check(CutterExtractor *ex, const AVFrame *frame)
+{
+    int ret;
+    const CutterThumb *thumb = frame_thumb(ex, frame, &ret);
+
+    if (!thumb || thumb->width < CUTTER_DHASH_COLUMNS || thumb->height < CUTTER_DHASH_ROWS)
+        return ret < 0 ? ret : 1;
+
+    uint64_t hash = cutter_luma_dhash(thumb);
+    if (ex->has_last_hash) {
+        int distance = __builtin_popcountll(hash ^ ex->last_hash);
+        if (distance < ex->options.dedupe_distance)
+            return 0;
+    }
+
+    // Later frames are compared with the last kept one, not the last decoded one
+    ex->last_hash = hash;
+    ex->has_last_hash = 1;
+    return 1;
+}
+
+double cutter_frame_score(const AVFrame *frame)
+{
+    CutterLumaStats stats;
+
+    if (!cutter_luma_supported(frame))
+        return 0;
+
+    cutter_luma_stats(frame->data[0], frame->linesize[0], frame->width, frame->height, &stats);
+    double sharpness = log1p(cutter_luma_laplacian_variance(frame->data[0], frame->linesize[0],
+                                                            frame->width, frame->height));
+    double exposure = 1.0 - fabs(stats.mean - SCORE_MID_GREY) / SCORE_MID_GREY;
+    double score = sharpness * (0.5 + 0.5 * exposure);
+
+    if (stats.mean < SCORE_BLACK_MEAN || stats.mean > SCORE_WHITE_MEAN || sqrt(stats.variance) < SCORE_SOLID_STDDEV)
+        score -= SCORE_PENALTY;
+
+    return score;
+}
@@ -0,0 +1,414 @@
+/*
+ * Animated PNG output
+ *
+ * Every frame is compared with the previous one and only the rectangle
+ * holding the changed pixels is encoded, as an fcTL chunk placing it and
+ * fdAT chunks with its image data. The regions go through the regular PNG
+ * encoder, whose IDAT chunks are renumbered into fdAT ones, so the filters
+ * and compression are the same as the frame files.
+ *
+ * A frame is only written once the next one arrives, since its delay is the
+ * gap to the next timestamp. Frames identical to the previous one are not
+ * written at all, they extend its delay.
+ *
+ * The number of frames in the acTL chunk is patched in when closing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "internal.h"
+
+// Offset of the acTL chunk: signature (8) and IHDR (8 + 13 + 4)
+#define ACTL_OFFSET 33
+
+static const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+struct CutterApng {
+    FILE *fp;
+    // Removed when the animation cannot be completed
+    char *filename;
+    int default_delay_ms;
+    int loops;
+    int width;
+    int height;
+
+    // Packed RGB24 copy of the last frame, the reference of the dirty rectangles
+    uint8_t *previous;
+
+    // Frame waiting for the next one to know its delay: its encoded region,
+    // the timestamp it starts at and the identical frames merged into it
+    uint8_t *encoded;
+    size_t encoded_size;
+    int x, y, region_width, region_height;
+    int64_t start_ms;
+    int64_t last_ms;
+    int merged;
+
+    // Sequence number of the next fcTL or fdAT chunk
+    uint32_t sequence;
+    uint32_t nb_frames;
+    int error;
+};
+
+static void write_be32(uint8_t *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static uint32_t read_be32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+// CRC-32 of the chunks, a nibble at a time: the bytes spent here are the
+// compressed ones, a small fraction of the deflate work
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        crc = table[crc & 0xf] ^ (crc >> 4);
+        crc = table[crc & 0xf] ^ (crc >> 4);
+    }
+    return crc;
+}
+
+// Write a chunk whose data is prefix (may be NULL) followed by data
+static int write_chunk(CutterApng *apng, const char *type, const uint8_t *prefix, size_t prefix_size,
+                       const uint8_t *data, size_t size)
+{
+    uint8_t header[8], trailer[4];
+    uint32_t crc = 0xffffffff;
+
+    write_be32(header, prefix_size + size);
+    memcpy(header + 4, type, 4);
+    crc = crc32_update(crc, header + 4, 4);
+    crc = crc32_update(crc, prefix, prefix_size);
+    crc = crc32_update(crc, data, size);
+    write_be32(trailer, crc ^ 0xffffffff);
+
+    if (fwrite(header, 1, 8, apng->fp) != 8 ||
+        (prefix_size && fwrite(prefix, 1, prefix_size, apng->fp) != prefix_size) ||
+        (size && fwrite(data, 1, size, apng->fp) != size) ||
+        fwrite(trailer, 1, 4, apng->fp) != 4)
+        return AVERROR(EIO);
+    cutter_metrics_add_bytes(prefix_size + size + 12);
+    return 0;
+}
+
+static int write_actl(CutterApng *apng)
+{
+    uint8_t actl[8];
+
+    write_be32(actl, apng->nb_frames);
+    write_be32(actl + 4, apng->loops);
+    return write_chunk(apng, "acTL", NULL, 0, actl, sizeof(actl));
+}
+
+// Walk the chunks of an encoded PNG
+static const uint8_t *next_chunk(const uint8_t *p, const uint8_t *end, char type[4], uint32_t *size)
+{
+    if (end - p < 12)
+        return NULL;
+    *size = read_be32(p);
+    if (*size > (size_t) (end - p) - 12)
+        return NULL;
+    memcpy(type, p + 4, 4);
+    return p + 8;
+}
+
+// Write the pending frame, with delay_ms until the next one
+static int write_frame(CutterApng *apng, int64_t delay_ms)
+{
+    const uint8_t *p = apng->encoded + sizeof(png_signature), *end = apng->encoded + apng->encoded_size;
+    uint8_t fctl[26];
+    int first = !apng->nb_frames;
+    int ret;
+
+    if (apng->encoded_size < sizeof(png_signature))
+        return AVERROR_BUG;
+
+    // The header of the first frame is the header of the file, followed by a
+    // placeholder acTL until the frames are counted
+    if (first) {
+        char type[4];
+        uint32_t size;
+        const uint8_t *data = next_chunk(p, end, type, &size);
+        if (!data || memcmp(type, "IHDR", 4))
+            return AVERROR_BUG;
+        if (fwrite(png_signature, 1, sizeof(png_signature), apng->fp) != sizeof(png_signature))
+            return AVERROR(EIO);
+        if ((ret = write_chunk(apng, "IHDR", NULL, 0, data, size)) < 0 || (ret = write_actl(apng)) < 0)
+            return ret;
+    }
+
+    // The delay is a fraction of uint16_t, in centiseconds past 65 s
+    int delay_num = delay_ms, delay_den = 1000;
+    if (delay_ms > 0xffff) {
+        delay_num = FFMIN(delay_ms / 10, 0xffff);
+        delay_den = 100;
+    }
+
+    write_be32(fctl, apng->sequence++);
+    write_be32(fctl + 4, apng->region_width);
+    write_be32(fctl + 8, apng->region_height);
+    write_be32(fctl + 12, apng->x);
+    write_be32(fctl + 16, apng->y);
+    fctl[20] = delay_num >> 8;
+    fctl[21] = delay_num;
+    fctl[22] = delay_den >> 8;
+    fctl[23] = delay_den;
+    // APNG_DISPOSE_OP_NONE and APNG_BLEND_OP_SOURCE: the region replaces what it covers
+    fctl[24] = 0;
+    fctl[25] = 0;
+    if ((ret = write_chunk(apng, "fcTL", NULL, 0, fctl, sizeof(fctl))) < 0)
+        return ret;
+
+    // The first frame is the default image and keeps its IDAT chunks,
+    // the others become fdAT chunks each with its own sequence number
+    for (;;) {
+        char type[4];
+        uint32_t size;
+        const uint8_t *data = next_chunk(p, end, type, &size);
+        if (!data)
+            return AVERROR_BUG;
+        if (!memcmp(type, "IEND", 4))
+            break;
+        if (!memcmp(type, "IDAT", 4)) {
+            uint8_t sequence[4];
+            write_be32(sequence, apng->sequence);
+            if (first)
+                ret = write_chunk(apng, "IDAT", NULL, 0, data, size);
+            else
+                ret = write_chunk(apng, "fdAT", sequence, sizeof(sequence), data, size);
+            if (ret < 0)
+                return ret;
+            apng->sequence += !first;
+        }
+        p = data + size + 4;
+    }
+
+    apng->nb_frames++;
+    free(apng->encoded);
+    apng->encoded = NULL;
+    apng->encoded_size = 0;
+    return 0;
+}
+
+// Delay of the pending frame when the next one starts at next_ms
+static int64_t pending_delay(const CutterApng *apng, int64_t next_ms)
+{
+    if (apng->start_ms >= 0 && next_ms > apng->start_ms)
+        return next_ms - apng->start_ms;
+    return (int64_t) apng->default_delay_ms * (apng->merged + 1);
+}
+
+// First and last byte where the rows differ, 0 if they are equal
+static int compare_rows(const uint8_t *a, const uint8_t *b, int size, int *first, int *last)
+{
+    int i = 0, j;
+
+#ifdef __SSE2__
+    // 16 bytes per comparison, the mask of the equal ones tells where they differ
+    for (; i + 16 <= size; i += 16) {
+        unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i)),
+                                                          _mm_loadu_si128((const __m128i *) (b + i)))) & 0xffff;
+        if (diff) {
+            i += __builtin_ctz(diff);
+            break;
+        }
+    }
+#endif
+    while (i < size && a[i] == b[i])
+        i++;
+    if (i == size)
+        return 0;
+    *first = i;
+
+    // Same from the end, there is a difference at i to stop at
+    j = size;
+#ifdef __SSE2__
+    for (; j - 16 >= i; j -= 16) {
+        unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + j - 16)),
+                                                          _mm_loadu_si128((const __m128i *) (b + j - 16)))) & 0xffff;
+        if (diff) {
+            *last = j - 16 + 31 - __builtin_clz(diff);
+            return 1;
+        }
+    }
+#endif
+    while (a[j - 1] == b[j - 1])
+        j--;
+    *last = j - 1;
+    return 1;
+}
+
+int cutter_apng_open(CutterApng **apng_out, const char *filename, int default_delay_ms, int loops)
+{
+    CutterApng *apng;
+
+    *apng_out = NULL;
+    if (default_delay_ms <= 0 || loops < 0)
+        return AVERROR(EINVAL);
+
+    apng = calloc(1, sizeof(*apng));
+    if (!apng)
+        return AVERROR(ENOMEM);
+    apng->default_delay_ms = default_delay_ms;
+    apng->loops = loops;
+    apng->filename = strdup(filename);
+    if (!apng->filename) {
+        free(apng);
+        return AVERROR(ENOMEM);
+    }
+
+    apng->fp = fopen(filename, "wb");
+    if (!apng->fp) {
+        int ret = AVERROR(errno);
+        cutter_log_error("Could not create %s", filename);
+        free(apng->filename);
+        free(apng);
+        return ret;
+    }
+
+    *apng_out = apng;
+    return 0;
+}
+
+int cutter_apng_add_frame(CutterApng *apng, const CutterImage *image)
+{
+    int row_size = image->width * 3;
+    int top = -1, bottom = 0, left = row_size, right = 0;
+    int ret;
+
+    if (apng->error)
+        return apng->error;
+
+    if (!apng->previous) {
+        apng->previous = av_malloc((size_t) row_size * image->height);
+        if (!apng->previous)
+            return AVERROR(ENOMEM);
+        apng->width = image->width;
+        apng->height = image->height;
+        top = 0;
+        bottom = image->height - 1;
+        left = 0;
+        right = row_size - 1;
+    } else if (image->width != apng->width || image->height != apng->height) {
+        cutter_log_error("The frames of an animation must keep the size of the first one");
+        return AVERROR(EINVAL);
+    } else {
+        int64_t start = cutter_metrics_start();
+        for (int y = 0; y < image->height; y++) {
+            int first, last;
+            if (!compare_rows(apng->previous + (size_t) y * row_size, image->data + (size_t) y * image->linesize,
+                              row_size, &first, &last))
+                continue;
+            if (top < 0)
+                top = y;
+            bottom = y;
+            left = FFMIN(left, first);
+            right = FFMAX(right, last);
+        }
+        // The comparison is part of the encoding cost of the frame
+        cutter_metrics_record(CUTTER_STAGE_ENCODE, start);
+
+        // Nothing changed, the pending frame lasts longer
+        if (top < 0) {
+            apng->merged++;
+            apng->last_ms = image->ts_ms;
+            return 0;
+        }
+
+        // The pending frame ends where this one starts
+        if ((ret = write_frame(apng, pending_delay(apng, image->ts_ms))) < 0)
+            goto fail;
+    }
+
+    CutterImage region = {
+        .data = image->data + (size_t) top * image->linesize + left / 3 * 3,
+        .linesize = image->linesize,
+        .width = right / 3 - left / 3 + 1,
+        .height = bottom - top + 1,
+    };
+    int64_t start = cutter_metrics_start();
+    ret = cutter_png_encode_buffer(&region, -1, &apng->encoded, &apng->encoded_size);
+    cutter_metrics_record(CUTTER_STAGE_ENCODE, start);
+    if (ret < 0)
+        goto fail;
+
+    apng->x = left / 3;
+    apng->y = top;
+    apng->region_width = region.width;
+    apng->region_height = region.height;
+    apng->start_ms = image->ts_ms;
+    apng->last_ms = image->ts_ms;
+    apng->merged = 0;
+
+    // Only the changed rows need to be kept
+    for (int y = top; y <= bottom; y++)
+        memcpy(apng->previous + (size_t) y * row_size, image->data + (size_t) y * image->linesize, row_size);
+    cutter_log_verbose("Animation frame %u: %dx%d at %d,%d", apng->nb_frames + 1,
+                       apng->region_width, apng->region_height, apng->x, apng->y);
+    return 0;
+
+fail:
+    apng->error = ret;
+    return ret;
+}
+
+int cutter_apng_close(CutterApng **apng_ptr)
+{
+    CutterApng *apng = *apng_ptr;
+    int ret;
+
+    if (!apng)
+        return 0;
+
+    ret = apng->error;
+    if (ret >= 0 && !apng->encoded) {
+        cutter_log_error("An animation needs at least one frame");
+        ret = AVERROR(EINVAL);
+    }
+
+    // The last frame lasts the default delay past its last timestamp
+    if (ret >= 0) {
+        int64_t end_ms = apng->last_ms >= 0 ? apng->last_ms + apng->default_delay_ms : -1;
+        ret = write_frame(apng, pending_delay(apng, end_ms));
+    }
+    if (ret >= 0)
+        ret = write_chunk(apng, "IEND", NULL, 0, NULL, 0);
+    if (ret >= 0 && (fseek(apng->fp, ACTL_OFFSET, SEEK_SET) < 0 || write_actl(apng) < 0))
+        ret = AVERROR(EIO);
+
+    if (fclose(apng->fp) && ret >= 0)
+        ret = AVERROR(errno);
+    if (ret >= 0) {
+        cutter_log("*** Animation of %u frames", apng->nb_frames);
+    } else {
+        // No truncated or empty .png is left behind
+        unlink(apng->filename);
+    }
+
+    av_free(apng->previous);
+    free(apng->encoded);
+    free(apng->filename);
+    free(apng);
+    *apng_ptr = NULL;
+    return ret;
+}
@@ -0,0 +1,577 @@
+/*
+ * Asynchronous file output
+ *
+ * Each job creates one file from a buffer: open, write, optional fsync and
+ * close. With io_uring the four steps are submitted by the calling thread
+ * and their completions reaped whenever it comes back, so it only blocks
+ * when queue_depth files are in flight. Kernels or headers without
+ * io_uring (before 5.6) get a small pool of threads doing the same with
+ * plain system calls.
+ *
+ * Either way the completions are reported in submission order, from the
+ * thread calling cutter_async_submit() and cutter_async_wait(), so the
+ * caller can record them without locking and in the order it produced them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// IORING_OP_OPENAT and IORING_OP_CLOSE came with the 5.6 headers
+#ifdef IORING_FEAT_RW_CUR_POS
+#define HAVE_IO_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "internal.h"
+
+#define ASYNC_THREADS 4
+
+enum AsyncStep {
+    STEP_QUEUED,
+    STEP_OPEN,
+    STEP_WRITE,
+    STEP_FSYNC,
+    STEP_CLOSE,
+    STEP_DONE,
+};
+
+typedef struct AsyncJob {
+    struct AsyncJob *next;
+    char *filename;
+    uint8_t *data;
+    size_t size;
+    size_t written;
+    int fd;
+    enum AsyncStep step;
+    // First error of the job
+    int ret;
+} AsyncJob;
+
+#ifdef HAVE_IO_URING
+typedef struct Uring {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    // Queued entries not handed to the kernel yet
+    unsigned int to_submit;
+} Uring;
+#endif
+
+struct CutterAsyncWriter {
+    int flags;
+    int depth;
+    cutter_write_cb done;
+    void *opaque;
+
+    // Every job not reported yet, in submission order
+    AsyncJob *head;
+    AsyncJob *tail;
+    int in_flight;
+    int first_error;
+
+#ifdef HAVE_IO_URING
+    Uring ring;
+    int use_ring;
+#endif
+
+    // Thread pool fallback, the lock protects the jobs and the counters
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t finished;
+    AsyncJob *next_queued;
+    pthread_t threads[ASYNC_THREADS];
+    int nb_threads;
+    int stopping;
+};
+
+static void free_job(AsyncJob *job)
+{
+    free(job->filename);
+    free(job->data);
+    free(job);
+}
+
+// Detach the completed jobs at the head of the queue, under the lock with the thread pool
+static AsyncJob *take_done(CutterAsyncWriter *writer)
+{
+    AsyncJob *done = writer->head, *last = NULL;
+
+    for (AsyncJob *job = writer->head; job && job->step == STEP_DONE; job = job->next)
+        last = job;
+    if (!last)
+        return NULL;
+
+    writer->head = last->next;
+    if (!writer->head)
+        writer->tail = NULL;
+    last->next = NULL;
+    return done;
+}
+
+// Report detached jobs, outside of the lock so the callback does not hold up the workers
+static void deliver(CutterAsyncWriter *writer, AsyncJob *done)
+{
+    while (done) {
+        AsyncJob *job = done;
+
+        done = job->next;
+        if (job->ret < 0) {
+            cutter_log_error("Failed to write %s: %s", job->filename, av_err2str(job->ret));
+            if (!writer->first_error)
+                writer->first_error = job->ret;
+        } else {
+            cutter_metrics_add_bytes(job->size);
+        }
+        if (writer->done)
+            writer->done(writer->opaque, job->filename, job->ret);
+        free_job(job);
+    }
+}
+
+#ifdef HAVE_IO_URING
+
+static int uring_setup(Uring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    int ret;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return AVERROR(errno);
+
+    // Only the steps of the jobs are needed, all of them since 5.6
+    size_t probe_size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    probe = calloc(1, probe_size);
+    if (!probe) {
+        close(ring->fd);
+        return AVERROR(ENOMEM);
+    }
+    ret = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256);
+    if (ret < 0 || probe->last_op < IORING_OP_CLOSE ||
+        !(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) ||
+        !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) ||
+        !(probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED)) {
+        free(probe);
+        close(ring->fd);
+        return AVERROR(ENOSYS);
+    }
+    free(probe);
+
+    ring->entries = params.sq_entries;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sq_map_size = ring->cq_map_size = FFMAX(ring->sq_map_size, ring->cq_map_size);
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+        goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED)
+            goto fail;
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    uint8_t *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
+
+fail:
+    ret = AVERROR(errno);
+    if (ring->sq_map != MAP_FAILED)
+        munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->cq_map && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    close(ring->fd);
+    return ret;
+}
+
+static void uring_free(Uring *ring)
+{
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+// Each job has at most one entry in flight and there are fewer jobs than
+// entries, so the submission queue never overflows
+static struct io_uring_sqe *uring_get_sqe(Uring *ring, AsyncJob *job)
+{
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t) (uintptr_t) job;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+static void uring_queue_step(CutterAsyncWriter *writer, AsyncJob *job)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&writer->ring, job);
+
+    switch (job->step) {
+    case STEP_OPEN:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t) (uintptr_t) job->filename;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        sqe->len = 0644;
+        break;
+    case STEP_WRITE:
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = job->fd;
+        sqe->addr = (uint64_t) (uintptr_t) (job->data + job->written);
+        sqe->len = FFMIN(job->size - job->written, 1U << 30);
+        sqe->off = job->written;
+        break;
+    case STEP_FSYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = job->fd;
+        break;
+    default:
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = job->fd;
+        break;
+    }
+}
+
+// Move the job to its next step after a completion with result res
+static void uring_advance(CutterAsyncWriter *writer, AsyncJob *job, int res)
+{
+    switch (job->step) {
+    case STEP_OPEN:
+        if (res < 0) {
+            job->ret = res;
+            job->step = STEP_DONE;
+            writer->in_flight--;
+            return;
+        }
+        job->fd = res;
+        job->step = job->size ? STEP_WRITE : STEP_CLOSE;
+        break;
+    case STEP_WRITE:
+        if (res <= 0) {
+            job->ret = res < 0 ? res : AVERROR(EIO);
+            job->step = STEP_CLOSE;
+            break;
+        }
+        job->written += res;
+        if (job->written < job->size)
+            break;
+        job->step = writer->flags & CUTTER_ASYNC_FSYNC ? STEP_FSYNC : STEP_CLOSE;
+        break;
+    case STEP_FSYNC:
+        if (res < 0)
+            job->ret = res;
+        job->step = STEP_CLOSE;
+        break;
+    default:
+        if (res < 0 && !job->ret)
+            job->ret = res;
+        job->step = STEP_DONE;
+        writer->in_flight--;
+        return;
+    }
+    uring_queue_step(writer, job);
+}
+
+// Submit the queued entries and process the completions, waiting for at least one if wait is set
+static int uring_run(CutterAsyncWriter *writer, int wait)
+{
+    Uring *ring = &writer->ring;
+
+    do {
+        unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait ? 1 : 0, flags, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        ring->to_submit -= ret;
+
+        unsigned int head = *ring->cq_head, reaped = 0;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+            uring_advance(writer, (AsyncJob *) (uintptr_t) cqe->user_data, cqe->res);
+            head++;
+            reaped++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        // New steps were queued by the completions, or nothing came back yet
+        if (reaped || ring->to_submit)
+            wait = 0;
+    } while (wait || ring->to_submit);
+
+    return 0;
+}
+
+#endif
+
+// Thread pool fallback: the same steps with blocking system calls
+static int run_job(const CutterAsyncWriter *writer, AsyncJob *job)
+{
+    cutter_unshare_file(job->filename);
+    int fd = open(job->filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return AVERROR(errno);
+
+    int ret = 0;
+    while (job->written < job->size) {
+        ssize_t written = write(fd, job->data + job->written, job->size - job->written);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0) {
+            ret = written < 0 ? AVERROR(errno) : AVERROR(EIO);
+            break;
+        }
+        job->written += written;
+    }
+    if (ret >= 0 && (writer->flags & CUTTER_ASYNC_FSYNC) && fsync(fd) < 0)
+        ret = AVERROR(errno);
+    if (close(fd) < 0 && ret >= 0)
+        ret = AVERROR(errno);
+    return ret;
+}
+
+static void *worker_main(void *opaque)
+{
+    CutterAsyncWriter *writer = opaque;
+
+    pthread_mutex_lock(&writer->lock);
+    while (1) {
+        while (!writer->next_queued && !writer->stopping)
+            pthread_cond_wait(&writer->work, &writer->lock);
+        if (!writer->next_queued)
+            break;
+
+        AsyncJob *job = writer->next_queued;
+        writer->next_queued = job->next;
+        job->step = STEP_WRITE;
+        pthread_mutex_unlock(&writer->lock);
+
+        int ret = run_job(writer, job);
+
+        pthread_mutex_lock(&writer->lock);
+        job->ret = ret;
+        job->step = STEP_DONE;
+        writer->in_flight--;
+        pthread_cond_signal(&writer->finished);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+int cutter_async_open(CutterAsyncWriter **writer_out, int depth, int flags, cutter_write_cb done, void *opaque)
+{
+    CutterAsyncWriter *writer;
+    int ret;
+
+    *writer_out = NULL;
+    writer = calloc(1, sizeof(*writer));
+    if (!writer)
+        return AVERROR(ENOMEM);
+    writer->depth = depth > 0 ? depth : 64;
+    writer->flags = flags;
+    writer->done = done;
+    writer->opaque = opaque;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->work, NULL);
+    pthread_cond_init(&writer->finished, NULL);
+
+#ifdef HAVE_IO_URING
+    ret = uring_setup(&writer->ring, writer->depth);
+    if (ret >= 0) {
+        writer->use_ring = 1;
+        // The kernel rounds the entries up to a power of two
+        writer->depth = FFMIN(writer->depth, (int) writer->ring.entries);
+        cutter_log("*** Asynchronous output through io_uring, %d files in flight", writer->depth);
+        *writer_out = writer;
+        return 0;
+    }
+    cutter_log("io_uring is not usable (%s), writing from a thread pool", av_err2str(ret));
+#endif
+
+    for (; writer->nb_threads < ASYNC_THREADS; writer->nb_threads++) {
+        ret = pthread_create(&writer->threads[writer->nb_threads], NULL, worker_main, writer);
+        if (ret) {
+            ret = AVERROR(ret);
+            cutter_async_close(&writer);
+            return ret;
+        }
+    }
+
+    *writer_out = writer;
+    return 0;
+}
+
+int cutter_async_submit(CutterAsyncWriter *writer, const char *filename, uint8_t *data, size_t size)
+{
+    AsyncJob *job = calloc(1, sizeof(*job));
+    if (!job || !(job->filename = strdup(filename))) {
+        free(job);
+        free(data);
+        return AVERROR(ENOMEM);
+    }
+    job->data = data;
+    job->size = size;
+    job->fd = -1;
+
+#ifdef HAVE_IO_URING
+    if (writer->use_ring) {
+        // Make room by waiting for the oldest completions
+        while (writer->in_flight >= writer->depth) {
+            int ret = uring_run(writer, 1);
+            if (ret < 0) {
+                free_job(job);
+                return ret;
+            }
+        }
+
+        // The ring only opens, an output linked from the cache is unlinked first
+        cutter_unshare_file(filename);
+        job->step = STEP_OPEN;
+        if (writer->tail)
+            writer->tail->next = job;
+        else
+            writer->head = job;
+        writer->tail = job;
+        writer->in_flight++;
+        uring_queue_step(writer, job);
+
+        // The job is queued, a failure of the ring is reported by the next wait
+        int ret = uring_run(writer, 0);
+        if (ret < 0 && !writer->first_error)
+            writer->first_error = ret;
+        deliver(writer, take_done(writer));
+        return 0;
+    }
+#endif
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->in_flight >= writer->depth)
+        pthread_cond_wait(&writer->finished, &writer->lock);
+
+    job->step = STEP_QUEUED;
+    if (writer->tail)
+        writer->tail->next = job;
+    else
+        writer->head = job;
+    writer->tail = job;
+    if (!writer->next_queued)
+        writer->next_queued = job;
+    writer->in_flight++;
+    pthread_cond_signal(&writer->work);
+    AsyncJob *done = take_done(writer);
+    pthread_mutex_unlock(&writer->lock);
+
+    deliver(writer, done);
+    return 0;
+}
+
+int cutter_async_wait(CutterAsyncWriter *writer)
+{
+    int ret = 0;
+
+#ifdef HAVE_IO_URING
+    if (writer->use_ring) {
+        while (writer->in_flight > 0 && ret >= 0)
+            ret = uring_run(writer, 1);
+        deliver(writer, take_done(writer));
+        return ret < 0 ? ret : writer->first_error;
+    }
+#endif
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->in_flight > 0)
+        pthread_cond_wait(&writer->finished, &writer->lock);
+    AsyncJob *done = take_done(writer);
+    pthread_mutex_unlock(&writer->lock);
+
+    deliver(writer, done);
+    return writer->first_error;
+}
+
+int cutter_async_close(CutterAsyncWriter **writer_ptr)
+{
+    CutterAsyncWriter *writer = *writer_ptr;
+
+    if (!writer)
+        return 0;
+
+    int ret = cutter_async_wait(writer);
+
+#ifdef HAVE_IO_URING
+    if (writer->use_ring) {
+        uring_free(&writer->ring);
+        // Only left after a failure of the ring itself, their files may be incomplete
+        while (writer->head) {
+            AsyncJob *job = writer->head;
+            writer->head = job->next;
+            free_job(job);
+        }
+    }
+#endif
+
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = 1;
+    pthread_cond_broadcast(&writer->work);
+    pthread_mutex_unlock(&writer->lock);
+    for (int i = 0; i < writer->nb_threads; i++)
+        pthread_join(writer->threads[i], NULL);
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->work);
+    pthread_cond_destroy(&writer->finished);
+    free(writer);
+    *writer_ptr = NULL;
+    return ret;
+}
@@ -0,0 +1,228 @@
+/*
+ * In-memory LRU cache of decoded frames and their encoded PNG
+ *
+ * Each entry keeps a reference to a decoded AVFrame, so a later request
+ * landing on the same frame skips the seek and the decode, and once the
+ * frame has been saved, the PNG bytes too, so saving it again skips the
+ * encoder. Entries are kept most recently used first and the least
+ * recently used ones are dropped once the byte budget is exceeded.
+ *
+ * The budget holds a few dozen full frames at most, so lookups simply
+ * walk the list.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+struct CutterCacheEntry {
+    CutterCache *cache;
+    CutterCacheKey key;
+    // Requests for any timestamp in [from_pts, pts] are answered by this frame
+    int64_t from_pts;
+    int64_t pts;
+    AVFrame *frame;
+    uint8_t *encoded;
+    size_t encoded_size;
+    // Memory charged to the budget
+    size_t bytes;
+    struct CutterCacheEntry *prev;
+    struct CutterCacheEntry *next;
+};
+
+struct CutterCache {
+    size_t max_bytes;
+    size_t bytes;
+    // Most recently used first
+    CutterCacheEntry *head;
+    CutterCacheEntry *tail;
+};
+
+int cutter_cache_alloc(CutterCache **cache, size_t max_bytes)
+{
+    *cache = calloc(1, sizeof(**cache));
+    if (!*cache)
+        return AVERROR(ENOMEM);
+    (*cache)->max_bytes = max_bytes;
+    return 0;
+}
+
+static void unlink_entry(CutterCache *cache, CutterCacheEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void push_front(CutterCache *cache, CutterCacheEntry *entry)
+{
+    entry->next = cache->head;
+    if (cache->head)
+        cache->head->prev = entry;
+    cache->head = entry;
+    if (!cache->tail)
+        cache->tail = entry;
+}
+
+static void free_entry(CutterCache *cache, CutterCacheEntry *entry)
+{
+    unlink_entry(cache, entry);
+    cache->bytes -= entry->bytes;
+    av_frame_free(&entry->frame);
+    free(entry->encoded);
+    free(entry);
+}
+
+// Drop the least recently used entries until the budget is met, keep is never dropped
+static void evict(CutterCache *cache, const CutterCacheEntry *keep)
+{
+    CutterCacheEntry *entry = cache->tail;
+
+    while (cache->bytes > cache->max_bytes && entry) {
+        CutterCacheEntry *prev = entry->prev;
+        if (entry != keep)
+            free_entry(cache, entry);
+        entry = prev;
+    }
+}
+
+void cutter_cache_free(CutterCache **cache)
+{
+    if (!*cache)
+        return;
+
+    while ((*cache)->head)
+        free_entry(*cache, (*cache)->head);
+    free(*cache);
+    *cache = NULL;
+}
+
+int cutter_cache_key(CutterExtractor *ex, CutterCacheKey *key)
+{
+    struct stat st;
+
+    // Only local files have an identity that survives their reopening
+    if (stat(ex->filename, &st) < 0)
+        return AVERROR(errno);
+
+    // Zeroed as a whole, keys are compared with memcmp()
+    memset(key, 0, sizeof(*key));
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime = st.st_mtime;
+    key->stream_index = ex->video_stream_index;
+    key->sws_flags = ex->options.sws_flags;
+    key->blank_mean = ex->options.blank_mean;
+    key->blank_range = ex->options.blank_range;
+    return 0;
+}
+
+CutterCacheEntry *cutter_cache_lookup(CutterCache *cache, const CutterCacheKey *key, int64_t pts)
+{
+    for (CutterCacheEntry *entry = cache->head; entry; entry = entry->next) {
+        if (entry->from_pts <= pts && pts <= entry->pts && !memcmp(&entry->key, key, sizeof(*key))) {
+            unlink_entry(cache, entry);
+            push_front(cache, entry);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static size_t frame_bytes(const AVFrame *frame)
+{
+    size_t bytes = 0;
+
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+        bytes += frame->buf[i]->size;
+    return bytes;
+}
+
+int cutter_cache_insert(CutterCache *cache, const CutterCacheKey *key, int64_t from_pts,
+                        const AVFrame *frame, CutterCacheEntry **entry_out)
+{
+    int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+    CutterCacheEntry *entry;
+
+    // Another timestamp may already have landed on this frame, widen its range
+    for (entry = cache->head; entry; entry = entry->next) {
+        if (entry->pts == pts && !memcmp(&entry->key, key, sizeof(*key))) {
+            entry->from_pts = FFMIN(entry->from_pts, from_pts);
+            unlink_entry(cache, entry);
+            push_front(cache, entry);
+            *entry_out = entry;
+            return 0;
+        }
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry)
+        return AVERROR(ENOMEM);
+    entry->frame = av_frame_alloc();
+    if (!entry->frame) {
+        free(entry);
+        return AVERROR(ENOMEM);
+    }
+
+    // A new reference, the decoder keeps reusing its own frame
+    int ret = av_frame_ref(entry->frame, frame);
+    if (ret < 0) {
+        av_frame_free(&entry->frame);
+        free(entry);
+        return ret;
+    }
+
+    entry->cache = cache;
+    entry->key = *key;
+    entry->from_pts = FFMIN(from_pts, pts);
+    entry->pts = pts;
+    entry->bytes = sizeof(*entry) + frame_bytes(frame);
+    cache->bytes += entry->bytes;
+    push_front(cache, entry);
+    evict(cache, entry);
+
+    *entry_out = entry;
+    return 0;
+}
+
+const AVFrame *cutter_cache_frame(const CutterCacheEntry *entry)
+{
+    return entry->frame;
+}
+
+int cutter_cache_encoded(const CutterCacheEntry *entry, const uint8_t **data, size_t *size)
+{
+    if (!entry->encoded)
+        return 0;
+    *data = entry->encoded;
+    *size = entry->encoded_size;
+    return 1;
+}
+
+void cutter_cache_store_encoded(CutterCacheEntry *entry, uint8_t *data, size_t size)
+{
+    CutterCache *cache = entry->cache;
+
+    if (entry->encoded) {
+        free(data);
+        return;
+    }
+    entry->encoded = data;
+    entry->encoded_size = size;
+    entry->bytes += size;
+    cache->bytes += size;
+
+    unlink_entry(cache, entry);
+    push_front(cache, entry);
+    evict(cache, entry);
+}
@@ -0,0 +1,519 @@
+/*
+ * libcutter - extract still frames from a media file.
+ *
+ * The library wraps the demux -> decode -> convert pipeline behind an
+ * opaque extractor handle, so the same open file and decoder can be
+ * reused across many requests:
+ *
+ *     CutterExtractor *ex = NULL;
+ *     if (cutter_open(&ex, "input.mp4", NULL) < 0)
+ *         ...
+ *     cutter_extract_at(ex, 1500, my_callback, my_data);
+ *     cutter_close(&ex);
+ *
+ * Every function returning an int uses the FFmpeg convention:
+ * >= 0 on success and a negative AVERROR code on failure.
+ */
+
+#ifndef LIBCUTTER_CUTTER_H
+#define LIBCUTTER_CUTTER_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Opaque extractor handle, one per opened input
+typedef struct CutterExtractor CutterExtractor;
+
+// Frame cache, may be shared by several extractors
+typedef struct CutterCache CutterCache;
+typedef struct CutterCacheEntry CutterCacheEntry;
+
+// Options applied when the input is opened
+typedef struct CutterOptions {
+    // Index of the video stream to decode, -1 picks the first video stream
+    int stream_index;
+    // libswscale flags used for the YUV -> RGB24 conversion
+    int sws_flags;
+    // Probe only a few KiB of the input and skip avformat_find_stream_info()
+    // when the container already describes the video stream (always for MP4/MOV)
+    int fast_probe;
+    // Only deliver frames opening a new shot: mean absolute luma difference
+    // with the previous frame, from 0 to 1. 0 disables the detection
+    double scene_threshold;
+    // Drop frames whose 64-bit perceptual hash is less than this many bits
+    // away from the last delivered frame. 0 disables the suppression
+    int dedupe_distance;
+    // Skip black or blank frames: mean luma below blank_mean or luma range
+    // (max - min) below blank_range. 0 disables each check.
+    // cutter_extract_at() then delivers the first frame that is not blank.
+    int blank_mean;
+    int blank_range;
+} CutterOptions;
+
+// Stream information, filled by cutter_probe()
+typedef struct CutterProbe {
+    const char *format_name;
+    const char *codec_name;
+    int width;
+    int height;
+    // enum AVPixelFormat of the decoded frames
+    int pix_fmt;
+    // Duration of the container in milliseconds, -1 if unknown
+    int64_t duration_ms;
+    int64_t bit_rate;
+    // Average frame rate, 0 if unknown
+    double frame_rate;
+} CutterProbe;
+
+// A converted RGB24 frame handed to the caller
+typedef struct CutterImage {
+    // Packed RGB24 rows, only valid for the duration of the callback
+    const uint8_t *data;
+    int linesize;
+    int width;
+    int height;
+    // Presentation timestamp in stream time base and in milliseconds
+    int64_t pts;
+    int64_t ts_ms;
+    // Timestamp asked to cutter_extract_many() this frame answers, -1 otherwise
+    int64_t requested_ms;
+    // 0-based display-order position of the frame in the whole stream,
+    // set by cutter_iterate_shard() and -1 otherwise
+    int64_t frame_index;
+    // 1-based number of the frame in decode order
+    int frame_number;
+    int key_frame;
+    char pict_type;
+    // Cache slot of the frame, NULL without a cache. cutter_save_png() keeps
+    // the encoded bytes there and writes them back on the next save.
+    CutterCacheEntry *cache_entry;
+} CutterImage;
+
+/*
+ * Called once per delivered frame.
+ * Return 0 to keep going, > 0 to stop the current request
+ * and < 0 to abort it with that error code.
+ */
+typedef int (*cutter_frame_cb)(const CutterImage *image, void *opaque);
+
+typedef void (*cutter_log_cb)(void *opaque, const char *fmt, va_list args);
+
+// A message is logged when its level is at most the current one
+typedef enum CutterLogLevel {
+    CUTTER_LOG_QUIET = -1,
+    CUTTER_LOG_ERROR,
+    // Progress of the extraction, the default
+    CUTTER_LOG_INFO,
+    // One message per output and the stream details
+    CUTTER_LOG_VERBOSE,
+    // One message per packet and per decoded frame
+    CUTTER_LOG_DEBUG,
+} CutterLogLevel;
+
+// Fill options with the default values
+void cutter_options_default(CutterOptions *options);
+
+// Open the input, select the video stream and open its decoder.
+// options may be NULL to use the defaults.
+int cutter_open(CutterExtractor **extractor, const char *filename, const CutterOptions *options);
+
+// Release the extractor and every resource it holds, *extractor is set to NULL
+void cutter_close(CutterExtractor **extractor);
+
+// Describe the selected video stream
+int cutter_probe(CutterExtractor *extractor, CutterProbe *probe);
+
+// Deliver the first frame displayed at or after ts_ms
+int cutter_extract_at(CutterExtractor *extractor, int64_t ts_ms, cutter_frame_cb callback, void *opaque);
+
+// Deliver the first frame displayed at or after each of the count timestamps.
+// The targets are sorted and planned per GOP so no frame is decoded twice,
+// the callback receives them in increasing order with image->requested_ms set.
+// Returns the number of targets delivered.
+int cutter_extract_many(CutterExtractor *extractor, const int64_t *ts_ms, size_t count,
+                        cutter_frame_cb callback, void *opaque);
+
+// Same as cutter_extract_at() but copy the frame into a caller-provided buffer.
+// The buffer must hold at least height rows of linesize bytes (width * 3 minimum).
+// image (optional) receives the frame description, its data points to buffer.
+int cutter_extract_at_buffer(CutterExtractor *extractor, int64_t ts_ms,
+                             uint8_t *buffer, int linesize, CutterImage *image);
+
+// Deliver every frame displayed in [start_ms, end_ms], end_ms < 0 means until the end
+int cutter_extract_range(CutterExtractor *extractor, int64_t start_ms, int64_t end_ms,
+                         cutter_frame_cb callback, void *opaque);
+
+// Deliver every frame of the stream from the beginning
+int cutter_iterate_frames(CutterExtractor *extractor, cutter_frame_cb callback, void *opaque);
+
+// Resume cutter_iterate_frames() after the frame with this pts (CutterImage.pts)
+// delivered by an earlier run. Decoding restarts on the keyframe before it, or on
+// the first frame when the selection counts frames. The frames up to resume_pts
+// still feed the selection and the content filters but are not delivered again.
+int cutter_iterate_frames_from(CutterExtractor *extractor, int64_t resume_pts,
+                               cutter_frame_cb callback, void *opaque);
+
+// Deliver the frames of one of nb_shards keyframe-aligned time slices of the stream,
+// as cutter_iterate_frames() would have in a single run. Several processes can
+// decode one shard each: together they deliver the same frames, each with its
+// frame_index in the whole stream. The slice bounds come from the loaded index or
+// from a demux-only pass. Fails with AVERROR(ENOSYS) for a selection keeping one
+// frame out of n inside ranges, whose count depends on every frame before, and
+// for duplicate removal or scene detection with blank frames skipped, whose
+// reference frame may lie anywhere before the slice.
+int cutter_iterate_shard(CutterExtractor *extractor, int shard, int nb_shards,
+                         cutter_frame_cb callback, void *opaque);
+
+// Carry on a shard stopped after delivering the frame at resume_pts, within the
+// same slice and with the same frame_index numbering
+int cutter_iterate_shard_from(CutterExtractor *extractor, int shard, int nb_shards, int64_t resume_pts,
+                              cutter_frame_cb callback, void *opaque);
+
+// Decode the keyframes nearest to candidates timestamps spread over the stream,
+// score them on their luma plane and deliver only the best one
+int cutter_extract_best(CutterExtractor *extractor, int candidates, cutter_frame_cb callback, void *opaque);
+
+// Walk the video packets once, demux only, and store every keyframe
+// position into a sidecar. index_path NULL writes <input>.cutidx
+int cutter_index_build(CutterExtractor *extractor, const char *index_path);
+
+// Map a sidecar written by cutter_index_build(), the following seeks use it.
+// Fails with AVERROR_INVALIDDATA when the sidecar does not match the input.
+int cutter_index_load(CutterExtractor *extractor, const char *index_path);
+
+/*
+ * Frame selection, applied by cutter_iterate_frames() and cutter_extract_range().
+ * Frames rejected by the selection are never converted nor delivered.
+ * Every configured criterion must accept a frame for it to be delivered.
+ */
+typedef struct CutterSelection CutterSelection;
+
+int cutter_selection_alloc(CutterSelection **selection);
+void cutter_selection_free(CutterSelection **selection);
+
+// Keep one frame out of every n
+int cutter_selection_set_every(CutterSelection *selection, int n);
+
+// Resample to fps frames per second from the presentation timestamps
+int cutter_selection_set_fps(CutterSelection *selection, double fps);
+
+// Keep the frames displayed in [start_ms, end_ms], may be called several times
+int cutter_selection_add_range(CutterSelection *selection, int64_t start_ms, int64_t end_ms);
+
+// Keep the frames with these 0-based display-order numbers,
+// counted from the first frame of each request
+int cutter_selection_add_frames(CutterSelection *selection, const int64_t *frames, size_t count);
+
+// Attach a selection to the extractor, NULL removes it.
+// The selection is not owned and must outlive its use by the extractor.
+void cutter_set_selection(CutterExtractor *extractor, CutterSelection *selection);
+
+/*
+ * LRU cache of decoded frames and of their PNG encoding, bounded by max_bytes.
+ * Entries are keyed by the input file identity, the frame timestamp and the
+ * delivery options. With a cache attached, cutter_extract_at() and
+ * cutter_extract_many() answer the timestamps they already decoded without
+ * seeking nor decoding, and cutter_save_png() reuses the bytes it encoded.
+ */
+int cutter_cache_alloc(CutterCache **cache, size_t max_bytes);
+// Must be called after every extractor using the cache is done with it
+void cutter_cache_free(CutterCache **cache);
+
+// Attach a cache to the extractor, NULL detaches it.
+// Inputs that are not local files are never cached.
+void cutter_set_cache(CutterExtractor *extractor, CutterCache *cache);
+
+/*
+ * On-disk cache of the written outputs, shareable by concurrent processes.
+ * Objects are addressed by a fingerprint of the input (size, mtime and sampled
+ * blocks), the delivery options and the position of the frame: the requested
+ * timestamp for images delivered by cutter_extract_many(), the pts otherwise.
+ * Outputs are hardlinked (or cloned across filesystems) to and from the cache,
+ * so they must be replaced and never rewritten in place.
+ */
+typedef struct CutterOutputCache CutterOutputCache;
+
+// The extractor must outlive the cache
+int cutter_output_cache_open(CutterOutputCache **cache, CutterExtractor *extractor, const char *directory);
+void cutter_output_cache_close(CutterOutputCache **cache);
+
+// Link the output stored for the frame requested at ts_ms to filename,
+// before anything is decoded. Returns 1 on a hit and 0 on a miss.
+int cutter_output_cache_fetch_at(CutterOutputCache *cache, int64_t ts_ms, const char *filename);
+
+// Same for a delivered image, which saves its encoding
+int cutter_output_cache_fetch(CutterOutputCache *cache, const CutterImage *image, const char *filename);
+
+// Publish the file written for a delivered image
+int cutter_output_cache_store(CutterOutputCache *cache, const CutterImage *image, const char *filename);
+
+/*
+ * Append-only manifest of the completed outputs (number, pts, size, checksum,
+ * filename), so an interrupted job can resume where it stopped.
+ */
+typedef struct CutterManifest CutterManifest;
+
+// Open or create the manifest. With resume, the entries are checked against
+// their files and only the valid prefix is kept, otherwise it is emptied.
+int cutter_manifest_open(CutterManifest **manifest, const char *path, int resume);
+void cutter_manifest_close(CutterManifest **manifest);
+
+// Number and pts of the last valid output, returns 0 when there is none
+int cutter_manifest_last(const CutterManifest *manifest, int *number, int64_t *pts);
+
+// Record an output once its file is complete
+int cutter_manifest_append(CutterManifest *manifest, int number, int64_t pts, const char *filename);
+
+// Encode a delivered frame into a .png file
+int cutter_save_png(const CutterImage *image, const char *filename);
+
+/*
+ * Output file names from a template with the fields {stem} (input file name
+ * without directory nor extension), {n} (output number), {pts}, {ts_ms}, {w}
+ * and {h}. Numeric fields take a width, {n:06} pads the number with zeros.
+ */
+typedef struct CutterPathTemplate CutterPathTemplate;
+
+typedef enum CutterFanout {
+    CUTTER_FANOUT_NONE,
+    // Directories 000, 001... of fanout_size consecutive outputs each
+    CUTTER_FANOUT_NUMERIC,
+    // fanout_size directories named by the hash of the file name, in hexadecimal
+    CUTTER_FANOUT_HASHED,
+} CutterFanout;
+
+int cutter_path_template_parse(CutterPathTemplate **tmpl, const char *pattern, const char *input,
+                               CutterFanout fanout, int fanout_size);
+void cutter_path_template_free(CutterPathTemplate **tmpl);
+
+// Whether the names depend on the timestamps of the delivered frame, not only on
+// its number and size
+int cutter_path_template_frame_dependent(const CutterPathTemplate *tmpl);
+
+// Expand the template for an output, only number, pts, ts_ms, width and height of image are used
+int cutter_path_format(CutterPathTemplate *tmpl, int number, const CutterImage *image, char *path, size_t size);
+
+// Create the directory of an expanded path, once: the directories seen are remembered
+int cutter_path_mkdir(CutterPathTemplate *tmpl, const char *path);
+
+// mkdir -p
+int cutter_mkdirs(const char *path);
+
+/*
+ * Destination of encoded images. Each image is written as begin(), any
+ * number of write() and end(), so a sink can frame them or pass them on.
+ * The built-in sinks cover memory, file descriptors and tar streams.
+ */
+typedef struct CutterSink CutterSink;
+
+typedef struct CutterSinkCallbacks {
+    // Start of an image, name is the output name or "". May be NULL.
+    int (*begin)(void *opaque, const char *name);
+    int (*write)(void *opaque, const uint8_t *data, size_t size);
+    // The image is complete. May be NULL.
+    int (*end)(void *opaque);
+} CutterSinkCallbacks;
+
+// Sink calling the application back, the callbacks are copied
+int cutter_sink_alloc(CutterSink **sink, const CutterSinkCallbacks *callbacks, void *opaque);
+
+// Keep the bytes of the last image in a growable buffer, see cutter_sink_memory_data()
+int cutter_sink_alloc_memory(CutterSink **sink);
+
+// Write to fd (file, pipe or socket) in chunks of buffer_size bytes, 0 for 1 MiB.
+// The images are concatenated and fd is not closed by the sink.
+int cutter_sink_alloc_fd(CutterSink **sink, int fd, size_t buffer_size);
+// Same on a file created or truncated, and closed with the sink
+int cutter_sink_open_file(CutterSink **sink, const char *filename, size_t buffer_size);
+
+// Write each image as a member of a tar stream into output, which must outlive
+// the sink. Closing the sink ends the archive but does not close output.
+int cutter_sink_alloc_tar(CutterSink **sink, CutterSink *output);
+
+// Outcome of a file written in the background, ret is 0 or the first error
+typedef void (*cutter_write_cb)(void *opaque, const char *filename, int ret);
+
+// fsync() each file before closing it
+#define CUTTER_ASYNC_FSYNC 1
+
+// Write each image to the file named by its begin() in the background, through
+// io_uring when the kernel has it (5.6+) and a few threads otherwise. end() only
+// queues the image, at most queue_depth files (0 for 64) are in flight. done may
+// be NULL, it is called in the order of the images by the thread using the sink,
+// from end(), flush() and close(). Flushing waits for every queued file.
+int cutter_sink_open_async(CutterSink **sink, int queue_depth, int flags, cutter_write_cb done, void *opaque);
+
+int cutter_sink_begin(CutterSink *sink, const char *name);
+int cutter_sink_write(CutterSink *sink, const uint8_t *data, size_t size);
+int cutter_sink_end(CutterSink *sink);
+
+// Push the buffered bytes out
+int cutter_sink_flush(CutterSink *sink);
+
+// Bytes of the image of a memory sink, valid until its next image
+int cutter_sink_memory_data(const CutterSink *sink, const uint8_t **data, size_t *size);
+
+// Flush and release the sink, *sink is set to NULL. Returns the first error of the flush.
+int cutter_sink_close(CutterSink **sink);
+
+/*
+ * Publication of the output files: each one is written under a temporary
+ * name from cutter_publisher_temp_name() then committed, which renames it
+ * into place. The sync mode decides when the files are made durable.
+ */
+typedef struct CutterPublisher CutterPublisher;
+
+typedef enum CutterSyncMode {
+    // Renamed right away, no sync
+    CUTTER_SYNC_NONE,
+    // Renamed right away, synced once by cutter_publisher_sync() or closing
+    CUTTER_SYNC_END,
+    // Only renamed once every batch_size files are synced together
+    CUTTER_SYNC_BATCH,
+} CutterSyncMode;
+
+// done, may be NULL, is called with the final name of each file in commit order
+// once it is renamed, or with an error if it could not be published
+int cutter_publisher_open(CutterPublisher **publisher, CutterSyncMode mode, int batch_size,
+                          cutter_write_cb done, void *opaque);
+int cutter_publisher_temp_name(CutterPublisher *publisher, const char *filename, char *temp, size_t size);
+// The temporary file must be complete and closed
+int cutter_publisher_commit(CutterPublisher *publisher, const char *temp, const char *filename);
+// Sync and publish the files committed so far
+int cutter_publisher_sync(CutterPublisher *publisher);
+// Sync the last files and release the publisher, returns its first error
+int cutter_publisher_close(CutterPublisher **publisher);
+// Delete the temporary files of publishers whose process is gone, in directory and
+// up to depth levels of sub-directories. Returns the number of files removed.
+int cutter_publisher_remove_stale(const char *directory, int depth);
+
+/*
+ * Sprite sheet of thumbnails for scrubbing previews: columns x rows tiles of
+ * one RGB24 atlas, filled in timestamp order, with a WebVTT or JSON map.
+ */
+typedef struct CutterMosaic CutterMosaic;
+
+// tile_width 0 means 160 pixels, tile_height 0 keeps the aspect ratio of the video
+int cutter_mosaic_alloc(CutterMosaic **mosaic, int columns, int rows, int tile_width, int tile_height);
+void cutter_mosaic_free(CutterMosaic **mosaic);
+
+// Fill the tiles with the frames at the count timestamps, or at timestamps spread
+// evenly over the stream when ts_ms is NULL. Returns the number of tiles filled.
+int cutter_extract_mosaic(CutterExtractor *extractor, CutterMosaic *mosaic, const int64_t *ts_ms, size_t count);
+
+// The whole atlas, for cutter_save_png(), valid until the mosaic is freed
+void cutter_mosaic_image(const CutterMosaic *mosaic, CutterImage *image);
+
+// Cues mapping each span of the video to its tile, as image_url#xywh=x,y,w,h
+int cutter_mosaic_write_vtt(const CutterMosaic *mosaic, FILE *fp, const char *image_url);
+// Same with the geometry of the sheet and the timestamps of each tile
+int cutter_mosaic_write_json(const CutterMosaic *mosaic, FILE *fp, const char *image_url);
+
+/*
+ * Animated PNG of the delivered frames. Each frame only stores the rectangle
+ * that changed since the previous one, and lasts until the timestamp of the
+ * next frame that differs.
+ */
+typedef struct CutterApng CutterApng;
+
+// default_delay_ms is the duration of the frames without timestamps and of
+// the last one, loops the number of plays (0 forever)
+int cutter_apng_open(CutterApng **apng, const char *filename, int default_delay_ms, int loops);
+// Every frame must have the size of the first one
+int cutter_apng_add_frame(CutterApng *apng, const CutterImage *image);
+// Write the last frame and the frame count, returns the first error
+int cutter_apng_close(CutterApng **apng);
+
+/*
+ * Lossless frame sequences (.cutseq): full resolution RGB24 frames in one
+ * file, each a keyframe or an XOR delta against the previous frame, LZ4
+ * compressed, with an index for random access.
+ */
+typedef struct CutterSequenceWriter CutterSequenceWriter;
+typedef struct CutterSequence CutterSequence;
+
+typedef struct CutterSequenceInfo {
+    int width;
+    int height;
+    uint64_t count;
+    // Longest chain of deltas decoded to reach a frame, plus one
+    int keyframe_interval;
+} CutterSequenceInfo;
+
+// A keyframe every keyframe_interval frames, the file only appears once closed
+int cutter_sequence_writer_open(CutterSequenceWriter **writer, const char *filename, int keyframe_interval);
+// Every frame must have the size of the first one
+int cutter_sequence_write(CutterSequenceWriter *writer, const CutterImage *image);
+// Write the index and rename the file into place, returns the first error
+int cutter_sequence_writer_close(CutterSequenceWriter **writer);
+
+// Map a sequence for reading. A reader keeps the last decoded frame, use one per thread.
+int cutter_sequence_open(CutterSequence **seq, const char *filename);
+void cutter_sequence_close(CutterSequence **seq);
+void cutter_sequence_info(const CutterSequence *seq, CutterSequenceInfo *info);
+
+// Decode frame n (0-based), image->data is valid until the next read or closing.
+// Reading the frames in order decodes each of them once.
+int cutter_sequence_read(CutterSequence *seq, uint64_t n, CutterImage *image);
+
+// Index of the first frame displayed at or after ts_ms, the frame count if none
+uint64_t cutter_sequence_find(const CutterSequence *seq, int64_t ts_ms);
+
+// Encode a delivered frame as a PNG image named name into the sink,
+// level is the zlib compression level or -1 for the default, which reuses
+// the encoding kept by the frame cache
+int cutter_encode_png(const CutterImage *image, const char *name, int level, CutterSink *sink);
+
+// Start timing the demux, decode, convert, encode and write stages of every extractor
+void cutter_metrics_enable(int enable);
+
+// Write the count, total and p50/p95/p99 latencies of each stage, the frame and
+// write throughput since cutter_metrics_enable() and the peak RSS as JSON
+int cutter_metrics_write_json(FILE *fp);
+
+// Samples and total time of one stage ("demux", "decode", "convert", "encode"
+// or "write"), AVERROR(EINVAL) for an unknown name
+int cutter_metrics_stage(const char *name, uint64_t *count, uint64_t *total_ns);
+
+// Bytes written to the PNG files
+uint64_t cutter_metrics_bytes(void);
+
+// Forget the recorded samples and restart the elapsed time, between two runs
+void cutter_metrics_reset(void);
+
+// Record the stage spans of every thread, with the packet or frame pts they work on,
+// into per-thread rings of events_per_thread events (0 for the default of 65536)
+void cutter_trace_enable(size_t events_per_thread);
+
+// Stop the recording and write the spans in Chrome trace-event format,
+// for Perfetto or chrome://tracing. Call once the extracting threads are done.
+int cutter_trace_write(const char *filename);
+
+// Redirect the library log messages, NULL restores the default stderr output
+void cutter_log_set_callback(cutter_log_cb callback, void *opaque);
+
+// Set before the extraction starts, messages above the level are not even formatted
+void cutter_log_set_level(CutterLogLevel level);
+CutterLogLevel cutter_log_get_level(void);
+
+// Format the messages into per-thread rings and call the callback from a
+// background thread instead of the logging one
+int cutter_log_start_async(void);
+// Flush the pending messages and log synchronously again, call it once the
+// other threads stopped logging
+void cutter_log_stop_async(void);
+
+// Log an application message through the library output, keeping it in order
+void cutter_log_vprintf(CutterLogLevel level, const char *fmt, va_list args);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBCUTTER_CUTTER_H
@@ -0,0 +1,1151 @@
+/*
+ * http://ffmpeg.org/doxygen/trunk/index.html
+ *
+ * Main components
+ *
+ * Format (Container) - a wrapper, providing sync, metadata and muxing for the streams.
+ * Stream - a continuous stream (audio or video) of data over time.
+ * Codec - defines how data are enCOded (from Frame to Packet)
+ *        and DECoded (from Packet to Frame).
+ * Packet - are the data (kind of slices of the stream data) to be decoded as raw frames.
+ * Frame - a decoded raw frame (to be encoded or filtered).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "internal.h"
+
+// Describes which decoded frames a request wants delivered
+typedef struct DecodeRequest {
+    // Window in stream time base, AV_NOPTS_VALUE leaves that side open
+    int64_t start_pts;
+    int64_t end_pts;
+    // Stop after this many delivered frames, 0 means no limit
+    int max_frames;
+    int delivered;
+    cutter_frame_cb callback;
+    void *opaque;
+    // When set, receives the decoded frames instead of the selection,
+    // the analysis stages, the conversion and the callback
+    int (*frame_hook)(CutterExtractor *extractor, AVFrame *frame, void *opaque);
+    // Optional frame selection and the GOP skipping state it drives
+    CutterSelection *selection;
+    int skip_gop;
+    int64_t last_pts;
+    // Frames up to this pts were delivered by an earlier run: they only feed
+    // the selection and the analysis stages. AV_NOPTS_VALUE delivers everything
+    int64_t resume_pts;
+    // Position in the stream of the next frame in the window, -1 when not counted
+    int64_t next_index;
+} DecodeRequest;
+
+// Decode packets into frames and hand them to the request
+static int decode_packet(CutterExtractor *extractor, AVPacket *input_packet, DecodeRequest *request);
+
+// Spacing of the best-frame candidates when the duration is unknown
+#define BEST_FALLBACK_SPACING_MS 1000
+
+// Demuxer limits used by the fast probe: 32 KiB and 100 ms
+// A keyframe scan reads every packet of the input: it only pays off for at least
+// this many targets, on average this close together over the whole duration
+#define PLAN_SCAN_MIN_TARGETS 16
+#define PLAN_SCAN_MAX_SPACING_MS 2000
+
+#define FAST_PROBE_SIZE "32768"
+#define FAST_ANALYZE_DURATION "100000"
+
+// Whether the header alone describes the video stream we are going to decode.
+// MP4/MOV sample descriptions carry the geometry and the decoder configuration,
+// the pixel format is then learnt by the decoder itself on the first frame.
+static int stream_info_known(const AVFormatContext *format_context, int stream_index)
+{
+    int trusted = strstr(format_context->iformat->name, "mp4") != NULL;
+
+    for (unsigned int i = 0; i < format_context->nb_streams; i++) {
+        const AVCodecParameters *codecpar = format_context->streams[i]->codecpar;
+
+        if (codecpar->codec_type != AVMEDIA_TYPE_VIDEO || (stream_index >= 0 && (int) i != stream_index))
+            continue;
+
+        return codecpar->codec_id != AV_CODEC_ID_NONE && codecpar->width > 0 && codecpar->height > 0 &&
+               (trusted || codecpar->format != AV_PIX_FMT_NONE);
+    }
+    return 0;
+}
+
+void cutter_options_default(CutterOptions *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->stream_index = -1;
+    options->sws_flags = SWS_BILINEAR;
+}
+
+int cutter_open(CutterExtractor **extractor, const char *filename, const CutterOptions *options)
+{
+    int ret;
+
+    *extractor = NULL;
+
+    CutterExtractor *ex = calloc(1, sizeof(*ex));
+    if (!ex)
+        return AVERROR(ENOMEM);
+
+    if (options)
+        ex->options = *options;
+    else
+        cutter_options_default(&ex->options);
+    ex->video_stream_index = -1;
+
+    ex->filename = strdup(filename);
+    if (!ex->filename) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    cutter_log("*** Initializing all the containers, codecs and protocols...");
+
+    // AVFormatContext holds the header information from the format (Container)
+    // Allocating memory for this component
+    // http://ffmpeg.org/doxygen/trunk/structAVFormatContext.html
+    ex->format_context = avformat_alloc_context();
+    if (!ex->format_context) {
+        cutter_log_error("ERROR could not allocate memory for Format Context");
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    AVDictionary *format_options = NULL;
+    if (ex->options.fast_probe) {
+        // Enough to recognise the container, the decoder learns the rest from the first frames
+        av_dict_set(&format_options, "probesize", FAST_PROBE_SIZE, 0);
+        av_dict_set(&format_options, "analyzeduration", FAST_ANALYZE_DURATION, 0);
+    }
+
+    cutter_log("*** Opening the input file (%s) and loading format (container) header", filename);
+    // Open the file and read its header. The codecs are not opened.
+    // On failure the context is freed by avformat_open_input()
+    // http://ffmpeg.org/doxygen/trunk/group__lavf__decoding.html
+    ret = avformat_open_input(&ex->format_context, filename, NULL, &format_options);
+    av_dict_free(&format_options);
+    if (ret < 0) {
+        cutter_log_error("ERROR could not open the file: %s", av_err2str(ret));
+        goto fail;
+    }
+
+    AVFormatContext *format_context = ex->format_context;
+    cutter_log("*** Format: %s, Duration: %" PRId64 " us, Bitrate: %" PRId64,
+               format_context->iformat->name, format_context->duration, format_context->bit_rate);
+
+    if (ex->options.fast_probe && stream_info_known(format_context, ex->options.stream_index)) {
+        cutter_log("*** Fast probe: trusting the container stream parameters");
+    } else {
+        cutter_log("*** Finding stream info from format...");
+        // read Packets from the Format to get stream information
+        // this function populates format_context->streams
+        // https://ffmpeg.org/doxygen/trunk/group__lavf__decoding.html
+        ret = avformat_find_stream_info(format_context, NULL);
+        if (ret < 0) {
+            cutter_log_error("ERROR could not get the stream info: %s", av_err2str(ret));
+            goto fail;
+        }
+    }
+
+    // The component that knows how to enCOde and DECode the stream
+    // http://ffmpeg.org/doxygen/trunk/structAVCodec.html
+    const AVCodec *input_codec = NULL;
+    // https://ffmpeg.org/doxygen/trunk/structAVCodecParameters.html
+    AVCodecParameters *input_codec_parameters = NULL;
+
+    // Loop though all the streams and print its main information
+    for (unsigned int i = 0; i < format_context->nb_streams; i++) {
+        AVStream *stream = format_context->streams[i];
+        AVCodecParameters *local_codec_parameters = stream->codecpar;
+        cutter_log_verbose("    AVStream->time_base before open coded %d/%d", stream->time_base.num, stream->time_base.den);
+        cutter_log_verbose("    AVStream->r_frame_rate before open coded %d/%d", stream->r_frame_rate.num, stream->r_frame_rate.den);
+        cutter_log_verbose("    AVStream->start_time %" PRId64, stream->start_time);
+        cutter_log_verbose("    AVStream->duration %" PRId64, stream->duration);
+
+        // Finds the registered decoder for a codec ID
+        // https://ffmpeg.org/doxygen/trunk/group__lavc__decoding.html
+        const AVCodec *local_codec = avcodec_find_decoder(local_codec_parameters->codec_id);
+        if (local_codec == NULL) {
+            cutter_log_error("ERROR unsupported codec!");
+            continue;
+        }
+
+        // When the stream is the requested video we store its index, codec parameters and codec
+        if (local_codec_parameters->codec_type == AVMEDIA_TYPE_VIDEO) {
+            int wanted = ex->options.stream_index < 0 ? ex->video_stream_index == -1
+                                                      : (int) i == ex->options.stream_index;
+            if (wanted) {
+                ex->video_stream_index = i;
+                input_codec = local_codec;
+                input_codec_parameters = local_codec_parameters;
+            }
+
+            cutter_log_verbose("Video Codec: resolution %d x %d", local_codec_parameters->width, local_codec_parameters->height);
+        } else if (local_codec_parameters->codec_type == AVMEDIA_TYPE_AUDIO) {
+            cutter_log_verbose("Audio Codec: %d channels, sample rate %d", local_codec_parameters->channels, local_codec_parameters->sample_rate);
+        }
+
+        // Print its name, id and bitrate
+        cutter_log_verbose("\tCodec %s ID %d bit_rate %" PRId64, local_codec->name, local_codec->id, local_codec_parameters->bit_rate);
+    }
+
+    if (ex->video_stream_index == -1) {
+        cutter_log_error("File %s does not contain a usable video stream!", filename);
+        ret = AVERROR_STREAM_NOT_FOUND;
+        goto fail;
+    }
+    ex->video_stream = format_context->streams[ex->video_stream_index];
+
+    // Let the demuxer skip every other stream instead of reading and returning its packets
+    for (unsigned int i = 0; i < format_context->nb_streams; i++) {
+        if ((int) i != ex->video_stream_index)
+            format_context->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    // https://ffmpeg.org/doxygen/trunk/structAVCodecContext.html
+    ex->codec_context = avcodec_alloc_context3(input_codec);
+    if (!ex->codec_context) {
+        cutter_log_error("Failed to allocated memory for AVCodecContext");
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    // Fill the codec context based on the values from the supplied codec parameters
+    // https://ffmpeg.org/doxygen/trunk/group__lavc__core.html
+    ret = avcodec_parameters_to_context(ex->codec_context, input_codec_parameters);
+    if (ret < 0) {
+        cutter_log_error("Failed to copy codec params to codec context");
+        goto fail;
+    }
+    ex->codec_context->pkt_timebase = ex->video_stream->time_base;
+
+    // Initialize the AVCodecContext to use the given AVCodec.
+    // https://ffmpeg.org/doxygen/trunk/group__lavc__core.html
+    ret = avcodec_open2(ex->codec_context, input_codec, NULL);
+    if (ret < 0) {
+        cutter_log_error("Failed to open codec through avcodec_open2");
+        goto fail;
+    }
+
+    // https://ffmpeg.org/doxygen/trunk/structAVFrame.html
+    ex->input_frame = av_frame_alloc();
+    ex->rgb_frame = av_frame_alloc();
+    // https://ffmpeg.org/doxygen/trunk/structAVPacket.html
+    ex->input_packet = av_packet_alloc();
+    if (!ex->input_frame || !ex->rgb_frame || !ex->input_packet) {
+        cutter_log_error("Failed to allocate memory for AVFrame/AVPacket");
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    *extractor = ex;
+    return 0;
+
+fail:
+    cutter_close(&ex);
+    return ret;
+}
+
+void cutter_close(CutterExtractor **extractor)
+{
+    CutterExtractor *ex = *extractor;
+    if (!ex)
+        return;
+
+    avformat_close_input(&ex->format_context);
+    avcodec_free_context(&ex->codec_context);
+    av_packet_free(&ex->input_packet);
+    av_frame_free(&ex->input_frame);
+    av_frame_free(&ex->rgb_frame);
+    sws_freeContext(ex->sws_ctx);
+    cutter_index_free(&ex->index);
+    cutter_analysis_free(ex);
+
+    free(ex->filename);
+    free(ex);
+    *extractor = NULL;
+}
+
+int cutter_probe(CutterExtractor *ex, CutterProbe *probe)
+{
+    AVFormatContext *format_context = ex->format_context;
+    AVStream *stream = ex->video_stream;
+
+    memset(probe, 0, sizeof(*probe));
+    probe->format_name = format_context->iformat->name;
+    probe->codec_name = ex->codec_context->codec->name;
+    probe->width = ex->codec_context->width;
+    probe->height = ex->codec_context->height;
+    probe->pix_fmt = ex->codec_context->pix_fmt;
+    probe->bit_rate = format_context->bit_rate;
+
+    if (format_context->duration != AV_NOPTS_VALUE)
+        probe->duration_ms = av_rescale_q(format_context->duration, AV_TIME_BASE_Q, (AVRational){1, 1000});
+    else if (stream->duration != AV_NOPTS_VALUE)
+        probe->duration_ms = av_rescale_q(stream->duration, stream->time_base, (AVRational){1, 1000});
+    else
+        probe->duration_ms = -1;
+
+    if (stream->avg_frame_rate.num && stream->avg_frame_rate.den)
+        probe->frame_rate = av_q2d(stream->avg_frame_rate);
+    else if (stream->r_frame_rate.num && stream->r_frame_rate.den)
+        probe->frame_rate = av_q2d(stream->r_frame_rate);
+
+    return 0;
+}
+
+// Convert milliseconds since the stream start into stream time base
+static int64_t ms_to_pts(const CutterExtractor *ex, int64_t ms)
+{
+    AVStream *stream = ex->video_stream;
+    int64_t pts = av_rescale_q(ms, (AVRational){1, 1000}, stream->time_base);
+
+    if (stream->start_time != AV_NOPTS_VALUE)
+        pts += stream->start_time;
+    return pts;
+}
+
+static int64_t pts_to_ms(const CutterExtractor *ex, int64_t pts)
+{
+    AVStream *stream = ex->video_stream;
+
+    if (pts == AV_NOPTS_VALUE)
+        return -1;
+    if (stream->start_time != AV_NOPTS_VALUE)
+        pts -= stream->start_time;
+    return av_rescale_q(pts, stream->time_base, (AVRational){1, 1000});
+}
+
+static int64_t frame_pts(const AVFrame *frame)
+{
+    return frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+}
+
+int cutter_seek(CutterExtractor *ex, int64_t pts)
+{
+    const CutterIndexEntry *entry = NULL;
+    int ret;
+
+    if (pts == AV_NOPTS_VALUE)
+        pts = ms_to_pts(ex, 0);
+    if (ex->index)
+        entry = cutter_index_lookup(ex->index, pts);
+
+    // https://ffmpeg.org/doxygen/trunk/group__lavf__decoding.html
+    if (entry && ex->index->byte_seek && entry->pos >= 0)
+        ret = av_seek_frame(ex->format_context, ex->video_stream_index, entry->pos, AVSEEK_FLAG_BYTE);
+    else if (entry)
+        ret = av_seek_frame(ex->format_context, ex->video_stream_index,
+                            entry->dts != AV_NOPTS_VALUE ? entry->dts : entry->pts, AVSEEK_FLAG_BACKWARD);
+    else
+        ret = av_seek_frame(ex->format_context, ex->video_stream_index, pts, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+        cutter_log_error("Error while seeking to %" PRId64 ": %s", pts, av_err2str(ret));
+        return ret;
+    }
+    avcodec_flush_buffers(ex->codec_context);
+    ex->dirty = 0;
+    return 0;
+}
+
+// Translate a decoded frame into RGB24 inside the reusable rgb_frame,
+// scaled down to the tile size of a mosaic request if one is set
+static int convert_frame(CutterExtractor *ex, const AVFrame *input_frame, CutterImage *image)
+{
+    AVFrame *rgb_frame = ex->rgb_frame;
+    int width = ex->tile_width ? ex->tile_width : input_frame->width;
+    int height = ex->tile_height ? ex->tile_height : input_frame->height;
+    int ret;
+
+    // To create the PNG files, the AVFrame data must be translated into RGB24.
+    // The scaler context is only rebuilt when the input geometry or format changes.
+    ex->sws_ctx = sws_getCachedContext(ex->sws_ctx,
+        input_frame->width, input_frame->height, input_frame->format,
+        width, height, AV_PIX_FMT_RGB24,
+        ex->options.sws_flags, NULL, NULL, NULL);
+    if (!ex->sws_ctx) {
+        cutter_log_error("Error while creating the scaler context");
+        return AVERROR(EINVAL);
+    }
+
+    // The scaler may write whole SIMD blocks past the last pixel of a row,
+    // the padded buffer of rgb_frame absorbs them
+    if (rgb_frame->width != width || rgb_frame->height != height) {
+        av_frame_unref(rgb_frame);
+
+        // Set the properties of the output AVFrame
+        rgb_frame->format = AV_PIX_FMT_RGB24;
+        rgb_frame->width = width;
+        rgb_frame->height = height;
+
+        ret = av_frame_get_buffer(rgb_frame, 0);
+        if (ret < 0) {
+            cutter_log_error("Error while preparing RGB frame: %s", av_err2str(ret));
+            return ret;
+        }
+    }
+    uint8_t *dst_data[4] = { rgb_frame->data[0] };
+    int dst_linesize[4] = { rgb_frame->linesize[0] };
+
+    int64_t start = cutter_metrics_start();
+    ret = sws_scale(ex->sws_ctx, (const uint8_t * const *) input_frame->data, input_frame->linesize,
+                    0, input_frame->height, dst_data, dst_linesize);
+    cutter_metrics_record(CUTTER_STAGE_CONVERT, start);
+    if (ret < 0) {
+        cutter_log_error("Error while translating the frame format into RGB24: %s", av_err2str(ret));
+        return ret;
+    }
+
+    image->data = dst_data[0];
+    image->linesize = dst_linesize[0];
+    image->width = width;
+    image->height = height;
+    image->pts = frame_pts(input_frame);
+    image->ts_ms = pts_to_ms(ex, image->pts);
+    image->requested_ms = -1;
+    image->frame_index = -1;
+    image->cache_entry = NULL;
+    image->frame_number = ex->codec_context->frame_number;
+    image->key_frame = input_frame->key_frame;
+    image->pict_type = av_get_picture_type_char(input_frame->pict_type);
+
+    return 0;
+}
+
+// Convert a decoded frame and hand it to the caller
+static int deliver_frame(CutterExtractor *ex, AVFrame *input_frame, int64_t frame_index,
+                         cutter_frame_cb callback, void *opaque)
+{
+    CutterImage image;
+
+    int ret = convert_frame(ex, input_frame, &image);
+    if (ret < 0)
+        return ret;
+    image.frame_index = frame_index;
+
+    return callback(&image, opaque);
+}
+
+// Returns 0 to keep decoding, 1 once the request is complete, < 0 on error
+static int handle_frame(CutterExtractor *ex, AVFrame *input_frame, DecodeRequest *request)
+{
+    int64_t pts = frame_pts(input_frame);
+    int ret;
+
+    // Frames outside the window are dropped before any conversion work
+    if (pts != AV_NOPTS_VALUE) {
+        if (request->start_pts != AV_NOPTS_VALUE && pts < request->start_pts)
+            return 0;
+        if (request->end_pts != AV_NOPTS_VALUE && pts > request->end_pts)
+            return 1;
+        request->last_pts = pts;
+    }
+
+    int64_t frame_index = request->next_index;
+    if (request->next_index >= 0)
+        request->next_index++;
+
+    if (request->frame_hook) {
+        ret = request->frame_hook(ex, input_frame, request->opaque);
+    } else {
+        // Rejected frames never reach the scaler, the request ends once nothing is left to select
+        if (request->selection) {
+            int64_t ts_ms = pts_to_ms(ex, pts);
+            if (!cutter_selection_match(request->selection, ts_ms))
+                return cutter_selection_next_ms(request->selection, ts_ms) < 0;
+        }
+
+        // Blank frames go first, they must neither open a shot nor become the dedupe reference
+        cutter_analysis_begin(ex);
+        if (ex->options.blank_mean > 0 || ex->options.blank_range > 0) {
+            ret = cutter_blank_check(ex, input_frame);
+            if (ret <= 0)
+                return ret;
+        }
+        if (ex->options.scene_threshold > 0) {
+            ret = cutter_scene_check(ex, input_frame);
+            if (ret <= 0)
+                return ret;
+        }
+        if (ex->options.dedupe_distance > 0) {
+            ret = cutter_dedupe_check(ex, input_frame);
+            if (ret <= 0)
+                return ret;
+        }
+
+        if (request->resume_pts != AV_NOPTS_VALUE && pts != AV_NOPTS_VALUE && pts <= request->resume_pts)
+            return 0;
+
+        ret = deliver_frame(ex, input_frame, frame_index, request->callback, request->opaque);
+    }
+    if (ret < 0)
+        return ret;
+    request->delivered++;
+    if (ret > 0 || (request->max_frames && request->delivered >= request->max_frames))
+        return 1;
+
+    return 0;
+}
+
+static int decode_packet(CutterExtractor *ex, AVPacket *input_packet, DecodeRequest *request)
+{
+    AVCodecContext *codec_context = ex->codec_context;
+    AVFrame *input_frame = ex->input_frame;
+
+    // Time spent inside the decoder for this packet, the frame handling excluded
+    int64_t start = cutter_metrics_start();
+    int64_t decode_ns = 0;
+
+    // Supply raw packet data as input to a decoder, NULL enters draining mode
+    // https://ffmpeg.org/doxygen/trunk/group__lavc__decoding.html
+    int ret = avcodec_send_packet(codec_context, input_packet);
+    if (ret < 0) {
+        cutter_log_error("Error while sending a packet to the decoder: %s", av_err2str(ret));
+        return ret;
+    }
+
+    while (1) {
+        // Return decoded output data (into a frame) from a decoder
+        // https://ffmpeg.org/doxygen/trunk/group__lavc__decoding.html
+        ret = avcodec_receive_frame(codec_context, input_frame);
+        if (start) {
+            int64_t now = cutter_time_ns();
+            decode_ns += now - start;
+            cutter_trace_span(CUTTER_STAGE_DECODE, start, now);
+            start = now;
+        }
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            ret = 0;
+            break;
+        } else if (ret < 0) {
+            cutter_log_error("Error while receiving a frame from the decoder: %s", av_err2str(ret));
+            break;
+        }
+        cutter_trace_set_pts(frame_pts(input_frame));
+
+        cutter_log_debug(
+            "Frame %d (type=%c, size=%d bytes, format=%d) pts %" PRId64 " key_frame %d [DTS %d]",
+            codec_context->frame_number,
+            av_get_picture_type_char(input_frame->pict_type),
+            input_frame->pkt_size,
+            input_frame->format,
+            input_frame->pts,
+            input_frame->key_frame,
+            input_frame->coded_picture_number);
+
+        ret = handle_frame(ex, input_frame, request);
+        av_frame_unref(input_frame);
+        if (start)
+            start = cutter_time_ns();
+        if (ret != 0)
+            break;
+    }
+
+    if (start)
+        cutter_metrics_add(CUTTER_STAGE_DECODE, decode_ns);
+    return ret;
+}
+
+/*
+ * Drop whole GOPs that hold no selectable frame before they reach the decoder.
+ * Only possible for time based selections, with the index telling where each GOP ends.
+ * Returns 1 to drop the packet, 0 to decode it and AVERROR_EOF once nothing
+ * can be selected anymore.
+ */
+static int filter_packet(CutterExtractor *ex, DecodeRequest *request, const AVPacket *packet)
+{
+    CutterSelection *selection = request->selection;
+    CutterIndex *index = ex->index;
+
+    // Counted frames must all go through the decoder
+    if (!selection || !index || cutter_selection_frame_based(selection) || request->next_index >= 0)
+        return 0;
+    if (!(packet->flags & AV_PKT_FLAG_KEY) || packet->pts == AV_NOPTS_VALUE)
+        return request->skip_gop;
+
+    request->skip_gop = 0;
+    const CutterIndexEntry *entry = cutter_index_lookup(index, packet->pts);
+    if (!entry || entry->pts != packet->pts || entry + 1 == index->entries + index->count)
+        return 0;
+
+    // Leading frames of this GOP may be displayed before its keyframe,
+    // but never before the previous keyframe nor the last delivered frame
+    int64_t from = entry > index->entries ? entry[-1].pts : entry->pts;
+    if (request->last_pts != AV_NOPTS_VALUE)
+        from = FFMAX(from, request->last_pts + 1);
+
+    int64_t next_ms = cutter_selection_next_ms(selection, pts_to_ms(ex, from));
+    if (next_ms < 0)
+        return AVERROR_EOF;
+
+    request->skip_gop = ms_to_pts(ex, next_ms) >= entry[1].pts;
+    return request->skip_gop;
+}
+
+// Demux and decode until the request is complete or the stream ends
+static int run_request(CutterExtractor *ex, DecodeRequest *request, int64_t seek_pts)
+{
+    AVPacket *input_packet = ex->input_packet;
+    int ret = 0;
+
+    request->last_pts = AV_NOPTS_VALUE;
+    cutter_analysis_reset(ex);
+    if (request->selection) {
+        // A counted request starting mid-stream carries on the counters
+        if (request->next_index > 0)
+            cutter_selection_seek(request->selection, request->next_index, pts_to_ms(ex, request->start_pts));
+        else
+            cutter_selection_reset(request->selection);
+
+        // Jump straight to the first selectable timestamp
+        if (!cutter_selection_frame_based(request->selection) && request->next_index < 0) {
+            int64_t from_ms = request->start_pts != AV_NOPTS_VALUE ? pts_to_ms(ex, request->start_pts) : 0;
+            int64_t first_ms = cutter_selection_next_ms(request->selection, from_ms);
+            if (first_ms < 0)
+                return 0;
+            if (first_ms > from_ms && (seek_pts == AV_NOPTS_VALUE || ms_to_pts(ex, first_ms) > seek_pts))
+                seek_pts = ms_to_pts(ex, first_ms);
+        }
+    }
+
+    if (seek_pts != AV_NOPTS_VALUE || ex->dirty) {
+        ret = cutter_seek(ex, seek_pts);
+        if (ret < 0)
+            return ret;
+    }
+    ex->dirty = 1;
+
+    // Fill the Packet with data from the Stream
+    // https://ffmpeg.org/doxygen/trunk/group__lavf__decoding.html
+    while (ret == 0) {
+        int64_t start = cutter_metrics_start();
+        int read_ret = av_read_frame(ex->format_context, input_packet);
+        cutter_trace_set_pts(read_ret >= 0 ? input_packet->pts : AV_NOPTS_VALUE);
+        cutter_metrics_record(CUTTER_STAGE_DEMUX, start);
+        if (read_ret == AVERROR_EOF) {
+            // Flush the frames still buffered inside the decoder
+            ret = decode_packet(ex, NULL, request);
+            break;
+        } else if (read_ret < 0) {
+            cutter_log_error("Error while reading a packet: %s", av_err2str(read_ret));
+            return read_ret;
+        }
+
+        if (input_packet->stream_index == ex->video_stream_index) {
+            cutter_log_debug("AVPacket->pts %" PRId64, input_packet->pts);
+            ret = filter_packet(ex, request, input_packet);
+            if (ret == AVERROR_EOF)
+                ret = 1;
+            else if (ret == 0)
+                ret = decode_packet(ex, input_packet, request);
+            else
+                ret = 0;
+        }
+        // https://ffmpeg.org/doxygen/trunk/group__lavc__packet.html
+        av_packet_unref(input_packet);
+    }
+
+    return ret < 0 ? ret : request->delivered;
+}
+
+int cutter_extract_at(CutterExtractor *ex, int64_t ts_ms, cutter_frame_cb callback, void *opaque)
+{
+    // The planner looks the timestamp up in the cache and fills it
+    if (ex->cache) {
+        int ret = cutter_extract_many(ex, &ts_ms, 1, callback, opaque);
+        if (ret == 0)
+            return AVERROR_EOF;
+        return ret < 0 ? ret : 0;
+    }
+
+    DecodeRequest request = {
+        .start_pts = ms_to_pts(ex, ts_ms),
+        .end_pts = AV_NOPTS_VALUE,
+        .resume_pts = AV_NOPTS_VALUE,
+        .next_index = -1,
+        .max_frames = 1,
+        .callback = callback,
+        .opaque = opaque,
+    };
+
+    int ret = run_request(ex, &request, request.start_pts);
+    if (ret == 0)
+        return AVERROR_EOF;
+    return ret < 0 ? ret : 0;
+}
+
+static int compare_timestamps(const void *a, const void *b)
+{
+    int64_t ta = *(const int64_t *) a, tb = *(const int64_t *) b;
+
+    return (ta > tb) - (ta < tb);
+}
+
+// Duration of one frame in stream time base, from the average frame rate or 25 fps
+static int64_t frame_duration(const CutterExtractor *ex)
+{
+    AVStream *stream = ex->video_stream;
+    AVRational frame_rate = stream->avg_frame_rate.num && stream->avg_frame_rate.den
+                          ? stream->avg_frame_rate : (AVRational){25, 1};
+
+    return FFMAX(av_rescale_q(1, av_inv_q(frame_rate), stream->time_base), 1);
+}
+
+// Targets of one plan segment still waiting for their frame
+typedef struct PlanTargets {
+    const int64_t *pts;
+    const int64_t *requested_ms;
+    size_t next;
+    size_t end;
+    size_t delivered;
+    int stopped;
+    cutter_frame_cb callback;
+    void *opaque;
+    // Keyframes the plans are built from, NULL if none are known
+    const CutterIndex *index;
+} PlanTargets;
+
+static int deliver_targets(CutterExtractor *ex, AVFrame *frame, void *opaque)
+{
+    PlanTargets *targets = opaque;
+    int64_t pts = frame_pts(frame);
+    CutterImage image;
+
+    if (pts == AV_NOPTS_VALUE || pts < targets->pts[targets->next])
+        return 0;
+
+    // A blank frame leaves the targets pending, the next frame answers them
+    if (ex->options.blank_mean > 0 || ex->options.blank_range > 0) {
+        if (!cutter_blank_check(ex, frame))
+            return 0;
+    }
+
+    CutterCacheEntry *entry = NULL;
+    int ret;
+    if (ex->cache) {
+        ret = cutter_cache_insert(ex->cache, &ex->cache_key, targets->pts[targets->next], frame, &entry);
+        if (ret < 0)
+            return ret;
+    }
+
+    // Converted once, even when several targets fall on the same frame
+    ret = convert_frame(ex, frame, &image);
+    if (ret < 0)
+        return ret;
+    image.cache_entry = entry;
+
+    while (targets->next < targets->end && targets->pts[targets->next] <= pts) {
+        image.requested_ms = targets->requested_ms[targets->next++];
+        targets->delivered++;
+        ret = targets->callback(&image, targets->opaque);
+        if (ret != 0) {
+            targets->stopped = 1;
+            return ret;
+        }
+    }
+    return targets->next == targets->end;
+}
+
+// Decode the targets [first, last) along a GOP plan
+static int run_plan(CutterExtractor *ex, PlanTargets *targets, size_t first, size_t last)
+{
+    CutterPlanSegment *segments = NULL;
+    size_t nb_segments = 0;
+
+    int ret = cutter_plan_build(targets->index, targets->pts + first, last - first, frame_duration(ex),
+                                &segments, &nb_segments);
+    if (ret < 0)
+        return ret;
+    cutter_log("*** %zu timestamps planned in %zu seeks", last - first, nb_segments);
+
+    for (size_t i = 0; i < nb_segments && !targets->stopped; i++) {
+        DecodeRequest request = {
+            .start_pts = AV_NOPTS_VALUE,
+            .end_pts = AV_NOPTS_VALUE,
+            .resume_pts = AV_NOPTS_VALUE,
+            .next_index = -1,
+            .frame_hook = deliver_targets,
+            .opaque = targets,
+        };
+
+        // Targets left behind by the end of the stream are given up
+        targets->next = first + segments[i].first;
+        targets->end = first + segments[i].last;
+        ret = run_request(ex, &request, segments[i].seek_pts);
+        if (ret < 0)
+            break;
+    }
+
+    free(segments);
+    return ret < 0 ? ret : 0;
+}
+
+// Hand a cached frame to the caller, nothing is decoded
+static int deliver_cached(CutterExtractor *ex, CutterCacheEntry *entry, PlanTargets *targets)
+{
+    CutterImage image;
+
+    int ret = convert_frame(ex, cutter_cache_frame(entry), &image);
+    if (ret < 0)
+        return ret;
+    image.cache_entry = entry;
+    image.requested_ms = targets->requested_ms[targets->next++];
+
+    targets->delivered++;
+    ret = targets->callback(&image, targets->opaque);
+    if (ret != 0)
+        targets->stopped = 1;
+    return ret < 0 ? ret : 0;
+}
+
+int cutter_extract_many(CutterExtractor *ex, const int64_t *ts_ms, size_t count,
+                        cutter_frame_cb callback, void *opaque)
+{
+    CutterIndex *probed = NULL;
+    int ret = 0;
+
+    if (!count)
+        return 0;
+
+    int64_t *requested_ms = malloc(count * sizeof(*requested_ms));
+    int64_t *pts = malloc(count * sizeof(*pts));
+    if (!requested_ms || !pts) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    memcpy(requested_ms, ts_ms, count * sizeof(*requested_ms));
+    qsort(requested_ms, count, sizeof(*requested_ms), compare_timestamps);
+    for (size_t i = 0; i < count; i++)
+        pts[i] = ms_to_pts(ex, requested_ms[i]);
+
+    // The planner needs the GOP boundaries, or two blind seeks may land on the same
+    // keyframe and decode its GOP twice. Many dense targets are worth a demux-only
+    // pass, the keyframes of the others are looked up around each of them.
+    if (!ex->index && count > 1) {
+        CutterProbe probe;
+        cutter_probe(ex, &probe);
+        if (count >= PLAN_SCAN_MIN_TARGETS &&
+            (probe.duration_ms <= 0 || probe.duration_ms / (int64_t) count <= PLAN_SCAN_MAX_SPACING_MS))
+            ret = cutter_index_scan(ex);
+        else
+            ret = cutter_index_probe(ex, pts, count, &probed);
+        if (ret < 0)
+            goto end;
+    }
+
+    PlanTargets targets = {
+        .pts = pts,
+        .requested_ms = requested_ms,
+        .callback = callback,
+        .opaque = opaque,
+        .index = ex->index ? ex->index : probed,
+    };
+
+    // Cached targets are answered in place, each run of misses in between gets its own plan
+    size_t first = 0, hits = 0;
+    while (first < count && !targets.stopped) {
+        CutterCacheEntry *entry = ex->cache ? cutter_cache_lookup(ex->cache, &ex->cache_key, pts[first]) : NULL;
+        if (entry) {
+            targets.next = first++;
+            hits++;
+            ret = deliver_cached(ex, entry, &targets);
+            if (ret < 0)
+                goto end;
+            continue;
+        }
+
+        size_t last = first + 1;
+        while (ex->cache && last < count && !cutter_cache_lookup(ex->cache, &ex->cache_key, pts[last]))
+            last++;
+        if (!ex->cache)
+            last = count;
+
+        ret = run_plan(ex, &targets, first, last);
+        if (ret < 0)
+            goto end;
+        first = last;
+    }
+    if (ex->cache)
+        cutter_log("*** %zu of %zu timestamps answered by the frame cache", hits, count);
+    ret = targets.delivered;
+
+end:
+    cutter_index_free(&probed);
+    free(pts);
+    free(requested_ms);
+    return ret;
+}
+
+typedef struct BestCandidate {
+    AVFrame *frame;
+    double score;
+    int64_t last_pts;
+} BestCandidate;
+
+static int score_candidate(CutterExtractor *ex, AVFrame *frame, void *opaque)
+{
+    BestCandidate *best = opaque;
+    int64_t pts = frame_pts(frame);
+
+    (void) ex;
+    // Nearby timestamps often land on the same keyframe
+    if (pts != AV_NOPTS_VALUE && pts == best->last_pts)
+        return 0;
+    best->last_pts = pts;
+
+    double score = cutter_frame_score(frame);
+    cutter_log_verbose("Candidate at pts %" PRId64 " scored %.3f", pts, score);
+    if (best->frame->buf[0] && score <= best->score)
+        return 0;
+
+    // Keep a reference to the winner, nothing is converted yet
+    av_frame_unref(best->frame);
+    best->score = score;
+    return av_frame_ref(best->frame, frame);
+}
+
+int cutter_extract_best(CutterExtractor *ex, int candidates, cutter_frame_cb callback, void *opaque)
+{
+    BestCandidate best = { av_frame_alloc(), 0, AV_NOPTS_VALUE };
+    CutterProbe probe;
+    int ret = 0;
+
+    if (candidates < 1)
+        return AVERROR(EINVAL);
+    if (!best.frame)
+        return AVERROR(ENOMEM);
+
+    cutter_probe(ex, &probe);
+    for (int i = 0; i < candidates && ret >= 0; i++) {
+        // Spread over the whole duration, away from both ends
+        int64_t ts_ms = probe.duration_ms > 0 ? probe.duration_ms * (i + 1) / (candidates + 1)
+                                              : (int64_t) i * BEST_FALLBACK_SPACING_MS;
+        DecodeRequest request = {
+            .start_pts = AV_NOPTS_VALUE,
+            .end_pts = AV_NOPTS_VALUE,
+            .resume_pts = AV_NOPTS_VALUE,
+            .next_index = -1,
+            .max_frames = 1,
+            .frame_hook = score_candidate,
+            .opaque = &best,
+        };
+
+        // The first frame after the seek is the keyframe, which needs no other frame to decode
+        ret = run_request(ex, &request, ms_to_pts(ex, ts_ms));
+    }
+
+    if (ret >= 0 && !best.frame->buf[0])
+        ret = AVERROR_EOF;
+    if (ret >= 0) {
+        cutter_log("Best candidate at pts %" PRId64 " (score %.3f)", frame_pts(best.frame), best.score);
+        ret = deliver_frame(ex, best.frame, -1, callback, opaque);
+    }
+
+    av_frame_free(&best.frame);
+    return ret < 0 ? ret : 0;
+}
+
+typedef struct BufferTarget {
+    uint8_t *buffer;
+    int linesize;
+    CutterImage *image;
+} BufferTarget;
+
+static int copy_to_buffer(const CutterImage *image, void *opaque)
+{
+    BufferTarget *target = opaque;
+    int row_size = image->width * 3;
+
+    if (target->linesize < row_size)
+        return AVERROR(EINVAL);
+
+    for (int y = 0; y < image->height; y++)
+        memcpy(target->buffer + (size_t) y * target->linesize, image->data + (size_t) y * image->linesize, row_size);
+
+    if (target->image) {
+        *target->image = *image;
+        target->image->data = target->buffer;
+        target->image->linesize = target->linesize;
+    }
+    return 0;
+}
+
+int cutter_extract_at_buffer(CutterExtractor *ex, int64_t ts_ms,
+                             uint8_t *buffer, int linesize, CutterImage *image)
+{
+    BufferTarget target = { buffer, linesize, image };
+
+    return cutter_extract_at(ex, ts_ms, copy_to_buffer, &target);
+}
+
+int cutter_extract_range(CutterExtractor *ex, int64_t start_ms, int64_t end_ms,
+                         cutter_frame_cb callback, void *opaque)
+{
+    DecodeRequest request = {
+        .start_pts = ms_to_pts(ex, start_ms),
+        .end_pts = end_ms < 0 ? AV_NOPTS_VALUE : ms_to_pts(ex, end_ms),
+        .resume_pts = AV_NOPTS_VALUE,
+        .next_index = -1,
+        .callback = callback,
+        .opaque = opaque,
+        .selection = ex->selection,
+    };
+
+    return run_request(ex, &request, request.start_pts);
+}
+
+int cutter_iterate_frames(CutterExtractor *ex, cutter_frame_cb callback, void *opaque)
+{
+    DecodeRequest request = {
+        .start_pts = AV_NOPTS_VALUE,
+        .end_pts = AV_NOPTS_VALUE,
+        .resume_pts = AV_NOPTS_VALUE,
+        .next_index = -1,
+        .callback = callback,
+        .opaque = opaque,
+        .selection = ex->selection,
+    };
+
+    return run_request(ex, &request, AV_NOPTS_VALUE);
+}
+
+int cutter_iterate_frames_from(CutterExtractor *ex, int64_t resume_pts, cutter_frame_cb callback, void *opaque)
+{
+    DecodeRequest request = {
+        .start_pts = AV_NOPTS_VALUE,
+        .end_pts = AV_NOPTS_VALUE,
+        .callback = callback,
+        .opaque = opaque,
+        .selection = ex->selection,
+        .resume_pts = resume_pts,
+        .next_index = -1,
+    };
+
+    // Frame counts can only be replayed from the first frame, everything
+    // else restarts on the keyframe before the last delivered frame
+    int64_t seek_pts = resume_pts;
+    if (ex->selection && cutter_selection_frame_based(ex->selection))
+        seek_pts = AV_NOPTS_VALUE;
+
+    cutter_log("*** Resuming after pts %" PRId64, resume_pts);
+    return run_request(ex, &request, seek_pts);
+}
+
+// resume_pts is AV_NOPTS_VALUE for a fresh shard
+static int run_shard(CutterExtractor *ex, int shard, int nb_shards, int64_t resume_pts,
+                     cutter_frame_cb callback, void *opaque)
+{
+    DecodeRequest request = {
+        .start_pts = AV_NOPTS_VALUE,
+        .end_pts = AV_NOPTS_VALUE,
+        .resume_pts = AV_NOPTS_VALUE,
+        .next_index = 0,
+        .callback = callback,
+        .opaque = opaque,
+        .selection = ex->selection,
+    };
+    CutterProbe probe;
+    int ret;
+
+    if (nb_shards < 1 || shard < 0 || shard >= nb_shards)
+        return AVERROR(EINVAL);
+    if (ex->selection && !cutter_selection_seekable(ex->selection)) {
+        cutter_log_error("Frames counted inside ranges cannot be split into shards");
+        return AVERROR(ENOSYS);
+    }
+    // A shard only replays one GOP before its slice: the last kept hash, or the
+    // last picture before a run of blank frames, may lie further back
+    if (ex->options.dedupe_distance > 0 ||
+        ((ex->options.blank_mean > 0 || ex->options.blank_range > 0) && ex->options.scene_threshold > 0)) {
+        cutter_log_error("Duplicate removal and scene detection across blank frames cannot be split into shards");
+        return AVERROR(ENOSYS);
+    }
+
+    // The slices are cut on keyframes and numbered with the frame counts of the index
+    if (!ex->index) {
+        ret = cutter_index_scan(ex);
+        if (ret < 0)
+            return ret;
+    }
+    const CutterIndex *index = ex->index;
+    if (!index->count) {
+        if (shard)
+            return 0;
+        return resume_pts != AV_NOPTS_VALUE ? cutter_iterate_frames_from(ex, resume_pts, callback, opaque)
+                                            : cutter_iterate_frames(ex, callback, opaque);
+    }
+
+    // Equal time slices, each bound moved back to its keyframe
+    cutter_probe(ex, &probe);
+    int64_t first = index->entries[0].pts;
+    int64_t span = probe.duration_ms > 0 ? ms_to_pts(ex, probe.duration_ms) - first
+                                         : index->entries[index->count - 1].pts - first;
+    const CutterIndexEntry *start = shard ? cutter_index_lookup(index, first + span / nb_shards * shard) : NULL;
+    const CutterIndexEntry *end = shard + 1 < nb_shards ? cutter_index_lookup(index, first + span / nb_shards * (shard + 1)) : NULL;
+
+    if (start && end && start->pts >= end->pts) {
+        cutter_log("*** Shard %d/%d is empty", shard, nb_shards);
+        return 0;
+    }
+    if (end)
+        request.end_pts = end->pts - 1;
+
+    // Decoding starts one GOP early so the scene detection and the selection
+    // see the same frames before the slice as in a single run
+    const CutterIndexEntry *prime = start && start > index->entries ? start - 1 : start;
+    if (start)
+        request.resume_pts = start->pts - 1;
+
+    // A resumed shard restarts one GOP before the last delivered frame, still
+    // within its own slice, with the frames numbered from there
+    if (resume_pts != AV_NOPTS_VALUE && resume_pts > request.resume_pts) {
+        const CutterIndexEntry *last = cutter_index_lookup(index, resume_pts);
+        if (last && last > index->entries && (!prime || last - 1 > prime))
+            prime = last - 1;
+        request.resume_pts = resume_pts;
+    }
+
+    if (prime) {
+        request.start_pts = prime->pts;
+        request.next_index = prime->frame;
+    }
+
+    cutter_log("*** Shard %d/%d: pts %" PRId64 " to %" PRId64, shard, nb_shards,
+               start ? start->pts : first, end ? end->pts : INT64_MAX);
+    if (resume_pts != AV_NOPTS_VALUE)
+        cutter_log("*** Resuming after pts %" PRId64, request.resume_pts);
+    return run_request(ex, &request, request.start_pts);
+}
+
+int cutter_iterate_shard(CutterExtractor *ex, int shard, int nb_shards, cutter_frame_cb callback, void *opaque)
+{
+    return run_shard(ex, shard, nb_shards, AV_NOPTS_VALUE, callback, opaque);
+}
+
+int cutter_iterate_shard_from(CutterExtractor *ex, int shard, int nb_shards, int64_t resume_pts,
+                              cutter_frame_cb callback, void *opaque)
+{
+    return run_shard(ex, shard, nb_shards, resume_pts, callback, opaque);
+}
+
+void cutter_set_selection(CutterExtractor *ex, CutterSelection *selection)
+{
+    ex->selection = selection;
+}
+
+void cutter_set_cache(CutterExtractor *ex, CutterCache *cache)
+{
+    ex->cache = NULL;
+    if (cache && cutter_cache_key(ex, &ex->cache_key) < 0) {
+        cutter_log("%s is not a local file, its frames are not cached", ex->filename);
+        return;
+    }
+    ex->cache = cache;
+}
@@ -0,0 +1,448 @@
+/*
+ * Keyframe index sidecar (.cutidx)
+ *
+ * One demux-only pass records every keyframe of the video stream.
+ * The file is a fixed header followed by entries sorted by pts,
+ * stored in host byte order and read back through mmap(), so later
+ * seeks are a binary search instead of a new walk over the packets.
+ *
+ * A few timestamps do not justify that walk: their keyframes come from the
+ * demuxer's own index, or from one seek per timestamp.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+#define CUTIDX_MAGIC "CUTIDX\0\0"
+#define CUTIDX_VERSION 2
+
+typedef struct CutterIndexHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t stream_index;
+    int32_t time_base_num;
+    int32_t time_base_den;
+    // Identity of the media file the index was built from
+    int64_t file_size;
+    int64_t file_mtime;
+    uint64_t count;
+} CutterIndexHeader;
+
+// Size and modification time of the input, -1 when it is not a local file
+static void file_identity(const char *filename, int64_t *size, int64_t *mtime)
+{
+    struct stat st;
+
+    if (stat(filename, &st) < 0) {
+        *size = -1;
+        *mtime = -1;
+        return;
+    }
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+}
+
+static char *default_index_path(const char *filename)
+{
+    size_t length = strlen(filename) + sizeof(".cutidx");
+    char *path = malloc(length);
+
+    if (path)
+        snprintf(path, length, "%s.cutidx", filename);
+    return path;
+}
+
+// Demuxers without a sample table resync on any byte position, so the
+// recorded packet offset can be used directly. Containers carrying their
+// own index (mp4, mkv, avi...) seek exactly by timestamp instead.
+static int supports_byte_seek(const AVInputFormat *iformat)
+{
+    static const char *const names[] = { "mpegts", "mpeg", "mpegvideo", "h264", "hevc", "m4v", NULL };
+
+    if (iformat->flags & AVFMT_NO_BYTE_SEEK)
+        return 0;
+    for (int i = 0; names[i]; i++) {
+        if (!strcmp(iformat->name, names[i]))
+            return 1;
+    }
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const CutterIndexEntry *ea = a, *eb = b;
+
+    return (ea->pts > eb->pts) - (ea->pts < eb->pts);
+}
+
+static int compare_pts(const void *a, const void *b)
+{
+    int64_t pa = *(const int64_t *) a, pb = *(const int64_t *) b;
+
+    return (pa > pb) - (pa < pb);
+}
+
+// Append to a growable array of items of the given size
+static int append(void **array, size_t *count, size_t *allocated, size_t size, const void *item)
+{
+    if (*count == *allocated) {
+        size_t new_size = *allocated ? *allocated * 2 : 256;
+        void *tmp = realloc(*array, new_size * size);
+        if (!tmp)
+            return AVERROR(ENOMEM);
+        *array = tmp;
+        *allocated = new_size;
+    }
+    memcpy((uint8_t *) *array + *count * size, item, size);
+    (*count)++;
+    return 0;
+}
+
+// Walk the video packets once, demux only, and return the keyframes sorted by pts
+static int collect_keyframes(CutterExtractor *ex, CutterIndexEntry **entries_out, size_t *count_out)
+{
+    AVPacket *packet = ex->input_packet;
+    CutterIndexEntry *entries = NULL;
+    int64_t *packets = NULL;
+    size_t count = 0, allocated = 0;
+    size_t nb_packets = 0, packets_allocated = 0;
+    int ret;
+
+    // Restart from the beginning if a previous request moved the demuxer
+    if (ex->dirty) {
+        ret = cutter_seek(ex, AV_NOPTS_VALUE);
+        if (ret < 0)
+            return ret;
+    }
+    ex->dirty = 1;
+
+    cutter_log("*** Collecting the keyframes of %s", ex->filename);
+
+    // The decoder is never involved
+    while ((ret = av_read_frame(ex->format_context, packet)) >= 0) {
+        if (packet->stream_index == ex->video_stream_index) {
+            int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+
+            // Every timestamp is kept to count the frames displayed before each keyframe
+            ret = append((void **) &packets, &nb_packets, &packets_allocated, sizeof(*packets), &pts);
+            if (ret >= 0 && (packet->flags & AV_PKT_FLAG_KEY)) {
+                CutterIndexEntry entry = { pts, packet->dts, packet->pos, 0 };
+                ret = append((void **) &entries, &count, &allocated, sizeof(*entries), &entry);
+            }
+            if (ret < 0) {
+                av_packet_unref(packet);
+                goto fail;
+            }
+        }
+        av_packet_unref(packet);
+    }
+    if (ret != AVERROR_EOF) {
+        cutter_log_error("Error while reading a packet: %s", av_err2str(ret));
+        goto fail;
+    }
+
+    qsort(entries, count, sizeof(*entries), compare_entries);
+    qsort(packets, nb_packets, sizeof(*packets), compare_pts);
+    for (size_t i = 0, p = 0; i < count; i++) {
+        while (p < nb_packets && packets[p] < entries[i].pts)
+            p++;
+        entries[i].frame = p;
+    }
+
+    free(packets);
+    *entries_out = entries;
+    *count_out = count;
+    return 0;
+
+fail:
+    free(packets);
+    free(entries);
+    return ret;
+}
+
+int cutter_index_scan(CutterExtractor *ex)
+{
+    CutterIndex *index = calloc(1, sizeof(*index));
+    int ret;
+
+    if (!index)
+        return AVERROR(ENOMEM);
+
+    ret = collect_keyframes(ex, &index->owned_entries, &index->count);
+    if (ret < 0) {
+        free(index);
+        return ret;
+    }
+    index->entries = index->owned_entries;
+    index->byte_seek = supports_byte_seek(ex->format_context->iformat);
+
+    cutter_index_free(&ex->index);
+    ex->index = index;
+    return 0;
+}
+
+// Keyframes of the demuxer's own index: the stss of MP4 and MOV, the cues of
+// Matroska. Timestamps are the ones the demuxer seeks with.
+static int demuxer_keyframes(CutterExtractor *ex, CutterIndexEntry **entries, size_t *count)
+{
+    AVStream *stream = ex->video_stream;
+    int nb_entries = avformat_index_get_entries_count(stream);
+    size_t allocated = 0;
+
+    for (int i = 0; i < nb_entries; i++) {
+        const AVIndexEntry *index_entry = avformat_index_get_entry(stream, i);
+        if (!(index_entry->flags & AVINDEX_KEYFRAME))
+            continue;
+
+        CutterIndexEntry entry = { index_entry->timestamp, index_entry->timestamp, index_entry->pos, -1 };
+        int ret = append((void **) entries, count, &allocated, sizeof(entry), &entry);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+// The keyframe in front of each target: one seek and one packet read per target
+static int probe_keyframes(CutterExtractor *ex, const int64_t *targets, size_t count,
+                           CutterIndexEntry **entries, size_t *nb_entries)
+{
+    AVPacket *packet = ex->input_packet;
+    size_t allocated = 0;
+
+    ex->dirty = 1;
+    for (size_t i = 0; i < count; i++) {
+        // Repeated targets share their keyframe
+        if (i && targets[i] == targets[i - 1])
+            continue;
+
+        int ret = av_seek_frame(ex->format_context, ex->video_stream_index, targets[i], AVSEEK_FLAG_BACKWARD);
+        if (ret < 0)
+            continue;
+        while ((ret = av_read_frame(ex->format_context, packet)) >= 0 &&
+               packet->stream_index != ex->video_stream_index)
+            av_packet_unref(packet);
+        if (ret < 0)
+            continue;
+
+        int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+        CutterIndexEntry entry = { pts, packet->dts, packet->pos, -1 };
+        int key = packet->flags & AV_PKT_FLAG_KEY;
+        av_packet_unref(packet);
+        if (!key || pts == AV_NOPTS_VALUE || pts > targets[i])
+            continue;
+
+        ret = append((void **) entries, nb_entries, &allocated, sizeof(entry), &entry);
+        if (ret < 0)
+            return ret;
+    }
+
+    // Targets of one GOP found the same keyframe
+    qsort(*entries, *nb_entries, sizeof(**entries), compare_entries);
+    size_t kept = 0;
+    for (size_t i = 0; i < *nb_entries; i++) {
+        if (!kept || (*entries)[i].pts != (*entries)[kept - 1].pts)
+            (*entries)[kept++] = (*entries)[i];
+    }
+    *nb_entries = kept;
+    return 0;
+}
+
+int cutter_index_probe(CutterExtractor *ex, const int64_t *targets, size_t count, CutterIndex **index_out)
+{
+    CutterIndex *index = calloc(1, sizeof(*index));
+    int ret;
+
+    *index_out = NULL;
+    if (!index)
+        return AVERROR(ENOMEM);
+
+    ret = demuxer_keyframes(ex, &index->owned_entries, &index->count);
+    if (ret >= 0 && index->count < 2) {
+        free(index->owned_entries);
+        index->owned_entries = NULL;
+        index->count = 0;
+        ret = probe_keyframes(ex, targets, count, &index->owned_entries, &index->count);
+    }
+    if (ret < 0 || !index->count) {
+        free(index->owned_entries);
+        free(index);
+        return ret;
+    }
+
+    index->entries = index->owned_entries;
+    cutter_log_verbose("%zu keyframes known around the targets without a scan", index->count);
+    *index_out = index;
+    return 0;
+}
+
+int cutter_index_build(CutterExtractor *ex, const char *index_path)
+{
+    CutterIndexEntry *entries = NULL;
+    size_t count = 0;
+    char *path = NULL, *tmp_path = NULL;
+    FILE *fp = NULL;
+
+    int ret = collect_keyframes(ex, &entries, &count);
+    if (ret < 0)
+        return ret;
+
+    CutterIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CUTIDX_MAGIC, sizeof(header.magic));
+    header.version = CUTIDX_VERSION;
+    header.stream_index = ex->video_stream_index;
+    header.time_base_num = ex->video_stream->time_base.num;
+    header.time_base_den = ex->video_stream->time_base.den;
+    header.count = count;
+    file_identity(ex->filename, &header.file_size, &header.file_mtime);
+
+    path = index_path ? strdup(index_path) : default_index_path(ex->filename);
+    tmp_path = path ? malloc(strlen(path) + sizeof(".tmp")) : NULL;
+    if (!tmp_path) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    // Written aside and renamed, readers never map a partial index
+    fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        ret = AVERROR(errno);
+        cutter_log_error("Failed to open file '%s'", tmp_path);
+        goto end;
+    }
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        (count && fwrite(entries, sizeof(*entries), count, fp) != count)) {
+        ret = AVERROR(EIO);
+        goto end;
+    }
+    ret = fclose(fp);
+    fp = NULL;
+    if (ret != 0 || rename(tmp_path, path) < 0) {
+        ret = AVERROR(errno);
+        unlink(tmp_path);
+        goto end;
+    }
+
+    cutter_log("*** %zu keyframes written to %s", count, path);
+    ret = 0;
+
+end:
+    if (fp) {
+        fclose(fp);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(path);
+    free(entries);
+    return ret;
+}
+
+int cutter_index_load(CutterExtractor *ex, const char *index_path)
+{
+    char *path = index_path ? strdup(index_path) : default_index_path(ex->filename);
+    struct stat st;
+    int ret;
+
+    if (!path)
+        return AVERROR(ENOMEM);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        ret = AVERROR(errno);
+        free(path);
+        return ret;
+    }
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(CutterIndexHeader)) {
+        close(fd);
+        free(path);
+        return AVERROR_INVALIDDATA;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ret = AVERROR(errno);
+        free(path);
+        return ret;
+    }
+
+    const CutterIndexHeader *header = map;
+    int64_t file_size, file_mtime;
+    file_identity(ex->filename, &file_size, &file_mtime);
+
+    ret = AVERROR_INVALIDDATA;
+    if (memcmp(header->magic, CUTIDX_MAGIC, sizeof(header->magic)) || header->version != CUTIDX_VERSION) {
+        cutter_log_error("%s is not a keyframe index", path);
+        goto fail;
+    }
+    if (header->count > (st.st_size - sizeof(*header)) / sizeof(CutterIndexEntry)) {
+        cutter_log_error("%s is truncated", path);
+        goto fail;
+    }
+    if (header->stream_index != ex->video_stream_index ||
+        header->time_base_num != ex->video_stream->time_base.num ||
+        header->time_base_den != ex->video_stream->time_base.den ||
+        header->file_size != file_size || header->file_mtime != file_mtime) {
+        cutter_log_error("%s is stale, rebuild it", path);
+        goto fail;
+    }
+
+    CutterIndex *index = calloc(1, sizeof(*index));
+    if (!index) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    index->map = map;
+    index->map_size = st.st_size;
+    index->entries = (const CutterIndexEntry *) (header + 1);
+    index->count = header->count;
+    index->byte_seek = supports_byte_seek(ex->format_context->iformat);
+
+    cutter_index_free(&ex->index);
+    ex->index = index;
+
+    cutter_log("*** Using %zu keyframes from %s", index->count, path);
+    free(path);
+    return 0;
+
+fail:
+    munmap(map, st.st_size);
+    free(path);
+    return ret;
+}
+
+void cutter_index_free(CutterIndex **index)
+{
+    if (!*index)
+        return;
+    if ((*index)->map)
+        munmap((*index)->map, (*index)->map_size);
+    free((*index)->owned_entries);
+    free(*index);
+    *index = NULL;
+}
+
+const CutterIndexEntry *cutter_index_lookup(const CutterIndex *index, int64_t pts)
+{
+    size_t low = 0, high = index->count;
+
+    // Last keyframe whose pts is not after the target
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (index->entries[middle].pts <= pts)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low ? &index->entries[low - 1] : NULL;
+}
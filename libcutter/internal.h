@@ -0,0 +1,300 @@
+/*
+ * Private definitions shared by the libcutter translation units.
+ * Not installed, not part of the public API.
+ */
+
+#ifndef LIBCUTTER_INTERNAL_H
+#define LIBCUTTER_INTERNAL_H
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+
+#include "cutter.h"
+
+// One keyframe of the .cutidx sidecar, timestamps in stream time base
+typedef struct CutterIndexEntry {
+    int64_t pts;
+    int64_t dts;
+    // Byte offset of the packet in the input, -1 if unknown
+    int64_t pos;
+    // Number of frames displayed before this keyframe
+    int64_t frame;
+} CutterIndexEntry;
+
+// A mapped .cutidx sidecar, or keyframes collected in memory
+typedef struct CutterIndex {
+    void *map;
+    size_t map_size;
+    CutterIndexEntry *owned_entries;
+    const CutterIndexEntry *entries;
+    size_t count;
+    // Seek with the byte offsets instead of the timestamps
+    int byte_seek;
+} CutterIndex;
+
+// One seek of a plan and the targets decoded after it
+typedef struct CutterPlanSegment {
+    // Keyframe to seek to, AV_NOPTS_VALUE for the stream start
+    int64_t seek_pts;
+    // Targets [first, last) of the sorted list
+    size_t first;
+    size_t last;
+} CutterPlanSegment;
+
+// Identifies what a cached frame was decoded from and how it is delivered
+typedef struct CutterCacheKey {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;
+    int stream_index;
+    int sws_flags;
+    int blank_mean;
+    int blank_range;
+} CutterCacheKey;
+
+// Stages timed by the metrics
+typedef enum CutterStage {
+    CUTTER_STAGE_DEMUX,
+    CUTTER_STAGE_DECODE,
+    CUTTER_STAGE_CONVERT,
+    // PNG filtering and deflate, without the file writes
+    CUTTER_STAGE_ENCODE,
+    CUTTER_STAGE_WRITE,
+    CUTTER_STAGE_NB
+} CutterStage;
+
+// Side of the square luma blocks averaged into a thumbnail pixel
+#define CUTTER_THUMB_BLOCK 8
+
+// dHash grid: 9 columns give 8 horizontal gradients on each of the 8 rows
+#define CUTTER_DHASH_COLUMNS 9
+#define CUTTER_DHASH_ROWS 8
+
+// Block-averaged copy of a luma plane
+typedef struct CutterThumb {
+    uint8_t *data;
+    int width;
+    int height;
+} CutterThumb;
+
+typedef struct CutterLumaStats {
+    int min;
+    int max;
+    double mean;
+    double variance;
+} CutterLumaStats;
+
+struct CutterExtractor {
+    CutterOptions options;
+    char *filename;
+
+    // Demuxer, decoder and the selected stream
+    AVFormatContext *format_context;
+    AVCodecContext *codec_context;
+    AVStream *video_stream;
+    int video_stream_index;
+
+    // Reused across every request
+    AVPacket *input_packet;
+    AVFrame *input_frame;
+    AVFrame *rgb_frame;
+    struct SwsContext *sws_ctx;
+
+    // Set by cutter_extract_mosaic(): the frames are scaled to the size of
+    // a tile, 0 keeps the size of the input
+    int tile_width;
+    int tile_height;
+
+    // Keyframe index loaded by cutter_index_load(), NULL if none
+    CutterIndex *index;
+    // Set by cutter_set_selection(), not owned
+    CutterSelection *selection;
+    // Set by cutter_set_cache(), not owned, with the key of this input
+    CutterCache *cache;
+    CutterCacheKey cache_key;
+
+    // Luma thumbnails of the current and previous analysed frames
+    CutterThumb thumbs[2];
+    int thumb_current;
+    // thumbs[thumb_current] is computed / the other one holds the previous frame
+    int thumb_ready;
+    int thumb_primed;
+
+    // Perceptual hash of the last kept frame
+    uint64_t last_hash;
+    int has_last_hash;
+
+    // Set once packets have been read, the next request must seek first
+    int dirty;
+};
+
+// Creates whole files from memory buffers in the background, see async.c
+typedef struct CutterAsyncWriter CutterAsyncWriter;
+
+struct CutterSink {
+    CutterSinkCallbacks callbacks;
+    void *opaque;
+
+    // Image being buffered by the memory and tar sinks
+    uint8_t *data;
+    size_t size;
+    size_t allocated;
+
+    // Buffered descriptor of the fd sinks
+    int fd;
+    int owns_fd;
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t buffered;
+    // Time spent in write(), for the metrics
+    int64_t write_ns;
+
+    // Destination and member name of the tar sink
+    CutterSink *output;
+    char name[100];
+    char prefix[155];
+
+    // Writer and file name of the image of the async sinks
+    CutterAsyncWriter *async;
+    char *path;
+};
+
+extern int cutter_log_level;
+
+void cutter_log_message(CutterLogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Print out the steps and errors through the installed log callback. The
+// arguments are only evaluated when the level is enabled.
+#define cutter_log_at(level, ...)                           \
+    do {                                                    \
+        if ((level) <= cutter_log_level)                    \
+            cutter_log_message((level), __VA_ARGS__);       \
+    } while (0)
+
+#define cutter_log_error(...)   cutter_log_at(CUTTER_LOG_ERROR, __VA_ARGS__)
+#define cutter_log(...)         cutter_log_at(CUTTER_LOG_INFO, __VA_ARGS__)
+#define cutter_log_verbose(...) cutter_log_at(CUTTER_LOG_VERBOSE, __VA_ARGS__)
+#define cutter_log_debug(...)   cutter_log_at(CUTTER_LOG_DEBUG, __VA_ARGS__)
+
+// Position the demuxer on the keyframe at or before pts (AV_NOPTS_VALUE
+// for the stream start) and reset the decoder
+int cutter_seek(CutterExtractor *extractor, int64_t pts);
+
+// Collect the keyframes in memory with a demux-only pass, when no sidecar is available
+int cutter_index_scan(CutterExtractor *extractor);
+void cutter_index_free(CutterIndex **index);
+// Keyframes in front of the sorted targets without walking the whole input: the
+// demuxer's own index when it has one, else one seek and one read per target.
+// *index is NULL when none is found. Only pts, dts and pos of the entries are set.
+int cutter_index_probe(CutterExtractor *extractor, const int64_t *targets, size_t count, CutterIndex **index);
+// Last keyframe whose pts is not after the given one, NULL if none
+const CutterIndexEntry *cutter_index_lookup(const CutterIndex *index, int64_t pts);
+
+// Group sorted target timestamps (stream time base) by GOP and choose between seeking
+// and decoding through each gap. index may be NULL, segments must be freed with free()
+int cutter_plan_build(const CutterIndex *index, const int64_t *targets, size_t count,
+                      int64_t frame_duration, CutterPlanSegment **segments, size_t *nb_segments);
+
+// Identity of the input file and of the delivery options, fails when the input is not a local file
+int cutter_cache_key(CutterExtractor *extractor, CutterCacheKey *key);
+// Entry answering a request for pts, NULL on a miss. The entry becomes the most recently used.
+CutterCacheEntry *cutter_cache_lookup(CutterCache *cache, const CutterCacheKey *key, int64_t pts);
+// Keep a reference to the frame delivered for a request of from_pts, may evict older entries
+int cutter_cache_insert(CutterCache *cache, const CutterCacheKey *key, int64_t from_pts,
+                        const AVFrame *frame, CutterCacheEntry **entry);
+const AVFrame *cutter_cache_frame(const CutterCacheEntry *entry);
+// Returns 1 and the PNG bytes saved for this entry, 0 if it was never saved
+int cutter_cache_encoded(const CutterCacheEntry *entry, const uint8_t **data, size_t *size);
+// Attach the PNG bytes of the frame, data is owned by the cache afterwards
+void cutter_cache_store_encoded(CutterCacheEntry *entry, uint8_t *data, size_t size);
+
+const char *cutter_stage_name(CutterStage stage);
+// CLOCK_MONOTONIC in nanoseconds
+int64_t cutter_time_ns(void);
+// Start of a timed section, 0 when neither the metrics nor the trace are enabled
+int64_t cutter_metrics_start(void);
+// Close a section opened by cutter_metrics_start() into the metrics and the trace,
+// nothing is recorded for a 0 start
+void cutter_metrics_record(CutterStage stage, int64_t start);
+// Record a duration measured by the caller, metrics only
+void cutter_metrics_add(CutterStage stage, int64_t ns);
+void cutter_metrics_add_bytes(size_t bytes);
+
+// Outputs may be hard links to the objects of an output cache: truncating
+// one in place would rewrite the cached copy too. Unlinks filename when it is
+// a regular file with other links, so the next open() creates a new inode.
+void cutter_unshare_file(const char *filename);
+
+// Take the buffer of a memory sink, malloc'ed, the sink starts over empty
+uint8_t *cutter_sink_memory_detach(CutterSink *sink, size_t *size);
+
+int cutter_async_open(CutterAsyncWriter **writer, int depth, int flags, cutter_write_cb done, void *opaque);
+// Queue the creation of filename with the malloc'ed data, which the writer frees.
+// May block until a file in flight completes.
+int cutter_async_submit(CutterAsyncWriter *writer, const char *filename, uint8_t *data, size_t size);
+// Wait for the queued files, returns the first error of the writer
+int cutter_async_wait(CutterAsyncWriter *writer);
+int cutter_async_close(CutterAsyncWriter **writer);
+
+// PNG encoding at a zlib level, -1 for the libpng default. *data is malloc'ed.
+int cutter_png_encode_buffer(const CutterImage *image, int level, uint8_t **data, size_t *size);
+int cutter_png_save_level(const CutterImage *image, const char *filename, int level);
+
+int cutter_trace_active(void);
+// Packet or frame the following spans of this thread work on
+void cutter_trace_set_pts(int64_t pts);
+// Record a span of the calling thread, nothing is recorded for a 0 start
+void cutter_trace_span(CutterStage stage, int64_t start_ns, int64_t end_ns);
+
+// XXH64 of the buffer, chain calls through seed to hash several buffers
+uint64_t cutter_xxh64(const void *data, size_t length, uint64_t seed);
+
+// LZ4 blocks: dst of a compression holds at least cutter_lz_bound(size) bytes.
+// A decompression must produce exactly dst_size bytes, AVERROR_INVALIDDATA otherwise.
+size_t cutter_lz_bound(size_t size);
+size_t cutter_lz_compress(const uint8_t *src, size_t size, uint8_t *dst);
+int cutter_lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t dst_size);
+
+// Restart the per request counters of a selection
+void cutter_selection_reset(CutterSelection *selection);
+// Whether the selection counts frames, such selections cannot skip GOPs
+int cutter_selection_frame_based(const CutterSelection *selection);
+// Earliest timestamp at or after ts_ms that may be selected, -1 if none
+int64_t cutter_selection_next_ms(const CutterSelection *selection, int64_t ts_ms);
+// Continue counting from a frame decoded after a seek: frame_index is its position in the
+// stream, ts_ms its timestamp. Only exact for selections counting frames without ranges.
+void cutter_selection_seek(CutterSelection *selection, int64_t frame_index, int64_t ts_ms);
+// Whether cutter_selection_seek() can be used
+int cutter_selection_seekable(const CutterSelection *selection);
+// Feed the next decoded frame in display order, returns 1 if it is selected
+int cutter_selection_match(CutterSelection *selection, int64_t ts_ms);
+
+// Whether data[0] of the frame is an 8-bit luma plane the kernels can read
+int cutter_luma_supported(const AVFrame *frame);
+// Average CUTTER_THUMB_BLOCK x CUTTER_THUMB_BLOCK blocks, thumb is (re)allocated as needed
+int cutter_luma_downsample(const uint8_t *src, int linesize, int width, int height, CutterThumb *thumb);
+uint64_t cutter_luma_sad(const uint8_t *a, const uint8_t *b, size_t size);
+// 64-bit difference hash of a thumbnail of at least 9x8 pixels
+uint64_t cutter_luma_dhash(const CutterThumb *thumb);
+void cutter_luma_stats(const uint8_t *src, int linesize, int width, int height, CutterLumaStats *stats);
+// Variance of the 4-neighbour Laplacian, higher for sharper pictures
+double cutter_luma_laplacian_variance(const uint8_t *src, int linesize, int width, int height);
+void cutter_thumb_free(CutterThumb *thumb);
+
+// Restart the analysis stages at the beginning of a request
+void cutter_analysis_reset(CutterExtractor *extractor);
+void cutter_analysis_free(CutterExtractor *extractor);
+// Called before the stages look at a new frame
+void cutter_analysis_begin(CutterExtractor *extractor);
+// Returns 1 when the frame is not blank, 0 to drop it
+int cutter_blank_check(CutterExtractor *extractor, const AVFrame *frame);
+// Returns 1 when the frame opens a new shot, 0 to drop it, < 0 on error
+int cutter_scene_check(CutterExtractor *extractor, const AVFrame *frame);
+// Returns 1 when the frame differs enough from the last kept one, 0 to drop it, < 0 on error
+int cutter_dedupe_check(CutterExtractor *extractor, const AVFrame *frame);
+// Poster quality of a frame from sharpness and exposure, black or solid frames score negative
+double cutter_frame_score(const AVFrame *frame);
+
+#endif // LIBCUTTER_INTERNAL_H
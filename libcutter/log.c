@@ -0,0 +1,278 @@
+/*
+ * Leveled logging
+ *
+ * The level is compared by the cutter_log*() macros before any argument is
+ * evaluated, a filtered message costs one load and one branch.
+ *
+ * Messages are handed to the callback synchronously by default. Once
+ * cutter_log_start_async() is called, each thread formats its messages into
+ * a ring of its own and a background thread passes them on. A ring has a
+ * single producer and a single consumer, so neither side takes a lock.
+ * The ring of a thread that exits is handed to the next thread needing one,
+ * there are never more rings than threads logging at the same time.
+ * Messages of different threads may be reordered, those of one thread
+ * never are.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "internal.h"
+
+// Longer messages are truncated
+#define LOG_MESSAGE_SIZE 512
+#define LOG_RING_SLOTS 1024
+
+// Sleep of the flushing thread when every ring is empty
+#define LOG_IDLE_NS 2000000
+
+// Batch of the default output, written with a single call
+#define LOG_BATCH_SIZE 65536
+
+int cutter_log_level = CUTTER_LOG_INFO;
+
+typedef struct LogRing {
+    struct LogRing *next;
+    // Owned by a running thread, a free ring is reused before allocating one
+    atomic_int in_use;
+    // Slots written by the owning thread, and read by the flushing thread
+    atomic_size_t head;
+    atomic_size_t tail;
+    // Messages lost while the ring was full, errors wait instead
+    atomic_size_t dropped;
+    char slots[LOG_RING_SLOTS][LOG_MESSAGE_SIZE];
+} LogRing;
+
+static void default_log_callback(void *opaque, const char *fmt, va_list args)
+{
+    char message[LOG_MESSAGE_SIZE + 8];
+    (void) opaque;
+
+    // One write per line, stderr is unbuffered
+    int length = snprintf(message, sizeof(message), "LOG: ");
+    length += vsnprintf(message + length, sizeof(message) - length - 1, fmt, args);
+    if (length > (int) sizeof(message) - 2)
+        length = sizeof(message) - 2;
+    message[length++] = '\n';
+    fwrite(message, 1, length, stderr);
+}
+
+static cutter_log_cb log_callback = default_log_callback;
+static void *log_opaque = NULL;
+
+static atomic_int log_async;
+static atomic_int flusher_running;
+static pthread_t flusher;
+static _Atomic(LogRing *) log_rings;
+static _Thread_local LogRing *thread_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+// Batch of the flushing thread for the default output
+static char batch[LOG_BATCH_SIZE];
+static size_t batch_size;
+
+void cutter_log_set_callback(cutter_log_cb callback, void *opaque)
+{
+    log_callback = callback ? callback : default_log_callback;
+    log_opaque = callback ? opaque : NULL;
+}
+
+void cutter_log_set_level(CutterLogLevel level)
+{
+    cutter_log_level = level;
+}
+
+CutterLogLevel cutter_log_get_level(void)
+{
+    return cutter_log_level;
+}
+
+static void callback_printf(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start( args, fmt );
+    log_callback( log_opaque, fmt, args );
+    va_end( args );
+}
+
+static void flush_batch(void)
+{
+    if (batch_size) {
+        fwrite(batch, 1, batch_size, stderr);
+        batch_size = 0;
+    }
+}
+
+static void emit(const char *message)
+{
+    if (log_callback != default_log_callback) {
+        callback_printf("%s", message);
+        return;
+    }
+
+    size_t length = strlen(message);
+    if (batch_size + length + 6 > sizeof(batch))
+        flush_batch();
+    memcpy(batch + batch_size, "LOG: ", 5);
+    memcpy(batch + batch_size + 5, message, length);
+    batch[batch_size + 5 + length] = '\n';
+    batch_size += length + 6;
+}
+
+// Pass on the pending messages of every ring, returns how many there were
+static size_t drain_rings(void)
+{
+    size_t drained = 0;
+
+    for (LogRing *ring = atomic_load(&log_rings); ring; ring = ring->next) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+
+        drained += head - tail + dropped;
+        for (; tail != head; tail++)
+            emit(ring->slots[tail % LOG_RING_SLOTS]);
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        if (dropped) {
+            char message[64];
+            snprintf(message, sizeof(message), "%zu log messages dropped", dropped);
+            emit(message);
+        }
+    }
+    flush_batch();
+    return drained;
+}
+
+static void *flusher_main(void *opaque)
+{
+    const struct timespec idle = { 0, LOG_IDLE_NS };
+    (void) opaque;
+
+    while (atomic_load(&flusher_running)) {
+        if (!drain_rings())
+            nanosleep(&idle, NULL);
+    }
+    drain_rings();
+    return NULL;
+}
+
+// Destructor of ring_key: the ring outlives its thread, with any message
+// still pending, until another thread claims it
+static void release_ring(void *ring)
+{
+    atomic_store_explicit(&((LogRing *) ring)->in_use, 0, memory_order_release);
+}
+
+static void create_ring_key(void)
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+static LogRing *current_ring(void)
+{
+    LogRing *ring;
+
+    if (thread_ring)
+        return thread_ring;
+    pthread_once(&ring_key_once, create_ring_key);
+
+    // The new owner carries on after the messages of the previous one, the
+    // flushing thread sees no difference
+    for (ring = atomic_load(&log_rings); ring; ring = ring->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&ring->in_use, &expected, 1,
+                                                    memory_order_acq_rel, memory_order_relaxed))
+            break;
+    }
+
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if (!ring)
+            return NULL;
+        atomic_init(&ring->in_use, 1);
+        ring->next = atomic_load(&log_rings);
+        while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring))
+            ;
+    }
+
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+int cutter_log_start_async(void)
+{
+    if (atomic_load(&log_async))
+        return 0;
+
+    atomic_store(&flusher_running, 1);
+    int ret = pthread_create(&flusher, NULL, flusher_main, NULL);
+    if (ret) {
+        atomic_store(&flusher_running, 0);
+        return AVERROR(ret);
+    }
+    atomic_store(&log_async, 1);
+    return 0;
+}
+
+void cutter_log_stop_async(void)
+{
+    if (!atomic_load(&log_async))
+        return;
+
+    // Messages logged from now on go straight to the callback
+    atomic_store(&log_async, 0);
+    atomic_store(&flusher_running, 0);
+    pthread_join(flusher, NULL);
+}
+
+static void log_async_message(int level, const char *fmt, va_list args)
+{
+    LogRing *ring = current_ring();
+    if (!ring) {
+        log_callback( log_opaque, fmt, args );
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SLOTS) {
+        if (level > CUTTER_LOG_ERROR) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        sched_yield();
+    }
+
+    vsnprintf(ring->slots[head % LOG_RING_SLOTS], LOG_MESSAGE_SIZE, fmt, args);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void cutter_log_vprintf(CutterLogLevel level, const char *fmt, va_list args)
+{
+    if (level > cutter_log_level)
+        return;
+
+    if (atomic_load_explicit(&log_async, memory_order_relaxed))
+        log_async_message(level, fmt, args);
+    else
+        log_callback( log_opaque, fmt, args );
+}
+
+void cutter_log_message(CutterLogLevel level, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start( args, fmt );
+    cutter_log_vprintf( level, fmt, args );
+    va_end( args );
+}
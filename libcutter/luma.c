@@ -0,0 +1,250 @@
+/*
+ * Kernels working on the decoded luma (Y) plane, before any conversion.
+ *
+ * The SSE2 paths are used whenever the compiler targets it (always on x86-64),
+ * the scalar paths give the same results everywhere else.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/pixdesc.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "internal.h"
+
+int cutter_luma_supported(const AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+
+    // data[0] must hold 8-bit luma samples only: planar YUV or gray
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)))
+        return 0;
+    if (desc->nb_components > 1 && !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) && desc->comp[1].plane == 0)
+        return 0;
+    return desc->comp[0].depth == 8 && desc->comp[0].step == 1 &&
+           frame->width >= CUTTER_THUMB_BLOCK && frame->height >= CUTTER_THUMB_BLOCK;
+}
+
+void cutter_thumb_free(CutterThumb *thumb)
+{
+    free(thumb->data);
+    memset(thumb, 0, sizeof(*thumb));
+}
+
+int cutter_luma_downsample(const uint8_t *src, int linesize, int width, int height, CutterThumb *thumb)
+{
+    int thumb_width = width / CUTTER_THUMB_BLOCK;
+    int thumb_height = height / CUTTER_THUMB_BLOCK;
+
+    if (thumb->width != thumb_width || thumb->height != thumb_height) {
+        uint8_t *data = realloc(thumb->data, (size_t) thumb_width * thumb_height);
+        if (!data)
+            return AVERROR(ENOMEM);
+        thumb->data = data;
+        thumb->width = thumb_width;
+        thumb->height = thumb_height;
+    }
+
+    for (int by = 0; by < thumb_height; by++) {
+        const uint8_t *block_row = src + (size_t) by * CUTTER_THUMB_BLOCK * linesize;
+        uint8_t *dst = thumb->data + (size_t) by * thumb_width;
+        int bx = 0;
+
+#ifdef __SSE2__
+        // psadbw against zero sums 8 horizontal pixels per 64-bit lane,
+        // so one load covers two blocks and 8 loads complete them
+        const __m128i zero = _mm_setzero_si128();
+        for (; bx + 2 <= thumb_width; bx += 2) {
+            const uint8_t *p = block_row + bx * CUTTER_THUMB_BLOCK;
+            __m128i sum = zero;
+            for (int y = 0; y < CUTTER_THUMB_BLOCK; y++)
+                sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) (p + (size_t) y * linesize)), zero));
+            dst[bx] = (uint8_t) (_mm_cvtsi128_si32(sum) >> 6);
+            dst[bx + 1] = (uint8_t) (_mm_cvtsi128_si32(_mm_srli_si128(sum, 8)) >> 6);
+        }
+#endif
+        for (; bx < thumb_width; bx++) {
+            const uint8_t *p = block_row + bx * CUTTER_THUMB_BLOCK;
+            unsigned sum = 0;
+            for (int y = 0; y < CUTTER_THUMB_BLOCK; y++) {
+                for (int x = 0; x < CUTTER_THUMB_BLOCK; x++)
+                    sum += p[(size_t) y * linesize + x];
+            }
+            dst[bx] = (uint8_t) (sum >> 6);
+        }
+    }
+
+    return 0;
+}
+
+uint64_t cutter_luma_sad(const uint8_t *a, const uint8_t *b, size_t size)
+{
+    uint64_t sad = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i sum = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, sum);
+    sad = lanes[0] + lanes[1];
+#endif
+    for (; i < size; i++)
+        sad += abs(a[i] - b[i]);
+
+    return sad;
+}
+
+uint64_t cutter_luma_dhash(const CutterThumb *thumb)
+{
+    unsigned cells[CUTTER_DHASH_ROWS][CUTTER_DHASH_COLUMNS];
+    uint64_t hash = 0;
+
+    // Area average of the thumbnail into the 9x8 grid
+    for (int cy = 0; cy < CUTTER_DHASH_ROWS; cy++) {
+        int y0 = cy * thumb->height / CUTTER_DHASH_ROWS, y1 = (cy + 1) * thumb->height / CUTTER_DHASH_ROWS;
+        for (int cx = 0; cx < CUTTER_DHASH_COLUMNS; cx++) {
+            int x0 = cx * thumb->width / CUTTER_DHASH_COLUMNS, x1 = (cx + 1) * thumb->width / CUTTER_DHASH_COLUMNS;
+            unsigned sum = 0;
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++)
+                    sum += thumb->data[(size_t) y * thumb->width + x];
+            }
+            cells[cy][cx] = sum / ((y1 - y0) * (x1 - x0));
+        }
+    }
+
+    // One bit per horizontal gradient
+    for (int cy = 0; cy < CUTTER_DHASH_ROWS; cy++) {
+        for (int cx = 0; cx < CUTTER_DHASH_COLUMNS - 1; cx++)
+            hash = (hash << 1) | (cells[cy][cx] < cells[cy][cx + 1]);
+    }
+    return hash;
+}
+
+void cutter_luma_stats(const uint8_t *src, int linesize, int width, int height, CutterLumaStats *stats)
+{
+    unsigned min = 255, max = 0;
+    uint64_t sum = 0, sum_squares = 0;
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t *row = src + (size_t) y * linesize;
+        int x = 0;
+
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        __m128i vmin = _mm_set1_epi8((char) 0xff), vmax = zero;
+        __m128i vsum = zero, vsquares = zero;
+        for (; x + 16 <= width; x += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (row + x));
+            __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+
+            vmin = _mm_min_epu8(vmin, v);
+            vmax = _mm_max_epu8(vmax, v);
+            vsum = _mm_add_epi64(vsum, _mm_sad_epu8(v, zero));
+            // 255^2 * 2 per 32-bit lane and step, a row of 64K pixels stays far from overflow
+            vsquares = _mm_add_epi32(vsquares, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        }
+
+        uint8_t lanes_min[16], lanes_max[16];
+        uint64_t lanes_sum[2];
+        uint32_t lanes_squares[4];
+        _mm_storeu_si128((__m128i *) lanes_min, vmin);
+        _mm_storeu_si128((__m128i *) lanes_max, vmax);
+        _mm_storeu_si128((__m128i *) lanes_sum, vsum);
+        _mm_storeu_si128((__m128i *) lanes_squares, vsquares);
+        if (x) {
+            for (int i = 0; i < 16; i++) {
+                min = FFMIN(min, lanes_min[i]);
+                max = FFMAX(max, lanes_max[i]);
+            }
+        }
+        sum += lanes_sum[0] + lanes_sum[1];
+        sum_squares += (uint64_t) lanes_squares[0] + lanes_squares[1] + lanes_squares[2] + lanes_squares[3];
+#endif
+        for (; x < width; x++) {
+            unsigned v = row[x];
+            min = FFMIN(min, v);
+            max = FFMAX(max, v);
+            sum += v;
+            sum_squares += v * v;
+        }
+    }
+
+    double count = (double) width * height;
+    stats->min = min;
+    stats->max = max;
+    stats->mean = sum / count;
+    stats->variance = sum_squares / count - stats->mean * stats->mean;
+}
+
+double cutter_luma_laplacian_variance(const uint8_t *src, int linesize, int width, int height)
+{
+    double sum = 0, sum_squares = 0;
+
+    if (width < 3 || height < 3)
+        return 0;
+
+    // 4-neighbour Laplacian over the interior pixels
+    for (int y = 1; y < height - 1; y++) {
+        const uint8_t *row = src + (size_t) y * linesize;
+        int64_t row_sum = 0, row_squares = 0;
+        int x = 1;
+
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        __m128i vsum = zero, vsquares = zero;
+        for (; x + 8 <= width - 1; x += 8) {
+            __m128i center = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (row + x)), zero);
+            __m128i left = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (row + x - 1)), zero);
+            __m128i right = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (row + x + 1)), zero);
+            __m128i up = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (row + x - linesize)), zero);
+            __m128i down = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (row + x + linesize)), zero);
+            __m128i lap = _mm_sub_epi16(_mm_slli_epi16(center, 2),
+                                        _mm_add_epi16(_mm_add_epi16(left, right), _mm_add_epi16(up, down)));
+
+            // |lap| <= 1020: pairs of squares fit a 32-bit lane, sums are
+            // widened with madd against 1 and flushed every row
+            vsum = _mm_add_epi32(vsum, _mm_madd_epi16(lap, _mm_set1_epi16(1)));
+            vsquares = _mm_add_epi32(vsquares, _mm_madd_epi16(lap, lap));
+            if (((x - 1) & 1023) == 1016) {
+                int32_t lanes_sum[4], lanes_squares[4];
+                _mm_storeu_si128((__m128i *) lanes_sum, vsum);
+                _mm_storeu_si128((__m128i *) lanes_squares, vsquares);
+                for (int i = 0; i < 4; i++) {
+                    row_sum += lanes_sum[i];
+                    row_squares += (uint32_t) lanes_squares[i];
+                }
+                vsum = vsquares = zero;
+            }
+        }
+        int32_t lanes_sum[4], lanes_squares[4];
+        _mm_storeu_si128((__m128i *) lanes_sum, vsum);
+        _mm_storeu_si128((__m128i *) lanes_squares, vsquares);
+        for (int i = 0; i < 4; i++) {
+            row_sum += lanes_sum[i];
+            row_squares += (uint32_t) lanes_squares[i];
+        }
+#endif
+        for (; x < width - 1; x++) {
+            int lap = 4 * row[x] - row[x - 1] - row[x + 1] - row[x - linesize] - row[x + linesize];
+            row_sum += lap;
+            row_squares += lap * lap;
+        }
+
+        sum += row_sum;
+        sum_squares += row_squares;
+    }
+
+    double count = (double) (width - 2) * (height - 2);
+    double mean = sum / count;
+    return sum_squares / count - mean * mean;
+}
@@ -0,0 +1,209 @@
+/*
+ * LZ4 block format by Yann Collet, https://github.com/lz4/lz4
+ *
+ * A small greedy compressor and a bounds-checked decompressor, used by the
+ * frame sequences. The blocks follow the reference format (a token of the
+ * literal and match lengths, the literals, a 16-bit little-endian offset)
+ * so other LZ4 block decoders read them too, given the decompressed size.
+ */
+
+#include <string.h>
+
+#include "internal.h"
+
+#define MIN_MATCH 4
+// The format ends every block with literals: the last match ends 5 bytes
+// before the end and starts 12 bytes before it
+#define LAST_LITERALS 5
+#define MATCH_FIND_LIMIT 12
+#define MAX_DISTANCE 65535
+#define HASH_BITS 14
+// After 2^SKIP_TRIGGER misses in a row the search steps over more bytes,
+// incompressible data goes through quickly
+#define SKIP_TRIGGER 6
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Length of the common prefix of p and ref, not going past limit
+static size_t match_length(const uint8_t *p, const uint8_t *ref, const uint8_t *limit)
+{
+    const uint8_t *start = p;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // 8 bytes at a time, the lowest set bit of the difference is the first mismatch
+    while (p + 8 <= limit) {
+        uint64_t diff = read64(p) ^ read64(ref);
+        if (diff)
+            return p - start + (__builtin_ctzll(diff) >> 3);
+        p += 8;
+        ref += 8;
+    }
+#endif
+    while (p < limit && *p == *ref) {
+        p++;
+        ref++;
+    }
+    return p - start;
+}
+
+static uint8_t *write_length(uint8_t *op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = length;
+    return op;
+}
+
+// Literals from anchor to p, then the match at distance offset (0 for the last literals)
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *anchor, const uint8_t *p, size_t offset, size_t length)
+{
+    size_t literals = p - anchor;
+    uint8_t *token = op++;
+
+    *token = FFMIN(literals, 15) << 4;
+    if (literals >= 15)
+        op = write_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    if (!offset)
+        return op;
+    *op++ = offset;
+    *op++ = offset >> 8;
+    length -= MIN_MATCH;
+    *token |= FFMIN(length, 15);
+    if (length >= 15)
+        op = write_length(op, length - 15);
+    return op;
+}
+
+size_t cutter_lz_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+size_t cutter_lz_compress(const uint8_t *src, size_t size, uint8_t *dst)
+{
+    // Positions of the last 4-byte sequences seen, by hash
+    uint32_t table[1 << HASH_BITS];
+    const uint8_t *p = src, *anchor = src, *end = src + size;
+    uint8_t *op = dst;
+
+    memset(table, 0, sizeof(table));
+    if (size > MATCH_FIND_LIMIT) {
+        const uint8_t *find_limit = end - MATCH_FIND_LIMIT, *match_limit = end - LAST_LITERALS;
+        unsigned misses = 0;
+
+        while (p < find_limit) {
+            uint32_t sequence = read32(p);
+            uint32_t h = hash4(sequence);
+            const uint8_t *ref = src + table[h];
+            table[h] = p - src;
+
+            if (ref >= p || p - ref > MAX_DISTANCE || read32(ref) != sequence) {
+                p += 1 + (misses++ >> SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            // The match may start in the literals before it
+            while (p > anchor && ref > src && p[-1] == ref[-1]) {
+                p--;
+                ref--;
+            }
+            size_t length = MIN_MATCH + match_length(p + MIN_MATCH, ref + MIN_MATCH, match_limit);
+
+            op = write_sequence(op, anchor, p, p - ref, length);
+            p += length;
+            anchor = p;
+            // Also seen, for the next matches
+            if (p < find_limit)
+                table[hash4(read32(p - 2))] = p - 2 - src;
+        }
+    }
+
+    op = write_sequence(op, anchor, end, 0, 0);
+    return op - dst;
+}
+
+int cutter_lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t dst_size)
+{
+    const uint8_t *p = src, *end = src + size;
+    uint8_t *op = dst, *op_end = dst + dst_size;
+
+    for (;;) {
+        if (p >= end)
+            return AVERROR_INVALIDDATA;
+        unsigned token = *p++;
+
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            unsigned byte;
+            do {
+                if (p >= end)
+                    return AVERROR_INVALIDDATA;
+                byte = *p++;
+                literals += byte;
+            } while (byte == 255);
+        }
+        if (literals > (size_t) (end - p) || literals > (size_t) (op_end - op))
+            return AVERROR_INVALIDDATA;
+        memcpy(op, p, literals);
+        op += literals;
+        p += literals;
+
+        // The block ends with its last literals
+        if (p == end)
+            break;
+
+        if (end - p < 2)
+            return AVERROR_INVALIDDATA;
+        size_t offset = p[0] | p[1] << 8;
+        p += 2;
+        if (!offset || offset > (size_t) (op - dst))
+            return AVERROR_INVALIDDATA;
+
+        size_t length = token & 15;
+        if (length == 15) {
+            unsigned byte;
+            do {
+                if (p >= end)
+                    return AVERROR_INVALIDDATA;
+                byte = *p++;
+                length += byte;
+            } while (byte == 255);
+        }
+        length += MIN_MATCH;
+        if (length > (size_t) (op_end - op))
+            return AVERROR_INVALIDDATA;
+
+        // Overlapping matches repeat their first offset bytes: each copy
+        // doubles the distance to the source, so runs take a few memcpy()
+        const uint8_t *match = op - offset;
+        while (length) {
+            size_t n = FFMIN(length, (size_t) (op - match));
+            memcpy(op, match, n);
+            op += n;
+            length -= n;
+        }
+    }
+
+    return op == op_end ? 0 : AVERROR_INVALIDDATA;
+}
@@ -0,0 +1,212 @@
+/*
+ * Checkpoint manifest of a long extraction
+ *
+ * One text line is appended per completed output, once its file is closed:
+ *
+ *     <number> <pts> <size> <checksum> <filename>
+ *
+ * The checksum chains XXH64 over 64 KiB blocks of the file. A job killed
+ * half way leaves at most a torn last line, which is dropped on resume
+ * together with every entry whose file does not match anymore.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+#define CHECKSUM_BLOCK_SIZE 65536
+
+// Only the last entries are checksummed on resume, earlier files were
+// closed long before the job stopped and only get their size checked
+#define RESUME_VERIFY_TAIL 64
+
+struct CutterManifest {
+    FILE *fp;
+    // Last valid entry, number 0 when there is none
+    int last_number;
+    int64_t last_pts;
+};
+
+static int file_checksum(const char *filename, int64_t *size, uint64_t *checksum)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return AVERROR(errno);
+
+    uint8_t *block = malloc(CHECKSUM_BLOCK_SIZE);
+    if (!block) {
+        fclose(fp);
+        return AVERROR(ENOMEM);
+    }
+
+    uint64_t h = 0;
+    int64_t total = 0;
+    size_t length;
+    while ((length = fread(block, 1, CHECKSUM_BLOCK_SIZE, fp)) > 0) {
+        h = cutter_xxh64(block, length, h);
+        total += length;
+    }
+
+    int ret = ferror(fp) ? AVERROR(EIO) : 0;
+    free(block);
+    fclose(fp);
+    *size = total;
+    *checksum = h;
+    return ret;
+}
+
+typedef struct ManifestEntry {
+    int number;
+    int64_t pts;
+    int64_t size;
+    uint64_t checksum;
+    char filename[1024];
+    // Offset of the line in the manifest
+    long offset;
+} ManifestEntry;
+
+// Read back the complete lines and keep the prefix whose files still match
+static int load_entries(CutterManifest *manifest)
+{
+    ManifestEntry *entries = NULL;
+    size_t count = 0, allocated = 0, valid;
+    char line[1200];
+    long offset = 0;
+
+    while (fgets(line, sizeof(line), manifest->fp)) {
+        size_t length = strlen(line);
+        ManifestEntry entry;
+        int consumed = 0;
+
+        // A torn or garbled line ends the usable part
+        if (!length || line[length - 1] != '\n')
+            break;
+        line[length - 1] = '\0';
+        if (sscanf(line, "%d %" SCNd64 " %" SCNd64 " %" SCNx64 " %n",
+                   &entry.number, &entry.pts, &entry.size, &entry.checksum, &consumed) != 4 || !consumed)
+            break;
+        snprintf(entry.filename, sizeof(entry.filename), "%s", line + consumed);
+        entry.offset = offset;
+
+        if (count == allocated) {
+            size_t new_size = allocated ? allocated * 2 : 1024;
+            ManifestEntry *tmp = realloc(entries, new_size * sizeof(*entries));
+            if (!tmp) {
+                free(entries);
+                return AVERROR(ENOMEM);
+            }
+            entries = tmp;
+            allocated = new_size;
+        }
+        entries[count++] = entry;
+        offset += length;
+    }
+
+    for (valid = 0; valid < count; valid++) {
+        const ManifestEntry *entry = &entries[valid];
+        struct stat st;
+
+        if (stat(entry->filename, &st) < 0 || st.st_size != entry->size)
+            break;
+        if (valid + RESUME_VERIFY_TAIL >= count) {
+            int64_t size;
+            uint64_t checksum;
+            if (file_checksum(entry->filename, &size, &checksum) < 0 ||
+                size != entry->size || checksum != entry->checksum)
+                break;
+        }
+    }
+
+    if (valid < count) {
+        cutter_log_error("Manifest entry %d (%s) does not match its file, resuming before it",
+                   entries[valid].number, entries[valid].filename);
+        offset = entries[valid].offset;
+    }
+    if (valid) {
+        manifest->last_number = entries[valid - 1].number;
+        manifest->last_pts = entries[valid - 1].pts;
+    }
+    free(entries);
+
+    // Later entries are appended right after the valid ones
+    fflush(manifest->fp);
+    if (ftruncate(fileno(manifest->fp), offset) < 0 || fseek(manifest->fp, offset, SEEK_SET) < 0)
+        return AVERROR(errno);
+
+    cutter_log("*** Manifest: %zu outputs verified", valid);
+    return 0;
+}
+
+int cutter_manifest_open(CutterManifest **manifest_out, const char *path, int resume)
+{
+    int ret;
+
+    *manifest_out = NULL;
+    CutterManifest *manifest = calloc(1, sizeof(*manifest));
+    if (!manifest)
+        return AVERROR(ENOMEM);
+
+    // Without resume any previous manifest describes outputs about to be replaced
+    manifest->fp = fopen(path, resume ? "a+" : "w");
+    if (!manifest->fp) {
+        ret = AVERROR(errno);
+        cutter_log_error("Failed to open the manifest %s", path);
+        free(manifest);
+        return ret;
+    }
+
+    if (resume) {
+        rewind(manifest->fp);
+        ret = load_entries(manifest);
+        if (ret < 0) {
+            cutter_manifest_close(&manifest);
+            return ret;
+        }
+    }
+
+    *manifest_out = manifest;
+    return 0;
+}
+
+void cutter_manifest_close(CutterManifest **manifest)
+{
+    if (!*manifest)
+        return;
+    fclose((*manifest)->fp);
+    free(*manifest);
+    *manifest = NULL;
+}
+
+int cutter_manifest_last(const CutterManifest *manifest, int *number, int64_t *pts)
+{
+    if (!manifest->last_number)
+        return 0;
+    *number = manifest->last_number;
+    *pts = manifest->last_pts;
+    return 1;
+}
+
+int cutter_manifest_append(CutterManifest *manifest, int number, int64_t pts, const char *filename)
+{
+    int64_t size;
+    uint64_t checksum;
+
+    int ret = file_checksum(filename, &size, &checksum);
+    if (ret < 0)
+        return ret;
+
+    // Flushed line by line, a killed job loses at most the line being written
+    fprintf(manifest->fp, "%d %" PRId64 " %" PRId64 " %016" PRIx64 " %s\n", number, pts, size, checksum, filename);
+    if (fflush(manifest->fp) != 0)
+        return AVERROR(errno);
+
+    manifest->last_number = number;
+    manifest->last_pts = pts;
+    return 0;
+}
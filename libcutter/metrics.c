@@ -0,0 +1,203 @@
+/*
+ * Per-stage timing metrics
+ *
+ * Each stage owns a log-linear histogram of its latencies: one group of
+ * HISTOGRAM_SUB_BUCKETS buckets per power of two of nanoseconds, so the
+ * percentiles are within 1/8 of the true value. Buckets and totals are
+ * relaxed atomics, recording never takes a lock and costs two clock reads.
+ * Nothing is recorded until cutter_metrics_enable() is called. The same
+ * sections feed the timeline of trace.c.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "internal.h"
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct StageMetrics {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t total_ns;
+    atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+} StageMetrics;
+
+static const char *const stage_names[CUTTER_STAGE_NB] = {
+    [CUTTER_STAGE_DEMUX]   = "demux",
+    [CUTTER_STAGE_DECODE]  = "decode",
+    [CUTTER_STAGE_CONVERT] = "convert",
+    [CUTTER_STAGE_ENCODE]  = "encode",
+    [CUTTER_STAGE_WRITE]   = "write",
+};
+
+static atomic_int metrics_enabled;
+static int64_t metrics_start_ns;
+static StageMetrics stages[CUTTER_STAGE_NB];
+static atomic_uint_fast64_t bytes_written;
+
+const char *cutter_stage_name(CutterStage stage)
+{
+    return stage_names[stage];
+}
+
+int64_t cutter_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void cutter_metrics_enable(int enable)
+{
+    if (enable && !atomic_load_explicit(&metrics_enabled, memory_order_relaxed))
+        metrics_start_ns = cutter_time_ns();
+    atomic_store(&metrics_enabled, enable);
+}
+
+int64_t cutter_metrics_start(void)
+{
+    int enabled = atomic_load_explicit(&metrics_enabled, memory_order_relaxed) || cutter_trace_active();
+
+    return enabled ? cutter_time_ns() : 0;
+}
+
+// Values below HISTOGRAM_SUB_BUCKETS get a bucket each, then every power of
+// two is split into HISTOGRAM_SUB_BUCKETS linear buckets
+static int bucket_index(uint64_t ns)
+{
+    if (ns < HISTOGRAM_SUB_BUCKETS)
+        return ns;
+
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Upper bound of a bucket, reported for the percentiles
+static uint64_t bucket_limit(int index)
+{
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+
+    int exponent = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void cutter_metrics_add(CutterStage stage, int64_t ns)
+{
+    StageMetrics *metrics = &stages[stage];
+
+    if (!atomic_load_explicit(&metrics_enabled, memory_order_relaxed))
+        return;
+    if (ns < 0)
+        ns = 0;
+    atomic_fetch_add_explicit(&metrics->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics->buckets[bucket_index(ns)], 1, memory_order_relaxed);
+}
+
+void cutter_metrics_record(CutterStage stage, int64_t start)
+{
+    if (!start)
+        return;
+
+    int64_t now = cutter_time_ns();
+    cutter_metrics_add(stage, now - start);
+    cutter_trace_span(stage, start, now);
+}
+
+void cutter_metrics_add_bytes(size_t bytes)
+{
+    if (atomic_load_explicit(&metrics_enabled, memory_order_relaxed))
+        atomic_fetch_add_explicit(&bytes_written, bytes, memory_order_relaxed);
+}
+
+int cutter_metrics_stage(const char *name, uint64_t *count, uint64_t *total_ns)
+{
+    for (int s = 0; s < CUTTER_STAGE_NB; s++) {
+        if (!strcmp(stage_names[s], name)) {
+            *count = atomic_load(&stages[s].count);
+            *total_ns = atomic_load(&stages[s].total_ns);
+            return 0;
+        }
+    }
+    return AVERROR(EINVAL);
+}
+
+uint64_t cutter_metrics_bytes(void)
+{
+    return atomic_load(&bytes_written);
+}
+
+void cutter_metrics_reset(void)
+{
+    for (int s = 0; s < CUTTER_STAGE_NB; s++) {
+        atomic_store(&stages[s].count, 0);
+        atomic_store(&stages[s].total_ns, 0);
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+            atomic_store_explicit(&stages[s].buckets[i], 0, memory_order_relaxed);
+    }
+    atomic_store(&bytes_written, 0);
+    metrics_start_ns = cutter_time_ns();
+}
+
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, double fraction)
+{
+    uint64_t rank = (uint64_t) (fraction * count + 0.5), seen = 0;
+
+    if (rank < 1)
+        rank = 1;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return bucket_limit(i);
+    }
+    return 0;
+}
+
+int cutter_metrics_write_json(FILE *fp)
+{
+    static uint64_t buckets[HISTOGRAM_BUCKETS];
+    struct rusage usage;
+
+    double elapsed = (cutter_time_ns() - metrics_start_ns) / 1e9;
+    uint64_t frames = atomic_load(&stages[CUTTER_STAGE_CONVERT].count);
+    uint64_t bytes = atomic_load(&bytes_written);
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(fp, "{\n  \"elapsed_s\": %.6f,\n  \"frames\": %" PRIu64 ",\n", elapsed, frames);
+    fprintf(fp, "  \"frames_per_s\": %.3f,\n", elapsed > 0 ? frames / elapsed : 0.0);
+    fprintf(fp, "  \"bytes_written\": %" PRIu64 ",\n", bytes);
+    fprintf(fp, "  \"mb_per_s\": %.3f,\n", elapsed > 0 ? bytes / 1e6 / elapsed : 0.0);
+    // ru_maxrss is in KiB on Linux
+    fprintf(fp, "  \"peak_rss_kb\": %ld,\n  \"stages\": {", usage.ru_maxrss);
+
+    for (int s = 0; s < CUTTER_STAGE_NB; s++) {
+        uint64_t count = atomic_load(&stages[s].count);
+        uint64_t total = atomic_load(&stages[s].total_ns);
+
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+            buckets[i] = atomic_load_explicit(&stages[s].buckets[i], memory_order_relaxed);
+
+        fprintf(fp, "%s\n    \"%s\": { \"count\": %" PRIu64 ", \"total_ns\": %" PRIu64, s ? "," : "",
+                stage_names[s], count, total);
+        if (count)
+            fprintf(fp, ", \"mean_ns\": %" PRIu64 ", \"p50_ns\": %" PRIu64 ", \"p95_ns\": %" PRIu64
+                        ", \"p99_ns\": %" PRIu64,
+                    total / count, percentile(buckets, count, 0.50),
+                    percentile(buckets, count, 0.95), percentile(buckets, count, 0.99));
+        fprintf(fp, " }");
+    }
+    fprintf(fp, "\n  }\n}\n");
+
+    return ferror(fp) ? AVERROR(EIO) : 0;
+}
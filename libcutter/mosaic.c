@@ -0,0 +1,266 @@
+/*
+ * Sprite sheets for video scrubbing
+ *
+ * The frames at the requested timestamps are decoded through
+ * cutter_extract_many() and scaled down to the tile size by the extractor,
+ * whose scaler context and padded RGB frame are reused from tile to tile,
+ * then copied into their tile of one atlas allocated up front. The scaler
+ * is never pointed at the atlas itself: its SIMD loops may write past the
+ * end of a row, into the next tile. The atlas is then encoded once, with a
+ * WebVTT or JSON map telling the player where each timestamp is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <libavutil/imgutils.h>
+
+#include "internal.h"
+
+// Width of the tiles when none is given
+#define DEFAULT_TILE_WIDTH 160
+
+typedef struct MosaicTile {
+    int64_t ts_ms;
+    int64_t pts;
+    int64_t requested_ms;
+} MosaicTile;
+
+struct CutterMosaic {
+    int columns;
+    int rows;
+    int tile_width;
+    int tile_height;
+
+    // Packed RGB24 atlas of columns x rows tiles, black where no frame landed
+    uint8_t *data;
+    int linesize;
+
+    MosaicTile *tiles;
+    int nb_tiles;
+    // End of the last tile in the maps, the stream duration when known
+    int64_t end_ms;
+};
+
+// The atlas is one image, its rows and size must fit the int sizes of libavutil
+static int check_atlas(int columns, int rows, int64_t tile_width, int64_t tile_height)
+{
+    int64_t width = columns * tile_width, height = rows * tile_height;
+
+    if (width > INT_MAX || height > INT_MAX || av_image_check_size(width, height, 0, NULL) < 0) {
+        cutter_log_error("A mosaic of %dx%d tiles of %" PRId64 "x%" PRId64 " pixels is too large",
+                         columns, rows, tile_width, tile_height);
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+int cutter_mosaic_alloc(CutterMosaic **mosaic_out, int columns, int rows, int tile_width, int tile_height)
+{
+    CutterMosaic *mosaic;
+
+    *mosaic_out = NULL;
+    if (columns < 1 || rows < 1 || tile_width < 0 || tile_height < 0 || columns > 1024 || rows > 1024)
+        return AVERROR(EINVAL);
+    // The height of the tiles may only be known once the input is probed
+    int ret = check_atlas(columns, rows, tile_width ? tile_width : DEFAULT_TILE_WIDTH, FFMAX(tile_height, 1));
+    if (ret < 0)
+        return ret;
+
+    mosaic = calloc(1, sizeof(*mosaic));
+    if (!mosaic)
+        return AVERROR(ENOMEM);
+    mosaic->columns = columns;
+    mosaic->rows = rows;
+    mosaic->tile_width = tile_width ? tile_width : DEFAULT_TILE_WIDTH;
+    mosaic->tile_height = tile_height;
+    mosaic->tiles = calloc((size_t) columns * rows, sizeof(*mosaic->tiles));
+    if (!mosaic->tiles) {
+        free(mosaic);
+        return AVERROR(ENOMEM);
+    }
+
+    *mosaic_out = mosaic;
+    return 0;
+}
+
+void cutter_mosaic_free(CutterMosaic **mosaic)
+{
+    if (!*mosaic)
+        return;
+    av_free((*mosaic)->data);
+    free((*mosaic)->tiles);
+    free(*mosaic);
+    *mosaic = NULL;
+}
+
+static uint8_t *tile_data(const CutterMosaic *mosaic, int tile)
+{
+    int x = tile % mosaic->columns, y = tile / mosaic->columns;
+
+    return mosaic->data + (size_t) y * mosaic->tile_height * mosaic->linesize + (size_t) x * mosaic->tile_width * 3;
+}
+
+static int fill_tile(const CutterImage *image, void *opaque)
+{
+    CutterMosaic *mosaic = opaque;
+    uint8_t *tile = tile_data(mosaic, mosaic->nb_tiles);
+
+    // Only the tile_width pixels of each row, the padding stays out of the atlas
+    for (int y = 0; y < mosaic->tile_height; y++)
+        memcpy(tile + (size_t) y * mosaic->linesize, image->data + (size_t) y * image->linesize,
+               (size_t) mosaic->tile_width * 3);
+
+    MosaicTile *entry = &mosaic->tiles[mosaic->nb_tiles++];
+    entry->ts_ms = image->ts_ms;
+    entry->pts = image->pts;
+    entry->requested_ms = image->requested_ms;
+    cutter_log_verbose("Tile %d at %" PRId64 " ms", mosaic->nb_tiles, image->ts_ms);
+
+    return mosaic->nb_tiles == mosaic->columns * mosaic->rows;
+}
+
+int cutter_extract_mosaic(CutterExtractor *ex, CutterMosaic *mosaic, const int64_t *ts_ms, size_t count)
+{
+    size_t nb_tiles = (size_t) mosaic->columns * mosaic->rows;
+    int64_t *spread = NULL;
+    CutterProbe probe;
+    int ret;
+
+    cutter_probe(ex, &probe);
+    if (probe.width <= 0 || probe.height <= 0)
+        return AVERROR(EINVAL);
+
+    // The tiles keep the aspect ratio of the frames unless both sides are given
+    if (!mosaic->tile_height) {
+        int64_t tile_height = FFMAX(1, av_rescale(mosaic->tile_width, probe.height, probe.width));
+        ret = check_atlas(mosaic->columns, mosaic->rows, mosaic->tile_width, tile_height);
+        if (ret < 0)
+            return ret;
+        mosaic->tile_height = tile_height;
+    }
+
+    if (!mosaic->data) {
+        // Rows padded to 64 bytes, like the frames of libavutil
+        mosaic->linesize = FFALIGN(mosaic->columns * mosaic->tile_width * 3, 64);
+        mosaic->data = av_mallocz((size_t) mosaic->linesize * mosaic->rows * mosaic->tile_height);
+        if (!mosaic->data)
+            return AVERROR(ENOMEM);
+    }
+    mosaic->end_ms = probe.duration_ms;
+
+    // Without timestamps the tiles are spread evenly, each one in the middle of its span
+    if (!ts_ms) {
+        if (probe.duration_ms <= 0)
+            return AVERROR(EINVAL);
+        spread = malloc(nb_tiles * sizeof(*spread));
+        if (!spread)
+            return AVERROR(ENOMEM);
+        for (size_t i = 0; i < nb_tiles; i++)
+            spread[i] = probe.duration_ms * (2 * i + 1) / (2 * nb_tiles);
+        ts_ms = spread;
+        count = nb_tiles;
+    }
+
+    mosaic->nb_tiles = 0;
+    ex->tile_width = mosaic->tile_width;
+    ex->tile_height = mosaic->tile_height;
+
+    ret = cutter_extract_many(ex, ts_ms, FFMIN(count, nb_tiles), fill_tile, mosaic);
+
+    // Later requests convert at the size of the input again
+    ex->tile_width = 0;
+    ex->tile_height = 0;
+    free(spread);
+    if (ret < 0)
+        return ret;
+
+    cutter_log("*** Mosaic of %d tiles of %dx%d", mosaic->nb_tiles, mosaic->tile_width, mosaic->tile_height);
+    return mosaic->nb_tiles;
+}
+
+void cutter_mosaic_image(const CutterMosaic *mosaic, CutterImage *image)
+{
+    memset(image, 0, sizeof(*image));
+    image->data = mosaic->data;
+    image->linesize = mosaic->linesize;
+    image->width = mosaic->columns * mosaic->tile_width;
+    image->height = mosaic->rows * mosaic->tile_height;
+    image->pts = AV_NOPTS_VALUE;
+    image->ts_ms = -1;
+    image->requested_ms = -1;
+    image->frame_index = -1;
+}
+
+static void write_vtt_time(FILE *fp, int64_t ms)
+{
+    ms = FFMAX(ms, 0);
+    fprintf(fp, "%02" PRId64 ":%02d:%02d.%03d", ms / 3600000, (int) (ms / 60000 % 60), (int) (ms / 1000 % 60),
+            (int) (ms % 1000));
+}
+
+// A tile covers the player positions from its timestamp to the next distinct
+// one: timestamps answered by the same frame share their span
+static int64_t tile_end_ms(const CutterMosaic *mosaic, int tile)
+{
+    for (int next = tile + 1; next < mosaic->nb_tiles; next++) {
+        if (mosaic->tiles[next].ts_ms > mosaic->tiles[tile].ts_ms)
+            return mosaic->tiles[next].ts_ms;
+    }
+    if (mosaic->end_ms > mosaic->tiles[tile].ts_ms)
+        return mosaic->end_ms;
+    return mosaic->tiles[tile].ts_ms + 1000;
+}
+
+int cutter_mosaic_write_vtt(const CutterMosaic *mosaic, FILE *fp, const char *image_url)
+{
+    fprintf(fp, "WEBVTT\n");
+    for (int i = 0; i < mosaic->nb_tiles; i++) {
+        // A repeated timestamp is already covered by the cue of its first tile,
+        // players do not expect empty cues
+        if (i && mosaic->tiles[i].ts_ms <= mosaic->tiles[i - 1].ts_ms)
+            continue;
+
+        // The first tile also covers the start of the stream
+        fprintf(fp, "\n");
+        write_vtt_time(fp, i ? mosaic->tiles[i].ts_ms : 0);
+        fprintf(fp, " --> ");
+        write_vtt_time(fp, tile_end_ms(mosaic, i));
+        fprintf(fp, "\n%s#xywh=%d,%d,%d,%d\n", image_url,
+                i % mosaic->columns * mosaic->tile_width, i / mosaic->columns * mosaic->tile_height,
+                mosaic->tile_width, mosaic->tile_height);
+    }
+    return ferror(fp) ? AVERROR(EIO) : 0;
+}
+
+int cutter_mosaic_write_json(const CutterMosaic *mosaic, FILE *fp, const char *image_url)
+{
+    fprintf(fp, "{\n  \"image\": \"");
+    // Only the characters JSON requires are escaped
+    for (const char *p = image_url; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fputc('\\', fp);
+        if ((unsigned char) *p < 0x20)
+            fprintf(fp, "\\u%04x", *p);
+        else
+            fputc(*p, fp);
+    }
+    fprintf(fp, "\",\n  \"columns\": %d,\n  \"rows\": %d,\n  \"tile_width\": %d,\n  \"tile_height\": %d,\n"
+                "  \"tiles\": [",
+            mosaic->columns, mosaic->rows, mosaic->tile_width, mosaic->tile_height);
+
+    for (int i = 0; i < mosaic->nb_tiles; i++) {
+        const MosaicTile *tile = &mosaic->tiles[i];
+
+        fprintf(fp, "%s\n    { \"x\": %d, \"y\": %d, \"start_ms\": %" PRId64 ", \"end_ms\": %" PRId64
+                    ", \"ts_ms\": %" PRId64 ", \"pts\": %" PRId64 " }",
+                i ? "," : "", i % mosaic->columns * mosaic->tile_width, i / mosaic->columns * mosaic->tile_height,
+                i ? tile->ts_ms : 0, tile_end_ms(mosaic, i), tile->ts_ms, tile->pts);
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    return ferror(fp) ? AVERROR(EIO) : 0;
+}
@@ -0,0 +1,280 @@
+/*
+ * Content-addressed cache of the written PNG files
+ *
+ * Every output is stored as <directory>/<xx>/<key>.png where the key hashes
+ * a fingerprint of the input (size, mtime and a few sampled blocks), the
+ * delivery options and the position of the frame. A rerun links its
+ * outputs from there instead of decoding and encoding them again.
+ *
+ * Objects are only ever published with rename(), so concurrent jobs sharing
+ * a directory see either a complete file or none at all. Two jobs racing on
+ * the same key write identical bytes, whichever rename lands last wins.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "internal.h"
+
+// Blocks of the input hashed into its fingerprint, first and last included
+#define SAMPLE_BLOCKS 8
+#define SAMPLE_BLOCK_SIZE 65536
+
+// Bump when the encoded output changes, older objects are then never looked up
+#define OUTPUT_CACHE_VERSION 1
+
+// Kind of position an object is stored under
+#define KEY_REQUESTED 'T'
+#define KEY_FRAME 'F'
+
+struct CutterOutputCache {
+    CutterExtractor *extractor;
+    char *directory;
+    uint64_t input_hash;
+    unsigned int tmp_counter;
+};
+
+typedef struct OutputKey {
+    uint64_t input_hash;
+    int32_t version;
+    int32_t stream_index;
+    int32_t sws_flags;
+    int32_t blank_mean;
+    int32_t blank_range;
+    int32_t kind;
+    int64_t position;
+} OutputKey;
+
+// Hash the file identity and SAMPLE_BLOCKS blocks spread over its content
+static int input_fingerprint(const char *filename, uint64_t *hash)
+{
+    struct stat st;
+    int ret = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return AVERROR(errno);
+    if (fstat(fd, &st) < 0) {
+        ret = AVERROR(errno);
+        close(fd);
+        return ret;
+    }
+
+    uint8_t *block = malloc(SAMPLE_BLOCK_SIZE);
+    if (!block) {
+        close(fd);
+        return AVERROR(ENOMEM);
+    }
+
+    int64_t identity[2] = { st.st_size, st.st_mtime };
+    uint64_t h = cutter_xxh64(identity, sizeof(identity), 0);
+
+    for (int i = 0; i < SAMPLE_BLOCKS; i++) {
+        off_t offset = st.st_size <= (off_t) SAMPLE_BLOCKS * SAMPLE_BLOCK_SIZE
+                     ? (off_t) i * SAMPLE_BLOCK_SIZE
+                     : (st.st_size - SAMPLE_BLOCK_SIZE) / (SAMPLE_BLOCKS - 1) * i;
+        ssize_t size = pread(fd, block, SAMPLE_BLOCK_SIZE, offset);
+        if (size < 0) {
+            ret = AVERROR(errno);
+            break;
+        }
+        if (size == 0)
+            break;
+        h = cutter_xxh64(block, size, h);
+    }
+
+    free(block);
+    close(fd);
+    *hash = h;
+    return ret;
+}
+
+int cutter_output_cache_open(CutterOutputCache **cache_out, CutterExtractor *ex, const char *directory)
+{
+    CutterOutputCache *cache;
+    int ret;
+
+    *cache_out = NULL;
+    if (mkdir(directory, 0777) < 0 && errno != EEXIST) {
+        ret = AVERROR(errno);
+        cutter_log_error("Failed to create the cache directory %s", directory);
+        return ret;
+    }
+
+    cache = calloc(1, sizeof(*cache));
+    if (!cache)
+        return AVERROR(ENOMEM);
+    cache->extractor = ex;
+    cache->directory = strdup(directory);
+    if (!cache->directory) {
+        free(cache);
+        return AVERROR(ENOMEM);
+    }
+
+    ret = input_fingerprint(ex->filename, &cache->input_hash);
+    if (ret < 0) {
+        cutter_log_error("%s cannot be fingerprinted, outputs are not cached: %s", ex->filename, av_err2str(ret));
+        cutter_output_cache_close(&cache);
+        return ret;
+    }
+
+    cutter_log("*** Output cache %s, input fingerprint %016" PRIx64, directory, cache->input_hash);
+    *cache_out = cache;
+    return 0;
+}
+
+void cutter_output_cache_close(CutterOutputCache **cache)
+{
+    if (!*cache)
+        return;
+    free((*cache)->directory);
+    free(*cache);
+    *cache = NULL;
+}
+
+static void object_path(const CutterOutputCache *cache, int kind, int64_t position, char *path, size_t size)
+{
+    const CutterExtractor *ex = cache->extractor;
+    OutputKey key;
+
+    // Zeroed as a whole, the padding is hashed too
+    memset(&key, 0, sizeof(key));
+    key.input_hash = cache->input_hash;
+    key.version = OUTPUT_CACHE_VERSION;
+    key.stream_index = ex->video_stream_index;
+    key.sws_flags = ex->options.sws_flags;
+    key.blank_mean = ex->options.blank_mean;
+    key.blank_range = ex->options.blank_range;
+    key.kind = kind;
+    key.position = position;
+
+    uint64_t hash = cutter_xxh64(&key, sizeof(key), 0);
+    snprintf(path, size, "%s/%02x/%016" PRIx64 ".png", cache->directory, (unsigned int) (hash >> 56), hash);
+}
+
+// Copy-on-write clone where the filesystem supports it, a plain copy otherwise
+static int clone_file(const char *src, const char *dst)
+{
+    char buffer[65536];
+    ssize_t size;
+    int ret = 0;
+
+    int in = open(src, O_RDONLY);
+    if (in < 0)
+        return AVERROR(errno);
+    int out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out < 0) {
+        ret = AVERROR(errno);
+        close(in);
+        return ret;
+    }
+
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0)
+        goto end;
+#endif
+
+    while ((size = read(in, buffer, sizeof(buffer))) > 0) {
+        if (write(out, buffer, size) != size) {
+            ret = AVERROR(errno);
+            goto end;
+        }
+    }
+    if (size < 0)
+        ret = AVERROR(errno);
+
+end:
+    close(in);
+    if (close(out) < 0 && ret == 0)
+        ret = AVERROR(errno);
+    if (ret < 0)
+        unlink(dst);
+    return ret;
+}
+
+// Make dst a link to src, or a clone across filesystems, replacing dst atomically
+static int link_atomic(CutterOutputCache *cache, const char *src, const char *dst)
+{
+    char tmp[4096];
+    int ret = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.%u.tmp", dst, (int) getpid(), cache->tmp_counter++);
+
+    if (link(src, tmp) < 0) {
+        if (errno != EXDEV && errno != EPERM && errno != EMLINK)
+            return AVERROR(errno);
+        ret = clone_file(src, tmp);
+        if (ret < 0)
+            return ret;
+    }
+    if (rename(tmp, dst) < 0) {
+        ret = AVERROR(errno);
+        unlink(tmp);
+    }
+    return ret;
+}
+
+static int fetch(CutterOutputCache *cache, int kind, int64_t position, const char *filename)
+{
+    char path[4096];
+
+    object_path(cache, kind, position, path, sizeof(path));
+    int ret = link_atomic(cache, path, filename);
+    if (ret == AVERROR(ENOENT))
+        return 0;
+    if (ret < 0) {
+        cutter_log_error("Failed to link %s from the cache: %s", filename, av_err2str(ret));
+        return ret;
+    }
+
+    cutter_log_verbose("Linked %s from %s", filename, path);
+    return 1;
+}
+
+int cutter_output_cache_fetch_at(CutterOutputCache *cache, int64_t ts_ms, const char *filename)
+{
+    return fetch(cache, KEY_REQUESTED, ts_ms, filename);
+}
+
+int cutter_output_cache_fetch(CutterOutputCache *cache, const CutterImage *image, const char *filename)
+{
+    if (image->requested_ms >= 0)
+        return fetch(cache, KEY_REQUESTED, image->requested_ms, filename);
+    return fetch(cache, KEY_FRAME, image->pts, filename);
+}
+
+int cutter_output_cache_store(CutterOutputCache *cache, const CutterImage *image, const char *filename)
+{
+    char path[4096];
+    int ret;
+
+    if (image->requested_ms >= 0)
+        object_path(cache, KEY_REQUESTED, image->requested_ms, path, sizeof(path));
+    else
+        object_path(cache, KEY_FRAME, image->pts, path, sizeof(path));
+
+    // The two-character shard directory
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+        ret = AVERROR(errno);
+        cutter_log_error("Failed to create the cache directory %s", path);
+        return ret;
+    }
+    *slash = '/';
+
+    ret = link_atomic(cache, filename, path);
+    if (ret < 0)
+        cutter_log_error("Failed to store %s into the cache: %s", filename, av_err2str(ret));
+    return ret;
+}
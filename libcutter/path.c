@@ -0,0 +1,377 @@
+/*
+ * Output file names
+ *
+ * A template such as "output/{stem}/frame-{n:06}-{w}x{h}.png" is parsed once
+ * into literal and field segments, then expanded for every output. With a
+ * fan-out the files are spread over sub-directories inserted before the file
+ * name, either numbered (fanout_size consecutive outputs per directory) or
+ * hashed from the file name (fanout_size directories), since lookups in a
+ * directory of a million entries get slow on ext4 and XFS.
+ *
+ * The directories are created on first use. The ones known to exist are kept
+ * in a hash set, so a frame costs no stat() nor mkdir() once its directory
+ * has been seen.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+enum SegmentType {
+    SEGMENT_TEXT,
+    SEGMENT_STEM,
+    SEGMENT_NUMBER,
+    SEGMENT_PTS,
+    SEGMENT_TS_MS,
+    SEGMENT_WIDTH,
+    SEGMENT_HEIGHT,
+};
+
+typedef struct Segment {
+    enum SegmentType type;
+    // Literal text of SEGMENT_TEXT
+    char *text;
+    // Minimum width of the numeric fields, padded with zeros or spaces
+    int width;
+    int zero_pad;
+} Segment;
+
+struct CutterPathTemplate {
+    Segment *segments;
+    int nb_segments;
+    char *stem;
+    CutterFanout fanout;
+    int fanout_size;
+    // Digits of the hashed directory names
+    int hash_digits;
+
+    // Open addressing set of the XXH64 of the existing directories, 0 marks a free slot
+    uint64_t *directories;
+    size_t directories_size;
+    size_t nb_directories;
+};
+
+static const struct {
+    const char *name;
+    enum SegmentType type;
+} fields[] = {
+    { "stem",  SEGMENT_STEM },
+    { "n",     SEGMENT_NUMBER },
+    { "pts",   SEGMENT_PTS },
+    { "ts_ms", SEGMENT_TS_MS },
+    { "w",     SEGMENT_WIDTH },
+    { "h",     SEGMENT_HEIGHT },
+};
+
+static int add_segment(CutterPathTemplate *tmpl, enum SegmentType type, const char *text, size_t length)
+{
+    Segment *tmp = realloc(tmpl->segments, (tmpl->nb_segments + 1) * sizeof(*tmp));
+    if (!tmp)
+        return AVERROR(ENOMEM);
+    tmpl->segments = tmp;
+
+    Segment *segment = &tmpl->segments[tmpl->nb_segments++];
+    memset(segment, 0, sizeof(*segment));
+    segment->type = type;
+    if (text && !(segment->text = strndup(text, length)))
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
+// Parse the field of "{name}" or "{name:06}" starting after the brace
+static int parse_field(CutterPathTemplate *tmpl, const char *field, size_t length)
+{
+    const char *colon = memchr(field, ':', length);
+    size_t name_length = colon ? (size_t) (colon - field) : length;
+
+    for (size_t i = 0; i < FF_ARRAY_ELEMS(fields); i++) {
+        if (strlen(fields[i].name) != name_length || strncmp(fields[i].name, field, name_length))
+            continue;
+
+        int ret = add_segment(tmpl, fields[i].type, NULL, 0);
+        if (ret < 0 || !colon)
+            return ret;
+
+        // Format of the numeric fields: [0]width
+        Segment *segment = &tmpl->segments[tmpl->nb_segments - 1];
+        const char *format = colon + 1, *end = field + length;
+        if (fields[i].type == SEGMENT_STEM || format == end)
+            break;
+        segment->zero_pad = *format == '0';
+        for (const char *p = format; p < end; p++) {
+            if (*p < '0' || *p > '9' || segment->width > 64)
+                goto invalid;
+            segment->width = segment->width * 10 + *p - '0';
+        }
+        return 0;
+    }
+
+invalid:
+    cutter_log_error("Invalid field {%.*s} in the output template", (int) length, field);
+    return AVERROR(EINVAL);
+}
+
+static char *input_stem(const char *input)
+{
+    const char *base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+
+    const char *dot = strrchr(base, '.');
+    return strndup(base, dot && dot != base ? (size_t) (dot - base) : strlen(base));
+}
+
+int cutter_path_template_parse(CutterPathTemplate **tmpl_out, const char *pattern, const char *input,
+                               CutterFanout fanout, int fanout_size)
+{
+    CutterPathTemplate *tmpl;
+    int ret = 0;
+
+    *tmpl_out = NULL;
+    if (fanout != CUTTER_FANOUT_NONE && fanout_size < 1)
+        return AVERROR(EINVAL);
+
+    tmpl = calloc(1, sizeof(*tmpl));
+    if (!tmpl)
+        return AVERROR(ENOMEM);
+    tmpl->fanout = fanout;
+    tmpl->fanout_size = fanout_size;
+    for (int buckets = fanout_size - 1; buckets > 0; buckets >>= 4)
+        tmpl->hash_digits++;
+    tmpl->hash_digits = FFMAX(tmpl->hash_digits, 1);
+
+    tmpl->stem = input_stem(input ? input : "");
+    if (!tmpl->stem) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    for (const char *p = pattern; *p && ret >= 0;) {
+        const char *brace = strchr(p, '{');
+
+        if (!brace) {
+            ret = add_segment(tmpl, SEGMENT_TEXT, p, strlen(p));
+            break;
+        }
+        if (brace > p)
+            ret = add_segment(tmpl, SEGMENT_TEXT, p, brace - p);
+
+        const char *close = strchr(brace, '}');
+        if (!close) {
+            cutter_log_error("Unterminated field in the output template %s", pattern);
+            ret = AVERROR(EINVAL);
+            break;
+        }
+        if (ret >= 0)
+            ret = parse_field(tmpl, brace + 1, close - brace - 1);
+        p = close + 1;
+    }
+    if (ret < 0)
+        goto fail;
+
+    *tmpl_out = tmpl;
+    return 0;
+
+fail:
+    cutter_path_template_free(&tmpl);
+    return ret;
+}
+
+void cutter_path_template_free(CutterPathTemplate **tmpl_ptr)
+{
+    CutterPathTemplate *tmpl = *tmpl_ptr;
+
+    if (!tmpl)
+        return;
+    for (int i = 0; i < tmpl->nb_segments; i++)
+        free(tmpl->segments[i].text);
+    free(tmpl->segments);
+    free(tmpl->stem);
+    free(tmpl->directories);
+    free(tmpl);
+    *tmpl_ptr = NULL;
+}
+
+int cutter_path_template_frame_dependent(const CutterPathTemplate *tmpl)
+{
+    for (int i = 0; i < tmpl->nb_segments; i++) {
+        if (tmpl->segments[i].type == SEGMENT_PTS || tmpl->segments[i].type == SEGMENT_TS_MS)
+            return 1;
+    }
+    return 0;
+}
+
+static int directory_known(const CutterPathTemplate *tmpl, uint64_t hash)
+{
+    if (!tmpl->directories_size)
+        return 0;
+    for (size_t i = hash & (tmpl->directories_size - 1);; i = (i + 1) & (tmpl->directories_size - 1)) {
+        if (tmpl->directories[i] == hash)
+            return 1;
+        if (!tmpl->directories[i])
+            return 0;
+    }
+}
+
+static int remember_directory(CutterPathTemplate *tmpl, uint64_t hash)
+{
+    // Kept at most half full
+    if (2 * (tmpl->nb_directories + 1) > tmpl->directories_size) {
+        size_t new_size = tmpl->directories_size ? tmpl->directories_size * 2 : 64;
+        uint64_t *table = calloc(new_size, sizeof(*table));
+        if (!table)
+            return AVERROR(ENOMEM);
+
+        for (size_t i = 0; i < tmpl->directories_size; i++) {
+            uint64_t h = tmpl->directories[i];
+            if (!h)
+                continue;
+            size_t j = h & (new_size - 1);
+            while (table[j])
+                j = (j + 1) & (new_size - 1);
+            table[j] = h;
+        }
+        free(tmpl->directories);
+        tmpl->directories = table;
+        tmpl->directories_size = new_size;
+    }
+
+    size_t i = hash & (tmpl->directories_size - 1);
+    while (tmpl->directories[i])
+        i = (i + 1) & (tmpl->directories_size - 1);
+    tmpl->directories[i] = hash;
+    tmpl->nb_directories++;
+    return 0;
+}
+
+int cutter_mkdirs(const char *path)
+{
+    char buffer[4096];
+    size_t length = strlen(path);
+
+    if (length >= sizeof(buffer))
+        return AVERROR(ENAMETOOLONG);
+    memcpy(buffer, path, length + 1);
+
+    // Create each missing component from the top, existing ones fail with EEXIST
+    for (char *p = buffer + 1; ; p++) {
+        if (*p != '/' && *p)
+            continue;
+        char c = *p;
+        *p = '\0';
+        if (mkdir(buffer, 0777) < 0 && errno != EEXIST) {
+            int ret = AVERROR(errno);
+            cutter_log_error("Failed to create the directory %s", buffer);
+            return ret;
+        }
+        *p = c;
+        if (!c)
+            break;
+    }
+    return 0;
+}
+
+int cutter_path_mkdir(CutterPathTemplate *tmpl, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash == path)
+        return 0;
+
+    uint64_t hash = cutter_xxh64(path, slash - path, 0);
+    // 0 marks the free slots of the set
+    hash += !hash;
+    if (directory_known(tmpl, hash))
+        return 0;
+
+    char *directory = strndup(path, slash - path);
+    if (!directory)
+        return AVERROR(ENOMEM);
+    int ret = cutter_mkdirs(directory);
+    free(directory);
+    if (ret < 0)
+        return ret;
+    return remember_directory(tmpl, hash);
+}
+
+static size_t append(char *path, size_t size, size_t length, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+static size_t append(char *path, size_t size, size_t length, const char *fmt, ...)
+{
+    va_list args;
+
+    if (length >= size)
+        return length;
+    va_start(args, fmt);
+    int written = vsnprintf(path + length, size - length, fmt, args);
+    va_end(args);
+    return written < 0 ? size : length + written;
+}
+
+int cutter_path_format(CutterPathTemplate *tmpl, int number, const CutterImage *image, char *path, size_t size)
+{
+    size_t length = 0;
+
+    for (int i = 0; i < tmpl->nb_segments; i++) {
+        const Segment *segment = &tmpl->segments[i];
+        int64_t value;
+
+        switch (segment->type) {
+        case SEGMENT_TEXT:
+            length = append(path, size, length, "%s", segment->text);
+            continue;
+        case SEGMENT_STEM:
+            length = append(path, size, length, "%s", tmpl->stem);
+            continue;
+        case SEGMENT_NUMBER:
+            value = number;
+            break;
+        case SEGMENT_PTS:
+            value = image->pts;
+            break;
+        case SEGMENT_TS_MS:
+            value = image->ts_ms;
+            break;
+        case SEGMENT_WIDTH:
+            value = image->width;
+            break;
+        default:
+            value = image->height;
+            break;
+        }
+        length = append(path, size, length, segment->zero_pad ? "%0*" PRId64 : "%*" PRId64, segment->width, value);
+    }
+
+    if (tmpl->fanout != CUTTER_FANOUT_NONE && length < size) {
+        // The sub-directory goes between the directory and the name of the file
+        char *slash = strrchr(path, '/');
+        char *name = slash ? slash + 1 : path;
+        char directory[32];
+
+        if (tmpl->fanout == CUTTER_FANOUT_NUMERIC)
+            snprintf(directory, sizeof(directory), "%03d", FFMAX(number - 1, 0) / tmpl->fanout_size);
+        else
+            snprintf(directory, sizeof(directory), "%0*" PRIx64, tmpl->hash_digits,
+                     cutter_xxh64(name, strlen(name), 0) % tmpl->fanout_size);
+
+        size_t dir_length = strlen(directory);
+        if (length + dir_length + 1 < size) {
+            memmove(name + dir_length + 1, name, strlen(name) + 1);
+            memcpy(name, directory, dir_length);
+            name[dir_length] = '/';
+            length += dir_length + 1;
+        } else {
+            length = size;
+        }
+    }
+
+    if (length >= size) {
+        cutter_log_error("Output file name too long");
+        return AVERROR(ENAMETOOLONG);
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * GOP-aware planner for many random timestamps
+ *
+ * The sorted targets are grouped by the keyframe interval (GOP) holding them.
+ * Between two groups the planner either keeps decoding through the gap or
+ * seeks to the next keyframe, whichever costs fewer decoded frames. Targets
+ * are always visited forward, so with an index no frame is ever decoded
+ * twice. Without one the keyframes are unknown and each target is sought on
+ * its own, the callers locate the keyframes first when there are several.
+ */
+
+#include <stdlib.h>
+
+#include "internal.h"
+
+// A seek flushes the decoder and moves the demuxer elsewhere in the file,
+// counted as the decoding of this many frames
+#define PLAN_SEEK_COST_FRAMES 8
+
+int cutter_plan_build(const CutterIndex *index, const int64_t *targets, size_t count,
+                      int64_t frame_duration, CutterPlanSegment **segments_out, size_t *nb_segments)
+{
+    CutterPlanSegment *segments = malloc(FFMAX(count, 1) * sizeof(*segments));
+    int64_t position = AV_NOPTS_VALUE;
+    size_t n = 0;
+
+    if (!segments)
+        return AVERROR(ENOMEM);
+
+    for (size_t i = 0; i < count;) {
+        const CutterIndexEntry *entry = index ? cutter_index_lookup(index, targets[i]) : NULL;
+        int64_t key, next_key;
+
+        if (entry) {
+            key = entry->pts;
+            next_key = entry + 1 < index->entries + index->count ? entry[1].pts : INT64_MAX;
+        } else if (index) {
+            // Before the first keyframe, decoded from the stream start
+            key = INT64_MIN;
+            next_key = index->count ? index->entries[0].pts : INT64_MAX;
+        } else {
+            // Without keyframe positions every distinct target is its own group,
+            // two of them in one GOP seek back to the same keyframe
+            key = targets[i];
+            next_key = targets[i] + 1;
+        }
+
+        size_t j = i + 1;
+        while (j < count && targets[j] < next_key)
+            j++;
+
+        int through = 0;
+        if (position != AV_NOPTS_VALUE) {
+            if (key <= position) {
+                // This GOP is already being decoded
+                through = 1;
+            } else {
+                double through_cost = (double) (targets[i] - position) / frame_duration;
+                double seek_cost = PLAN_SEEK_COST_FRAMES + (double) (targets[i] - key) / frame_duration;
+                through = through_cost <= seek_cost;
+            }
+        }
+
+        if (through) {
+            segments[n - 1].last = j;
+        } else {
+            segments[n].seek_pts = key == INT64_MIN ? AV_NOPTS_VALUE : key;
+            segments[n].first = i;
+            segments[n].last = j;
+            n++;
+        }
+
+        position = targets[j - 1];
+        i = j;
+    }
+
+    *segments_out = segments;
+    *nb_segments = n;
+    return 0;
+}
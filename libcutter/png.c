@@ -0,0 +1,262 @@
+/*
+ * PNG encoder of the converted RGB24 frames
+ *
+ * libpng writes through an output sink (see sink.c) instead of a FILE, so
+ * one encoder serves the files, the memory buffers kept by the frame cache
+ * and the async writer, and the members of a tar stream. The zlib level can
+ * be chosen per image, -1 keeps the libpng default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Required to create the PNG files
+#include <png.h>
+
+#include "internal.h"
+
+// Buffer of the file sinks, a PNG of a 1080p frame is a few MiB
+#define PNG_FILE_BUFFER (256 * 1024)
+
+static void sink_write(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    if (cutter_sink_write(png_get_io_ptr(png_ptr), data, length) < 0)
+        png_error(png_ptr, "write error");
+}
+
+// The sinks push their buffers out on their own
+static void sink_flush(png_structp png_ptr)
+{
+    (void) png_ptr;
+}
+
+// Encode a converted RGB24 frame into the sink,
+// level is the zlib compression level or -1 for the libpng default
+static int encode_png(const CutterImage *image, int level, CutterSink *sink)
+{
+    // Create the PNG write struct and info struct
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr) {
+        cutter_log_error("Failed to create PNG write struct");
+        return AVERROR(ENOMEM);
+    }
+
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+        cutter_log_error("Failed to create PNG info struct");
+        png_destroy_write_struct(&png_ptr, NULL);
+        return AVERROR(ENOMEM);
+    }
+
+    // Allocated before setjmp() so the error path can release it
+    png_bytep *row_pointers = (png_bytep *) malloc(sizeof(png_bytep) * image->height);
+    if (!row_pointers) {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        return AVERROR(ENOMEM);
+    }
+
+    // Set up error handling for libpng
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        cutter_log_error("Error writing PNG file");
+        free(row_pointers);
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        return AVERROR_EXTERNAL;
+    }
+
+    // Set the sink as the output for libpng
+    png_set_write_fn(png_ptr, sink, sink_write, sink_flush);
+    if (level >= 0)
+        png_set_compression_level(png_ptr, level);
+
+    // Set the PNG image attributes
+    png_set_IHDR(png_ptr, info_ptr, image->width, image->height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+    // Fill the row pointers with the frame data
+    for (int y = 0; y < image->height; y++) {
+        row_pointers[y] = (png_bytep) (image->data + (size_t) y * image->linesize);
+    }
+
+    // Write the PNG file
+    png_set_rows(png_ptr, info_ptr, row_pointers);
+    png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+
+    // Clean up
+    free(row_pointers);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return 0;
+}
+
+// Untimed, the callers of cutter_png_encode_buffer() account the encoding themselves
+static int encode_into(const CutterImage *image, const char *name, int level, CutterSink *sink)
+{
+    int ret = cutter_sink_begin(sink, name);
+    if (ret < 0)
+        return ret;
+
+    // A failed image is not ended, the next begin() drops what the sink buffered
+    ret = encode_png(image, level, sink);
+    if (ret < 0)
+        return ret;
+    return cutter_sink_end(sink);
+}
+
+int cutter_png_encode_buffer(const CutterImage *image, int level, uint8_t **data, size_t *size)
+{
+    CutterSink *sink = NULL;
+
+    int ret = cutter_sink_alloc_memory(&sink);
+    if (ret < 0)
+        return ret;
+
+    ret = encode_into(image, NULL, level, sink);
+    if (ret >= 0)
+        *data = cutter_sink_memory_detach(sink, size);
+    cutter_sink_close(&sink);
+    return ret;
+}
+
+// Cached encoding of the frame, encoded first if needed,
+// *encoded is then set and goes to the cache once written
+static int cached_encoding(const CutterImage *image, const uint8_t **data, size_t *size, uint8_t **encoded)
+{
+    *encoded = NULL;
+    if (cutter_cache_encoded(image->cache_entry, data, size))
+        return 0;
+
+    int64_t start = cutter_metrics_start();
+    int ret = cutter_png_encode_buffer(image, -1, encoded, size);
+    cutter_metrics_record(CUTTER_STAGE_ENCODE, start);
+    if (ret < 0)
+        return ret;
+    *data = *encoded;
+    return 0;
+}
+
+// Write the cached encoding of the frame into the sink
+static int sink_cached_png(const CutterImage *image, const char *name, CutterSink *sink)
+{
+    uint8_t *encoded;
+    const uint8_t *data;
+    size_t size;
+
+    int ret = cached_encoding(image, &data, &size, &encoded);
+    if (ret < 0)
+        return ret;
+
+    int64_t start = cutter_metrics_start();
+    ret = cutter_sink_begin(sink, name);
+    if (ret >= 0)
+        ret = cutter_sink_write(sink, data, size);
+    if (ret >= 0)
+        ret = cutter_sink_end(sink);
+    if (start)
+        cutter_metrics_add(CUTTER_STAGE_WRITE, cutter_time_ns() - start);
+
+    if (encoded)
+        cutter_cache_store_encoded(image->cache_entry, encoded, size);
+    return ret;
+}
+
+int cutter_encode_png(const CutterImage *image, const char *name, int level, CutterSink *sink)
+{
+    // The cache only keeps the encoding at the default level
+    if (image->cache_entry && level < 0)
+        return sink_cached_png(image, name, sink);
+
+    int ret = cutter_sink_begin(sink, name);
+    if (ret < 0)
+        return ret;
+
+    // The fd sinks may flush while encoding, their writes are not encoding time
+    int64_t write_ns = sink->write_ns;
+    int64_t start = cutter_metrics_start();
+    ret = encode_png(image, level, sink);
+    if (start) {
+        int64_t now = cutter_time_ns();
+        write_ns = sink->write_ns - write_ns;
+        cutter_metrics_add(CUTTER_STAGE_ENCODE, now - start - write_ns);
+        cutter_trace_span(CUTTER_STAGE_ENCODE, start, now);
+        start = now;
+    }
+
+    // A failed image is not ended, the next begin() drops what the sink buffered
+    if (ret < 0)
+        return ret;
+    ret = cutter_sink_end(sink);
+    // The tar and async sinks hand the image over in end()
+    if (start)
+        cutter_metrics_add(CUTTER_STAGE_WRITE, write_ns + cutter_time_ns() - start);
+    return ret;
+}
+
+// Write the cached encoding of the frame to a file
+static int save_cached_png(const CutterImage *image, const char *filename)
+{
+    uint8_t *encoded;
+    const uint8_t *data;
+    size_t size;
+
+    int ret = cached_encoding(image, &data, &size, &encoded);
+    if (ret < 0)
+        return ret;
+
+    // The sink traces its writes, only the total goes to the metrics
+    int64_t start = cutter_metrics_start();
+    CutterSink *sink = NULL;
+    ret = cutter_sink_open_file(&sink, filename, FFMIN(size, PNG_FILE_BUFFER) + 1);
+    if (ret >= 0) {
+        ret = cutter_sink_write(sink, data, size);
+        int closed = cutter_sink_close(&sink);
+        if (ret >= 0)
+            ret = closed;
+    }
+    if (start)
+        cutter_metrics_add(CUTTER_STAGE_WRITE, cutter_time_ns() - start);
+
+    // The next save of this frame skips the encoder
+    if (encoded)
+        cutter_cache_store_encoded(image->cache_entry, encoded, size);
+    return ret;
+}
+
+int cutter_png_save_level(const CutterImage *image, const char *filename, int level)
+{
+    CutterSink *sink = NULL;
+
+    // Open the PNG file for writing
+    int ret = cutter_sink_open_file(&sink, filename, PNG_FILE_BUFFER);
+    if (ret < 0)
+        return ret;
+
+    int64_t start = cutter_metrics_start();
+    ret = encode_png(image, level, sink);
+    if (start) {
+        int64_t now = cutter_time_ns();
+        cutter_metrics_add(CUTTER_STAGE_ENCODE, now - start - sink->write_ns);
+        // The timeline shows the writes nested in the encoding span
+        cutter_trace_span(CUTTER_STAGE_ENCODE, start, now);
+        start = now;
+    }
+
+    int64_t write_ns = sink->write_ns;
+    int closed = cutter_sink_close(&sink);
+    if (ret >= 0)
+        ret = closed;
+    if (start)
+        cutter_metrics_add(CUTTER_STAGE_WRITE, write_ns + cutter_time_ns() - start);
+
+    return ret;
+}
+
+// Function to save a converted RGB24 frame to a PNG file
+int cutter_save_png(const CutterImage *image, const char *filename)
+{
+    cutter_log_verbose("Creating PNG file -> %s", filename);
+
+    if (image->cache_entry)
+        return save_cached_png(image, filename);
+    return cutter_png_save_level(image, filename, -1);
+}
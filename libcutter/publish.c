@@ -0,0 +1,378 @@
+/*
+ * Atomic and durable publication of the output files
+ *
+ * Outputs are written under a temporary name next to their final one and
+ * renamed into place, so a reader never sees a partial file. The sync mode
+ * decides when the data reaches the disk:
+ *
+ *   none   the renames happen right away, the kernel writes back whenever
+ *   end    same, with one syncfs() and directory fsync() when closing
+ *   batch  the files wait under their temporary names; every batch_size
+ *          files one syncfs() makes their data durable, then they are
+ *          renamed and their directories fsync()ed
+ *
+ * In batch mode a file is only visible under its final name once its bytes
+ * are on disk, so a crash never leaves an empty or torn output behind, for
+ * the cost of one filesystem sync per batch instead of one fsync() per file.
+ * Outputs fanned out over several mounts get one syncfs() per filesystem.
+ *
+ * A killed run leaves its temporary files behind, cutter_publisher_remove_stale()
+ * deletes those of processes that are gone.
+ */
+
+// syncfs()
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+typedef struct PendingFile {
+    char *temp;
+    char *filename;
+} PendingFile;
+
+struct CutterPublisher {
+    CutterSyncMode mode;
+    int batch_size;
+    cutter_write_cb done;
+    void *opaque;
+    unsigned int temp_counter;
+
+    // Files of the batch, under their temporary names until it is synced
+    PendingFile *pending;
+    int nb_pending;
+
+    // Directories of the renamed files not fsync()ed yet, usually only one
+    char **directories;
+    int nb_directories;
+    int directories_allocated;
+
+    int first_error;
+};
+
+static char *directory_of(const char *filename)
+{
+    const char *slash = strrchr(filename, '/');
+
+    if (!slash)
+        return strdup(".");
+    if (slash == filename)
+        return strdup("/");
+    return strndup(filename, slash - filename);
+}
+
+static int add_directory(CutterPublisher *publisher, const char *filename)
+{
+    char *directory = directory_of(filename);
+    if (!directory)
+        return AVERROR(ENOMEM);
+
+    // Linear search, outputs go to a handful of directories
+    for (int i = publisher->nb_directories - 1; i >= 0; i--) {
+        if (!strcmp(publisher->directories[i], directory)) {
+            free(directory);
+            return 0;
+        }
+    }
+
+    if (publisher->nb_directories == publisher->directories_allocated) {
+        int new_size = publisher->directories_allocated ? publisher->directories_allocated * 2 : 8;
+        char **tmp = realloc(publisher->directories, new_size * sizeof(*tmp));
+        if (!tmp) {
+            free(directory);
+            return AVERROR(ENOMEM);
+        }
+        publisher->directories = tmp;
+        publisher->directories_allocated = new_size;
+    }
+    publisher->directories[publisher->nb_directories++] = directory;
+    return 0;
+}
+
+// fsync() a file or a directory, or syncfs() the filesystem holding it
+static int sync_path(const char *path, int whole_filesystem)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return AVERROR(errno);
+
+    int ret;
+#ifdef __linux__
+    ret = whole_filesystem ? syncfs(fd) : fsync(fd);
+#else
+    if (whole_filesystem)
+        sync();
+    ret = whole_filesystem ? 0 : fsync(fd);
+#endif
+    ret = ret < 0 ? AVERROR(errno) : 0;
+    close(fd);
+    return ret;
+}
+
+// syncfs() once per filesystem holding one of the paths, devices has room for
+// all of them. Without devices to tell the filesystems apart each path is
+// fsync()ed on its own.
+static int sync_filesystem_of(const char *path, dev_t *devices, int *nb_devices)
+{
+    struct stat st;
+
+    if (!devices || stat(path, &st) < 0)
+        return sync_path(path, 0);
+    for (int i = 0; i < *nb_devices; i++) {
+        if (devices[i] == st.st_dev)
+            return 0;
+    }
+    devices[(*nb_devices)++] = st.st_dev;
+    return sync_path(path, 1);
+}
+
+// fsync() and forget the directories of the renamed files
+static int sync_directories(CutterPublisher *publisher)
+{
+    int ret = 0;
+
+    for (int i = 0; i < publisher->nb_directories; i++) {
+        int synced = sync_path(publisher->directories[i], 0);
+        if (synced < 0 && ret >= 0) {
+            cutter_log_error("Failed to sync the directory %s", publisher->directories[i]);
+            ret = synced;
+        }
+        free(publisher->directories[i]);
+    }
+    publisher->nb_directories = 0;
+    return ret;
+}
+
+static int publish(CutterPublisher *publisher, const char *temp, const char *filename)
+{
+    int ret = 0;
+
+    if (rename(temp, filename) < 0) {
+        ret = AVERROR(errno);
+        cutter_log_error("Failed to rename %s to %s", temp, filename);
+        unlink(temp);
+    } else if (publisher->mode != CUTTER_SYNC_NONE) {
+        ret = add_directory(publisher, filename);
+    }
+
+    if (ret < 0 && !publisher->first_error)
+        publisher->first_error = ret;
+    if (publisher->done)
+        publisher->done(publisher->opaque, filename, ret);
+    return ret;
+}
+
+// Make the data of the batch durable, then publish it
+static int publish_batch(CutterPublisher *publisher)
+{
+    int ret = 0;
+
+    if (!publisher->nb_pending)
+        return 0;
+
+    // One sync covers the data of every file of the batch on the same filesystem
+    int64_t start = cutter_metrics_start();
+    dev_t *devices = malloc(publisher->nb_pending * sizeof(*devices));
+    int nb_devices = 0;
+    for (int i = 0; i < publisher->nb_pending && ret >= 0; i++)
+        ret = sync_filesystem_of(publisher->pending[i].temp, devices, &nb_devices);
+    free(devices);
+    if (ret < 0)
+        cutter_log_error("Failed to sync the outputs: %s", av_err2str(ret));
+
+    for (int i = 0; i < publisher->nb_pending; i++) {
+        PendingFile *file = &publisher->pending[i];
+
+        // Unsynced data is never published
+        if (ret < 0) {
+            unlink(file->temp);
+            if (publisher->done)
+                publisher->done(publisher->opaque, file->filename, ret);
+        } else {
+            publish(publisher, file->temp, file->filename);
+        }
+        free(file->temp);
+        free(file->filename);
+    }
+    cutter_log_verbose("Synced a batch of %d outputs", publisher->nb_pending);
+    publisher->nb_pending = 0;
+
+    int synced = sync_directories(publisher);
+    if (ret >= 0)
+        ret = synced;
+    cutter_metrics_record(CUTTER_STAGE_WRITE, start);
+
+    if (ret < 0 && !publisher->first_error)
+        publisher->first_error = ret;
+    return ret;
+}
+
+int cutter_publisher_open(CutterPublisher **publisher_out, CutterSyncMode mode, int batch_size,
+                          cutter_write_cb done, void *opaque)
+{
+    CutterPublisher *publisher;
+
+    *publisher_out = NULL;
+    if (mode == CUTTER_SYNC_BATCH && batch_size < 1)
+        return AVERROR(EINVAL);
+
+    publisher = calloc(1, sizeof(*publisher));
+    if (!publisher)
+        return AVERROR(ENOMEM);
+    publisher->mode = mode;
+    publisher->batch_size = batch_size;
+    publisher->done = done;
+    publisher->opaque = opaque;
+
+    if (mode == CUTTER_SYNC_BATCH) {
+        publisher->pending = calloc(batch_size, sizeof(*publisher->pending));
+        if (!publisher->pending) {
+            free(publisher);
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    *publisher_out = publisher;
+    return 0;
+}
+
+int cutter_publisher_temp_name(CutterPublisher *publisher, const char *filename, char *temp, size_t size)
+{
+    // Same directory so the rename stays atomic, and no .png extension for the globs
+    int length = snprintf(temp, size, "%s.%d.%u.tmp", filename, (int) getpid(), publisher->temp_counter++);
+
+    return length < 0 || (size_t) length >= size ? AVERROR(ENAMETOOLONG) : 0;
+}
+
+// Process id of a name made by cutter_publisher_temp_name(), 0 for any other name
+static pid_t temp_owner(const char *name)
+{
+    size_t length = strlen(name);
+    const char *p = name + length - 4;
+    int dots = 0;
+
+    if (length < 8 || strcmp(p, ".tmp"))
+        return 0;
+    // Back over <counter> then <pid>, each a run of digits after a dot
+    while (dots < 2) {
+        const char *digits = p;
+        while (p > name && p[-1] >= '0' && p[-1] <= '9')
+            p--;
+        if (p == digits || p == name || p[-1] != '.')
+            return 0;
+        p--;
+        dots++;
+    }
+    // p is on the dot before the pid, a final name must precede it
+    return p > name ? (pid_t) atol(p + 1) : 0;
+}
+
+int cutter_publisher_remove_stale(const char *directory, int depth)
+{
+    char path[4096];
+    struct dirent *entry;
+    int removed = 0;
+
+    DIR *dir = opendir(directory);
+    if (!dir)
+        return errno == ENOENT ? 0 : AVERROR(errno);
+
+    while ((entry = readdir(dir))) {
+        struct stat st;
+
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        int length = snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        if (length < 0 || (size_t) length >= sizeof(path) || lstat(path, &st) < 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            int ret = depth > 0 ? cutter_publisher_remove_stale(path, depth - 1) : 0;
+            if (ret > 0)
+                removed += ret;
+            continue;
+        }
+
+        // The temporary files of a live process, another shard maybe, are still being written
+        pid_t owner = S_ISREG(st.st_mode) ? temp_owner(entry->d_name) : 0;
+        if (owner <= 0 || owner == getpid() || kill(owner, 0) == 0 || errno != ESRCH)
+            continue;
+        if (unlink(path) == 0) {
+            cutter_log_verbose("Removed the stale temporary file %s", path);
+            removed++;
+        }
+    }
+
+    closedir(dir);
+    return removed;
+}
+
+int cutter_publisher_commit(CutterPublisher *publisher, const char *temp, const char *filename)
+{
+    if (publisher->mode != CUTTER_SYNC_BATCH)
+        return publish(publisher, temp, filename);
+
+    PendingFile *file = &publisher->pending[publisher->nb_pending];
+    file->temp = strdup(temp);
+    file->filename = strdup(filename);
+    if (!file->temp || !file->filename) {
+        free(file->temp);
+        free(file->filename);
+        return AVERROR(ENOMEM);
+    }
+
+    if (++publisher->nb_pending == publisher->batch_size)
+        return publish_batch(publisher);
+    return 0;
+}
+
+int cutter_publisher_sync(CutterPublisher *publisher)
+{
+    if (publisher->mode == CUTTER_SYNC_BATCH)
+        return publish_batch(publisher);
+    if (publisher->mode != CUTTER_SYNC_END || !publisher->nb_directories)
+        return 0;
+
+    int64_t start = cutter_metrics_start();
+    dev_t *devices = malloc(publisher->nb_directories * sizeof(*devices));
+    int nb_devices = 0, ret = 0;
+    for (int i = 0; i < publisher->nb_directories && ret >= 0; i++)
+        ret = sync_filesystem_of(publisher->directories[i], devices, &nb_devices);
+    free(devices);
+    if (ret < 0)
+        cutter_log_error("Failed to sync the outputs: %s", av_err2str(ret));
+    int synced = sync_directories(publisher);
+    if (ret >= 0)
+        ret = synced;
+    cutter_metrics_record(CUTTER_STAGE_WRITE, start);
+
+    if (ret < 0 && !publisher->first_error)
+        publisher->first_error = ret;
+    return ret;
+}
+
+int cutter_publisher_close(CutterPublisher **publisher_ptr)
+{
+    CutterPublisher *publisher = *publisher_ptr;
+
+    if (!publisher)
+        return 0;
+
+    cutter_publisher_sync(publisher);
+    int ret = publisher->first_error;
+
+    free(publisher->directories);
+    free(publisher->pending);
+    free(publisher);
+    *publisher_ptr = NULL;
+    return ret;
+}
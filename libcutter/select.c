@@ -0,0 +1,204 @@
+/*
+ * Frame selection engine
+ *
+ * Decides which decoded frames are worth converting and encoding.
+ * Every configured criterion must accept a frame for it to be selected.
+ * Time based criteria (ranges, fps) can also predict the next timestamp
+ * that may be selected, which lets the extractor skip whole GOPs.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "internal.h"
+
+typedef struct CutterRange {
+    int64_t start_ms;
+    int64_t end_ms;
+} CutterRange;
+
+struct CutterSelection {
+    // Keep one frame out of every, 0 or 1 keeps them all
+    int every;
+    // Output rate of the PTS resampling, 0 disables it
+    double fps;
+    // Sorted by start_ms, may overlap
+    CutterRange *ranges;
+    int nb_ranges;
+    // Sorted display-order frame numbers
+    int64_t *frames;
+    size_t nb_frames;
+
+    // Per request state, see cutter_selection_reset()
+    int64_t frame_index;
+    int64_t every_index;
+    int64_t next_slot;
+    size_t frame_cursor;
+};
+
+int cutter_selection_alloc(CutterSelection **selection)
+{
+    *selection = calloc(1, sizeof(**selection));
+    return *selection ? 0 : AVERROR(ENOMEM);
+}
+
+void cutter_selection_free(CutterSelection **selection)
+{
+    if (!*selection)
+        return;
+    free((*selection)->ranges);
+    free((*selection)->frames);
+    free(*selection);
+    *selection = NULL;
+}
+
+int cutter_selection_set_every(CutterSelection *selection, int n)
+{
+    if (n < 1)
+        return AVERROR(EINVAL);
+    selection->every = n;
+    return 0;
+}
+
+int cutter_selection_set_fps(CutterSelection *selection, double fps)
+{
+    if (!(fps > 0))
+        return AVERROR(EINVAL);
+    selection->fps = fps;
+    return 0;
+}
+
+int cutter_selection_add_range(CutterSelection *selection, int64_t start_ms, int64_t end_ms)
+{
+    if (start_ms < 0 || end_ms < start_ms)
+        return AVERROR(EINVAL);
+
+    CutterRange *ranges = realloc(selection->ranges, (selection->nb_ranges + 1) * sizeof(*ranges));
+    if (!ranges)
+        return AVERROR(ENOMEM);
+    selection->ranges = ranges;
+
+    // Insertion keeps the ranges sorted by their start
+    int i = selection->nb_ranges++;
+    while (i > 0 && ranges[i - 1].start_ms > start_ms) {
+        ranges[i] = ranges[i - 1];
+        i--;
+    }
+    ranges[i].start_ms = start_ms;
+    ranges[i].end_ms = end_ms;
+    return 0;
+}
+
+static int compare_frames(const void *a, const void *b)
+{
+    int64_t fa = *(const int64_t *) a, fb = *(const int64_t *) b;
+
+    return (fa > fb) - (fa < fb);
+}
+
+int cutter_selection_add_frames(CutterSelection *selection, const int64_t *frames, size_t count)
+{
+    int64_t *list = realloc(selection->frames, (selection->nb_frames + count) * sizeof(*list));
+    if (!list)
+        return AVERROR(ENOMEM);
+
+    memcpy(list + selection->nb_frames, frames, count * sizeof(*list));
+    selection->frames = list;
+    selection->nb_frames += count;
+    qsort(list, selection->nb_frames, sizeof(*list), compare_frames);
+    return 0;
+}
+
+void cutter_selection_reset(CutterSelection *selection)
+{
+    selection->frame_index = 0;
+    selection->every_index = 0;
+    selection->next_slot = 0;
+    selection->frame_cursor = 0;
+}
+
+void cutter_selection_seek(CutterSelection *selection, int64_t frame_index, int64_t ts_ms)
+{
+    cutter_selection_reset(selection);
+    selection->frame_index = frame_index;
+    // Without ranges every frame is counted
+    selection->every_index = frame_index;
+    // The first frame is treated as taking its slot, the following ones then
+    // fall in the same slots as when decoding from the start
+    if (selection->fps > 0 && ts_ms >= 0)
+        selection->next_slot = (int64_t) floor(ts_ms * selection->fps / 1000.0) + 1;
+}
+
+int cutter_selection_seekable(const CutterSelection *selection)
+{
+    return !(selection->every > 1 && selection->nb_ranges);
+}
+
+int cutter_selection_frame_based(const CutterSelection *selection)
+{
+    return selection->every > 1 || selection->nb_frames;
+}
+
+static int64_t slot_ms(const CutterSelection *selection, int64_t slot)
+{
+    return (int64_t) ceil(slot * 1000.0 / selection->fps);
+}
+
+int64_t cutter_selection_next_ms(const CutterSelection *selection, int64_t ts_ms)
+{
+    if (selection->nb_frames && selection->frame_cursor == selection->nb_frames)
+        return -1;
+
+    // Alternate between both time criteria until they agree on a timestamp
+    for (int r = 0;;) {
+        if (selection->fps > 0)
+            ts_ms = FFMAX(ts_ms, slot_ms(selection, selection->next_slot));
+        if (!selection->nb_ranges)
+            return ts_ms;
+
+        while (r < selection->nb_ranges && selection->ranges[r].end_ms < ts_ms)
+            r++;
+        if (r == selection->nb_ranges)
+            return -1;
+        if (ts_ms >= selection->ranges[r].start_ms)
+            return ts_ms;
+        ts_ms = selection->ranges[r].start_ms;
+    }
+}
+
+int cutter_selection_match(CutterSelection *selection, int64_t ts_ms)
+{
+    int64_t index = selection->frame_index++;
+
+    if (selection->nb_ranges) {
+        int inside = 0;
+        for (int r = 0; r < selection->nb_ranges && selection->ranges[r].start_ms <= ts_ms; r++) {
+            if (ts_ms <= selection->ranges[r].end_ms) {
+                inside = 1;
+                break;
+            }
+        }
+        if (!inside)
+            return 0;
+    }
+
+    if (selection->nb_frames) {
+        while (selection->frame_cursor < selection->nb_frames && selection->frames[selection->frame_cursor] < index)
+            selection->frame_cursor++;
+        if (selection->frame_cursor == selection->nb_frames || selection->frames[selection->frame_cursor] != index)
+            return 0;
+    }
+
+    // Counted among the frames that passed the ranges
+    if (selection->every > 1 && selection->every_index++ % selection->every)
+        return 0;
+
+    if (selection->fps > 0 && ts_ms >= 0) {
+        if (ts_ms < slot_ms(selection, selection->next_slot))
+            return 0;
+        selection->next_slot = (int64_t) floor(ts_ms * selection->fps / 1000.0) + 1;
+    }
+
+    return 1;
+}
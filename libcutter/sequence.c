@@ -0,0 +1,441 @@
+/*
+ * Frame sequences (.cutseq)
+ *
+ * Full resolution RGB24 frames stored losslessly in one file for repeated
+ * reads. The layout is a fixed header, the compressed frames, then an index
+ * of one entry per frame, in host byte order like the keyframe index:
+ *
+ *   header | frame 0 | frame 1 | ... | entry 0 | entry 1 | ...
+ *
+ * Every keyframe_interval frames a keyframe holds the packed rows. The frames
+ * in between hold the XOR with the previous frame, mostly zeros where the
+ * picture did not change. Both are LZ4 blocks, which decompress at several
+ * GB/s, far from the cost of inflating a PNG.
+ *
+ * Readers map the file and go through the index: a frame is decoded from the
+ * last keyframe before it, or from the frame read last when it is on the way,
+ * so sequential reads decode each frame once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "internal.h"
+
+#define CUTSEQ_MAGIC "CUTSEQ\0\0"
+#define CUTSEQ_VERSION 1
+
+// Entry of a frame holding the packed rows, the others are XOR deltas
+#define SEQUENCE_KEY 1
+
+typedef struct SequenceHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t keyframe_interval;
+    uint64_t count;
+    // Offset of the count entries, after the frames
+    uint64_t index_offset;
+} SequenceHeader;
+
+typedef struct SequenceEntry {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t flags;
+    int64_t pts;
+    int64_t ts_ms;
+} SequenceEntry;
+
+struct CutterSequenceWriter {
+    FILE *fp;
+    char *path;
+    char *tmp_path;
+    SequenceHeader header;
+    size_t row_size;
+
+    // Packed rows of the last frame, and the XOR of the next one against them
+    uint8_t *previous;
+    uint8_t *delta;
+    uint8_t *compressed;
+
+    SequenceEntry *entries;
+    size_t allocated;
+    uint64_t offset;
+    int error;
+};
+
+struct CutterSequence {
+    uint8_t *map;
+    size_t map_size;
+    const SequenceHeader *header;
+    const SequenceEntry *entries;
+    size_t row_size;
+    size_t frame_size;
+
+    // Last frame decoded, -1 if none
+    uint8_t *frame;
+    uint8_t *scratch;
+    int64_t current;
+};
+
+// dst = a ^ b
+static void xor_bytes(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t size)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= size; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(va, vb));
+    }
+#endif
+    for (; i < size; i++)
+        dst[i] = a[i] ^ b[i];
+}
+
+int cutter_sequence_writer_open(CutterSequenceWriter **writer_out, const char *filename, int keyframe_interval)
+{
+    CutterSequenceWriter *writer;
+    int ret;
+
+    *writer_out = NULL;
+    if (keyframe_interval < 1)
+        return AVERROR(EINVAL);
+
+    writer = calloc(1, sizeof(*writer));
+    if (!writer)
+        return AVERROR(ENOMEM);
+    memcpy(writer->header.magic, CUTSEQ_MAGIC, sizeof(writer->header.magic));
+    writer->header.version = CUTSEQ_VERSION;
+    writer->header.keyframe_interval = keyframe_interval;
+
+    writer->path = strdup(filename);
+    writer->tmp_path = malloc(strlen(filename) + sizeof(".tmp"));
+    if (!writer->path || !writer->tmp_path) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    sprintf(writer->tmp_path, "%s.tmp", filename);
+
+    // Written aside and renamed, readers never map a sequence without its index.
+    // The header is rewritten once the frames are counted.
+    writer->fp = fopen(writer->tmp_path, "wb");
+    if (!writer->fp) {
+        ret = AVERROR(errno);
+        cutter_log_error("Failed to open file '%s'", writer->tmp_path);
+        goto fail;
+    }
+    if (fwrite(&writer->header, sizeof(writer->header), 1, writer->fp) != 1) {
+        ret = AVERROR(EIO);
+        goto fail;
+    }
+    writer->offset = sizeof(writer->header);
+
+    *writer_out = writer;
+    return 0;
+
+fail:
+    if (writer->fp) {
+        fclose(writer->fp);
+        unlink(writer->tmp_path);
+    }
+    free(writer->tmp_path);
+    free(writer->path);
+    free(writer);
+    return ret;
+}
+
+static int write_frame(CutterSequenceWriter *writer, const CutterImage *image)
+{
+    SequenceHeader *header = &writer->header;
+    int key = header->count % header->keyframe_interval == 0;
+    size_t frame_size = writer->row_size * header->height;
+
+    if (!writer->previous) {
+        writer->previous = av_malloc(frame_size);
+        writer->delta = av_malloc(frame_size);
+        writer->compressed = av_malloc(cutter_lz_bound(frame_size));
+        if (!writer->previous || !writer->delta || !writer->compressed)
+            return AVERROR(ENOMEM);
+    }
+
+    if (header->count == writer->allocated) {
+        size_t new_size = writer->allocated ? writer->allocated * 2 : 256;
+        SequenceEntry *tmp = realloc(writer->entries, new_size * sizeof(*tmp));
+        if (!tmp)
+            return AVERROR(ENOMEM);
+        writer->entries = tmp;
+        writer->allocated = new_size;
+    }
+
+    // The rows are packed, and XORed on the way for a delta
+    int64_t start = cutter_metrics_start();
+    for (int y = 0; y < header->height; y++) {
+        const uint8_t *row = image->data + (size_t) y * image->linesize;
+        uint8_t *previous = writer->previous + y * writer->row_size;
+        if (!key)
+            xor_bytes(writer->delta + y * writer->row_size, row, previous, writer->row_size);
+        memcpy(previous, row, writer->row_size);
+    }
+    size_t size = cutter_lz_compress(key ? writer->previous : writer->delta, frame_size, writer->compressed);
+    cutter_metrics_record(CUTTER_STAGE_ENCODE, start);
+
+    start = cutter_metrics_start();
+    if (fwrite(writer->compressed, 1, size, writer->fp) != size)
+        return AVERROR(EIO);
+    cutter_metrics_record(CUTTER_STAGE_WRITE, start);
+    cutter_metrics_add_bytes(size);
+
+    SequenceEntry *entry = &writer->entries[header->count++];
+    entry->offset = writer->offset;
+    entry->size = size;
+    entry->flags = key ? SEQUENCE_KEY : 0;
+    entry->pts = image->pts;
+    entry->ts_ms = image->ts_ms;
+    writer->offset += size;
+
+    cutter_log_debug("Sequence frame %" PRIu64 ": %s, %zu bytes", header->count, key ? "key" : "delta", size);
+    return 0;
+}
+
+int cutter_sequence_write(CutterSequenceWriter *writer, const CutterImage *image)
+{
+    SequenceHeader *header = &writer->header;
+    int ret;
+
+    if (writer->error)
+        return writer->error;
+
+    if (!header->count) {
+        header->width = image->width;
+        header->height = image->height;
+        writer->row_size = (size_t) image->width * 3;
+    } else if (image->width != header->width || image->height != header->height) {
+        cutter_log_error("The frames of a sequence must keep the size of the first one");
+        return AVERROR(EINVAL);
+    }
+
+    // A failed frame leaves the next deltas without their reference, nothing more is written
+    ret = write_frame(writer, image);
+    if (ret < 0)
+        writer->error = ret;
+    return ret;
+}
+
+int cutter_sequence_writer_close(CutterSequenceWriter **writer_ptr)
+{
+    CutterSequenceWriter *writer = *writer_ptr;
+    int ret;
+
+    if (!writer)
+        return 0;
+
+    // The entries are read in place from the mapping, aligned
+    static const uint8_t padding[8];
+    size_t padding_size = FFALIGN(writer->offset, 8) - writer->offset;
+    writer->header.index_offset = writer->offset + padding_size;
+
+    ret = writer->error;
+    if (ret >= 0 && (fwrite(padding, 1, padding_size, writer->fp) != padding_size ||
+                     (writer->header.count &&
+                      fwrite(writer->entries, sizeof(*writer->entries), writer->header.count, writer->fp) !=
+                          writer->header.count) ||
+                     fseek(writer->fp, 0, SEEK_SET) < 0 ||
+                     fwrite(&writer->header, sizeof(writer->header), 1, writer->fp) != 1))
+        ret = AVERROR(EIO);
+
+    if (fclose(writer->fp) && ret >= 0)
+        ret = AVERROR(errno);
+    if (ret >= 0 && rename(writer->tmp_path, writer->path) < 0)
+        ret = AVERROR(errno);
+    if (ret < 0) {
+        cutter_log_error("Failed to write the sequence %s", writer->path);
+        unlink(writer->tmp_path);
+    } else {
+        cutter_log("*** %" PRIu64 " frames written to %s, %.1f%% of their raw size", writer->header.count,
+                   writer->path, writer->header.count ? 100.0 * writer->offset /
+                   (writer->header.count * writer->row_size * writer->header.height) : 0.0);
+    }
+
+    av_free(writer->previous);
+    av_free(writer->delta);
+    av_free(writer->compressed);
+    free(writer->entries);
+    free(writer->tmp_path);
+    free(writer->path);
+    free(writer);
+    *writer_ptr = NULL;
+    return ret;
+}
+
+int cutter_sequence_open(CutterSequence **seq_out, const char *filename)
+{
+    CutterSequence *seq;
+    struct stat st;
+    int ret;
+
+    *seq_out = NULL;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return AVERROR(errno);
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(SequenceHeader)) {
+        close(fd);
+        return AVERROR_INVALIDDATA;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return AVERROR(errno);
+
+    const SequenceHeader *header = map;
+    ret = AVERROR_INVALIDDATA;
+    if (memcmp(header->magic, CUTSEQ_MAGIC, sizeof(header->magic)) || header->version != CUTSEQ_VERSION) {
+        cutter_log_error("%s is not a frame sequence", filename);
+        goto fail;
+    }
+    if (header->index_offset < sizeof(*header) || header->index_offset > (uint64_t) st.st_size ||
+        header->index_offset % 8 ||
+        header->count > (st.st_size - header->index_offset) / sizeof(SequenceEntry) ||
+        header->width < 0 || header->height < 0 || (header->count && (!header->width || !header->height))) {
+        cutter_log_error("%s is truncated", filename);
+        goto fail;
+    }
+
+    seq = calloc(1, sizeof(*seq));
+    if (!seq) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    seq->map = map;
+    seq->map_size = st.st_size;
+    seq->header = header;
+    seq->entries = (const SequenceEntry *) ((const uint8_t *) map + header->index_offset);
+    seq->row_size = (size_t) header->width * 3;
+    seq->frame_size = seq->row_size * header->height;
+    seq->current = -1;
+
+    if (header->count) {
+        seq->frame = av_malloc(seq->frame_size);
+        seq->scratch = av_malloc(seq->frame_size);
+        if (!seq->frame || !seq->scratch) {
+            cutter_sequence_close(&seq);
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    *seq_out = seq;
+    return 0;
+
+fail:
+    munmap(map, st.st_size);
+    return ret;
+}
+
+void cutter_sequence_close(CutterSequence **seq)
+{
+    if (!*seq)
+        return;
+    munmap((*seq)->map, (*seq)->map_size);
+    av_free((*seq)->frame);
+    av_free((*seq)->scratch);
+    free(*seq);
+    *seq = NULL;
+}
+
+void cutter_sequence_info(const CutterSequence *seq, CutterSequenceInfo *info)
+{
+    info->width = seq->header->width;
+    info->height = seq->header->height;
+    info->count = seq->header->count;
+    info->keyframe_interval = seq->header->keyframe_interval;
+}
+
+// Decode frame n over frame n - 1 in seq->frame, or from scratch for a keyframe
+static int decode_frame(CutterSequence *seq, uint64_t n)
+{
+    const SequenceEntry *entry = &seq->entries[n];
+    int key = entry->flags & SEQUENCE_KEY;
+    int ret;
+
+    if (entry->offset < sizeof(*seq->header) || entry->offset > seq->header->index_offset ||
+        entry->size > seq->header->index_offset - entry->offset)
+        return AVERROR_INVALIDDATA;
+
+    int64_t start = cutter_metrics_start();
+    ret = cutter_lz_decompress(seq->map + entry->offset, entry->size, key ? seq->frame : seq->scratch,
+                               seq->frame_size);
+    if (ret >= 0 && !key)
+        xor_bytes(seq->frame, seq->frame, seq->scratch, seq->frame_size);
+    cutter_metrics_record(CUTTER_STAGE_DECODE, start);
+    return ret;
+}
+
+int cutter_sequence_read(CutterSequence *seq, uint64_t n, CutterImage *image)
+{
+    uint64_t key, first;
+    int ret;
+
+    if (n >= seq->header->count)
+        return AVERROR(EINVAL);
+
+    if (seq->current != (int64_t) n) {
+        for (key = n; !(seq->entries[key].flags & SEQUENCE_KEY); key--) {
+            if (!key)
+                return AVERROR_INVALIDDATA;
+        }
+
+        // Carry on from the last frame read when it is between the keyframe and n
+        first = seq->current >= (int64_t) key && seq->current < (int64_t) n ? (uint64_t) seq->current + 1 : key;
+        seq->current = -1;
+        for (uint64_t i = first; i <= n; i++) {
+            ret = decode_frame(seq, i);
+            if (ret < 0) {
+                cutter_log_error("Frame %" PRIu64 " of the sequence is corrupted", i);
+                return ret;
+            }
+        }
+        seq->current = n;
+    }
+
+    memset(image, 0, sizeof(*image));
+    image->data = seq->frame;
+    image->linesize = seq->row_size;
+    image->width = seq->header->width;
+    image->height = seq->header->height;
+    image->pts = seq->entries[n].pts;
+    image->ts_ms = seq->entries[n].ts_ms;
+    image->requested_ms = -1;
+    image->frame_index = n;
+    image->frame_number = n + 1;
+    image->key_frame = seq->entries[n].flags & SEQUENCE_KEY;
+    return 0;
+}
+
+uint64_t cutter_sequence_find(const CutterSequence *seq, int64_t ts_ms)
+{
+    uint64_t low = 0, high = seq->header->count;
+
+    // First frame displayed at or after ts_ms, the frames are in display order
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (seq->entries[middle].ts_ms < ts_ms)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
@@ -0,0 +1,377 @@
+/*
+ * Output sinks of the encoded images
+ *
+ * A sink receives each image as begin(name), any number of write() and
+ * end(). The built-in ones keep the bytes in memory, write them through a
+ * large buffer to a file descriptor (a file, a pipe or a socket), or wrap
+ * each image as a member of a tar stream written to another sink. The
+ * async sink creates one file per image in the background.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+#define SINK_DEFAULT_BUFFER (1 << 20)
+
+#define TAR_BLOCK 512
+
+static int sink_reserve(CutterSink *sink, size_t size)
+{
+    if (sink->size + size <= sink->allocated)
+        return 0;
+
+    size_t new_size = FFMAX(sink->allocated * 2, sink->size + size);
+    uint8_t *tmp = realloc(sink->data, new_size);
+    if (!tmp)
+        return AVERROR(ENOMEM);
+    sink->data = tmp;
+    sink->allocated = new_size;
+    return 0;
+}
+
+// Memory: only the image being written is kept, from its begin()
+
+static int memory_begin(void *opaque, const char *name)
+{
+    CutterSink *sink = opaque;
+
+    (void) name;
+    sink->size = 0;
+    return 0;
+}
+
+static int memory_write(void *opaque, const uint8_t *data, size_t size)
+{
+    CutterSink *sink = opaque;
+
+    int ret = sink_reserve(sink, size);
+    if (ret < 0)
+        return ret;
+    memcpy(sink->data + sink->size, data, size);
+    sink->size += size;
+    return 0;
+}
+
+// File descriptor: images are concatenated, writes go out in buffer_size chunks
+
+static int fd_flush(CutterSink *sink)
+{
+    int64_t start = cutter_metrics_start();
+    size_t done = 0;
+
+    while (done < sink->buffered) {
+        ssize_t written = write(sink->fd, sink->buffer + done, sink->buffered - done);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        // Pipes and sockets may take part of the buffer
+        done += written;
+    }
+    cutter_metrics_add_bytes(done);
+    sink->buffered = 0;
+
+    if (start) {
+        int64_t now = cutter_time_ns();
+        sink->write_ns += now - start;
+        cutter_trace_span(CUTTER_STAGE_WRITE, start, now);
+    }
+    return 0;
+}
+
+static int fd_write(void *opaque, const uint8_t *data, size_t size)
+{
+    CutterSink *sink = opaque;
+
+    while (size) {
+        size_t length = FFMIN(size, sink->buffer_size - sink->buffered);
+
+        memcpy(sink->buffer + sink->buffered, data, length);
+        sink->buffered += length;
+        data += length;
+        size -= length;
+        if (sink->buffered == sink->buffer_size) {
+            int ret = fd_flush(sink);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+// Tar: the member size goes in its header, so the image is buffered until end()
+
+static int tar_begin(void *opaque, const char *name)
+{
+    CutterSink *sink = opaque;
+    size_t length = strlen(name);
+
+    // Longer names are split at a '/' between the ustar prefix and name fields
+    const char *split = length < sizeof(sink->name) ? NULL : strchr(name + length - sizeof(sink->name) + 1, '/');
+    if (length >= sizeof(sink->name) && (!split || split - name >= 155)) {
+        cutter_log_error("%s is too long for a tar member name", name);
+        return AVERROR(ENAMETOOLONG);
+    }
+
+    if (split) {
+        snprintf(sink->prefix, sizeof(sink->prefix), "%.*s", (int) (split - name), name);
+        snprintf(sink->name, sizeof(sink->name), "%s", split + 1);
+    } else {
+        sink->prefix[0] = '\0';
+        snprintf(sink->name, sizeof(sink->name), "%s", name);
+    }
+    sink->size = 0;
+    return 0;
+}
+
+static int tar_end(void *opaque)
+{
+    CutterSink *sink = opaque;
+    uint8_t header[TAR_BLOCK];
+    unsigned int checksum = 0;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, sink->name, strlen(sink->name));
+    snprintf((char *) header + 100, 8, "%07o", 0644);
+    snprintf((char *) header + 108, 8, "%07o", 0);
+    snprintf((char *) header + 116, 8, "%07o", 0);
+    snprintf((char *) header + 124, 12, "%011llo", (unsigned long long) sink->size);
+    snprintf((char *) header + 136, 12, "%011llo", (unsigned long long) time(NULL));
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    memcpy(header + 345, sink->prefix, strlen(sink->prefix));
+
+    // Computed with the checksum field itself filled with spaces
+    memset(header + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++)
+        checksum += header[i];
+    snprintf((char *) header + 148, 8, "%06o", checksum);
+
+    static const uint8_t padding[TAR_BLOCK];
+    int ret = cutter_sink_write(sink->output, header, sizeof(header));
+    if (ret >= 0)
+        ret = cutter_sink_write(sink->output, sink->data, sink->size);
+    if (ret >= 0 && sink->size % TAR_BLOCK)
+        ret = cutter_sink_write(sink->output, padding, TAR_BLOCK - sink->size % TAR_BLOCK);
+    return ret;
+}
+
+// Async: the image is buffered and handed to the writer as a whole file by end()
+
+static int async_begin(void *opaque, const char *name)
+{
+    CutterSink *sink = opaque;
+
+    free(sink->path);
+    sink->path = strdup(name);
+    if (!sink->path)
+        return AVERROR(ENOMEM);
+    sink->size = 0;
+    return 0;
+}
+
+static int async_end(void *opaque)
+{
+    CutterSink *sink = opaque;
+    size_t size;
+
+    if (!sink->path || !sink->path[0])
+        return AVERROR(EINVAL);
+    uint8_t *data = cutter_sink_memory_detach(sink, &size);
+    return cutter_async_submit(sink->async, sink->path, data, size);
+}
+
+int cutter_sink_alloc(CutterSink **sink_out, const CutterSinkCallbacks *callbacks, void *opaque)
+{
+    CutterSink *sink;
+
+    *sink_out = NULL;
+    if (!callbacks->write)
+        return AVERROR(EINVAL);
+
+    sink = calloc(1, sizeof(*sink));
+    if (!sink)
+        return AVERROR(ENOMEM);
+    sink->callbacks = *callbacks;
+    sink->opaque = opaque;
+    sink->fd = -1;
+
+    *sink_out = sink;
+    return 0;
+}
+
+int cutter_sink_alloc_memory(CutterSink **sink)
+{
+    static const CutterSinkCallbacks callbacks = { memory_begin, memory_write, NULL };
+
+    int ret = cutter_sink_alloc(sink, &callbacks, NULL);
+    if (ret >= 0)
+        (*sink)->opaque = *sink;
+    return ret;
+}
+
+int cutter_sink_alloc_fd(CutterSink **sink, int fd, size_t buffer_size)
+{
+    static const CutterSinkCallbacks callbacks = { NULL, fd_write, NULL };
+
+    int ret = cutter_sink_alloc(sink, &callbacks, NULL);
+    if (ret < 0)
+        return ret;
+
+    (*sink)->opaque = *sink;
+    (*sink)->fd = fd;
+    (*sink)->buffer_size = buffer_size ? buffer_size : SINK_DEFAULT_BUFFER;
+    (*sink)->buffer = malloc((*sink)->buffer_size);
+    if (!(*sink)->buffer) {
+        cutter_sink_close(sink);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+void cutter_unshare_file(const char *filename)
+{
+    struct stat st;
+
+    // Devices and FIFOs are written in place, only extra names of a regular file go
+    if (lstat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1)
+        unlink(filename);
+}
+
+int cutter_sink_open_file(CutterSink **sink, const char *filename, size_t buffer_size)
+{
+    *sink = NULL;
+    cutter_unshare_file(filename);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        int ret = AVERROR(errno);
+        cutter_log_error("Failed to open file '%s'", filename);
+        return ret;
+    }
+
+    int ret = cutter_sink_alloc_fd(sink, fd, buffer_size);
+    if (ret < 0) {
+        close(fd);
+        return ret;
+    }
+    (*sink)->owns_fd = 1;
+    return 0;
+}
+
+int cutter_sink_alloc_tar(CutterSink **sink, CutterSink *output)
+{
+    static const CutterSinkCallbacks callbacks = { tar_begin, memory_write, tar_end };
+
+    int ret = cutter_sink_alloc(sink, &callbacks, NULL);
+    if (ret >= 0) {
+        (*sink)->opaque = *sink;
+        (*sink)->output = output;
+    }
+    return ret;
+}
+
+int cutter_sink_open_async(CutterSink **sink, int queue_depth, int flags, cutter_write_cb done, void *opaque)
+{
+    static const CutterSinkCallbacks callbacks = { async_begin, memory_write, async_end };
+
+    int ret = cutter_sink_alloc(sink, &callbacks, NULL);
+    if (ret < 0)
+        return ret;
+
+    (*sink)->opaque = *sink;
+    ret = cutter_async_open(&(*sink)->async, queue_depth, flags, done, opaque);
+    if (ret < 0)
+        cutter_sink_close(sink);
+    return ret;
+}
+
+int cutter_sink_begin(CutterSink *sink, const char *name)
+{
+    return sink->callbacks.begin ? sink->callbacks.begin(sink->opaque, name ? name : "") : 0;
+}
+
+int cutter_sink_write(CutterSink *sink, const uint8_t *data, size_t size)
+{
+    return sink->callbacks.write(sink->opaque, data, size);
+}
+
+int cutter_sink_end(CutterSink *sink)
+{
+    return sink->callbacks.end ? sink->callbacks.end(sink->opaque) : 0;
+}
+
+int cutter_sink_flush(CutterSink *sink)
+{
+    if (sink->output)
+        return cutter_sink_flush(sink->output);
+    if (sink->async)
+        return cutter_async_wait(sink->async);
+    if (sink->buffer)
+        return fd_flush(sink);
+    return 0;
+}
+
+int cutter_sink_memory_data(const CutterSink *sink, const uint8_t **data, size_t *size)
+{
+    if (sink->callbacks.write != memory_write || sink->output || sink->async)
+        return AVERROR(EINVAL);
+    *data = sink->data;
+    *size = sink->size;
+    return 0;
+}
+
+uint8_t *cutter_sink_memory_detach(CutterSink *sink, size_t *size)
+{
+    uint8_t *data = sink->data;
+
+    *size = sink->size;
+    sink->data = NULL;
+    sink->size = sink->allocated = 0;
+    return data;
+}
+
+int cutter_sink_close(CutterSink **sink_ptr)
+{
+    CutterSink *sink = *sink_ptr;
+    int ret = 0;
+
+    if (!sink)
+        return 0;
+
+    // Two zero blocks end the archive
+    if (sink->output) {
+        static const uint8_t trailer[2 * TAR_BLOCK];
+        ret = cutter_sink_write(sink->output, trailer, sizeof(trailer));
+        if (ret >= 0)
+            ret = cutter_sink_flush(sink->output);
+    }
+    if (sink->buffer) {
+        int flushed = fd_flush(sink);
+        if (ret >= 0)
+            ret = flushed;
+    }
+    if (sink->owns_fd && close(sink->fd) < 0 && ret >= 0)
+        ret = AVERROR(errno);
+    if (sink->async) {
+        int closed = cutter_async_close(&sink->async);
+        if (ret >= 0)
+            ret = closed;
+    }
+
+    free(sink->path);
+    free(sink->buffer);
+    free(sink->data);
+    free(sink);
+    *sink_ptr = NULL;
+    return ret;
+}
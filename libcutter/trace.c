@@ -0,0 +1,142 @@
+/*
+ * Timeline of the pipeline stages in Chrome trace-event format
+ *
+ * Every thread records its stage spans into a ring buffer of its own,
+ * allocated on its first event and published once into a lock-free list.
+ * The hot path only writes to memory owned by the calling thread. When a
+ * ring is full the oldest spans are overwritten, the end of the run is
+ * what stalls are usually looked for in.
+ *
+ * The file opens in Perfetto (ui.perfetto.dev) or chrome://tracing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "internal.h"
+
+#define TRACE_DEFAULT_EVENTS (1 << 16)
+
+typedef struct TraceEvent {
+    int64_t start_ns;
+    int64_t duration_ns;
+    // Packet or frame being processed, AV_NOPTS_VALUE if none
+    int64_t pts;
+    int stage;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    long tid;
+    size_t size;
+    // Total number of events written, the ring holds the last size ones
+    atomic_size_t written;
+    TraceEvent events[];
+} TraceBuffer;
+
+static atomic_int trace_enabled;
+static size_t trace_events_per_thread = TRACE_DEFAULT_EVENTS;
+static _Atomic(TraceBuffer *) trace_buffers;
+
+static _Thread_local TraceBuffer *thread_buffer;
+static _Thread_local int64_t thread_pts = AV_NOPTS_VALUE;
+
+void cutter_trace_enable(size_t events_per_thread)
+{
+    if (events_per_thread)
+        trace_events_per_thread = events_per_thread;
+    atomic_store(&trace_enabled, 1);
+}
+
+int cutter_trace_active(void)
+{
+    return atomic_load_explicit(&trace_enabled, memory_order_relaxed);
+}
+
+void cutter_trace_set_pts(int64_t pts)
+{
+    thread_pts = pts;
+}
+
+static TraceBuffer *current_buffer(void)
+{
+    if (thread_buffer)
+        return thread_buffer;
+
+    TraceBuffer *buffer = calloc(1, sizeof(*buffer) + trace_events_per_thread * sizeof(TraceEvent));
+    if (!buffer)
+        return NULL;
+    buffer->tid = syscall(SYS_gettid);
+    buffer->size = trace_events_per_thread;
+
+    // Published once per thread, the only contended operation
+    buffer->next = atomic_load(&trace_buffers);
+    while (!atomic_compare_exchange_weak(&trace_buffers, &buffer->next, buffer))
+        ;
+    thread_buffer = buffer;
+    return buffer;
+}
+
+void cutter_trace_span(CutterStage stage, int64_t start_ns, int64_t end_ns)
+{
+    if (!start_ns || !cutter_trace_active())
+        return;
+
+    TraceBuffer *buffer = current_buffer();
+    if (!buffer)
+        return;
+
+    size_t written = atomic_load_explicit(&buffer->written, memory_order_relaxed);
+    TraceEvent *event = &buffer->events[written % buffer->size];
+    event->start_ns = start_ns;
+    event->duration_ns = end_ns - start_ns;
+    event->pts = thread_pts;
+    event->stage = stage;
+    atomic_store_explicit(&buffer->written, written + 1, memory_order_release);
+}
+
+int cutter_trace_write(const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    int pid = getpid();
+    int first = 1;
+
+    if (!fp) {
+        cutter_log_error("Failed to open file '%s'", filename);
+        return AVERROR(errno);
+    }
+    atomic_store(&trace_enabled, 0);
+
+    // Complete ("X") events, timestamps in microseconds
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (TraceBuffer *buffer = atomic_load(&trace_buffers); buffer; buffer = buffer->next) {
+        size_t written = atomic_load_explicit(&buffer->written, memory_order_acquire);
+        size_t begin = written > buffer->size ? written - buffer->size : 0;
+
+        fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,"
+                    "\"args\":{\"name\":\"cutter-%ld\"}}", first ? "" : ",", pid, buffer->tid, buffer->tid);
+        first = 0;
+
+        for (size_t i = begin; i < written; i++) {
+            const TraceEvent *event = &buffer->events[i % buffer->size];
+
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"cutter\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,"
+                        "\"ts\":%.3f,\"dur\":%.3f",
+                    cutter_stage_name(event->stage), pid, buffer->tid,
+                    event->start_ns / 1000.0, event->duration_ns / 1000.0);
+            if (event->pts != AV_NOPTS_VALUE)
+                fprintf(fp, ",\"args\":{\"pts\":%" PRId64 "}", event->pts);
+            fprintf(fp, "}");
+        }
+    }
+    fprintf(fp, "\n]}\n");
+
+    if (fclose(fp) != 0)
+        return AVERROR(errno);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Kill one shard half way, resume it and check that the outputs match an
+# uninterrupted run and that the files of the other shards are left alone.
+# Run from the top of the tree after ./build.sh, input.mp4 is the sample.
+
+set -e
+
+INPUT=${1:-input.mp4}
+SHARDS=3
+VICTIM=1
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+rm -rf output
+for i in $(seq 0 $((SHARDS - 1))); do
+    ./cutter -q --checkpoint --shard $i/$SHARDS "$INPUT"
+done
+(cd output && sha256sum frame-*.png) > "$WORK/expected"
+
+# Everything the victim wrote after the first half of its manifest is lost
+MANIFEST=output/manifest-$VICTIM-of-$SHARDS.txt
+TOTAL=$(wc -l < "$MANIFEST")
+KEEP=$((TOTAL / 2))
+if [ "$KEEP" -lt 1 ]; then
+    echo "shard $VICTIM/$SHARDS is too short to be interrupted" >&2
+    exit 1
+fi
+tail -n +$((KEEP + 1)) "$MANIFEST" | while read -r number pts size checksum filename; do
+    rm -f "$filename"
+done
+head -n $KEEP "$MANIFEST" > "$WORK/manifest"
+cp "$WORK/manifest" "$MANIFEST"
+
+# Inode and modification time of the files of the other shards
+others() {
+    for i in $(seq 0 $((SHARDS - 1))); do
+        [ $i -eq $VICTIM ] && continue
+        cut -d' ' -f5- output/manifest-$i-of-$SHARDS.txt | xargs stat -c '%i %y %n'
+    done
+}
+others > "$WORK/others-before"
+
+./cutter -q --shard $VICTIM/$SHARDS --resume "$INPUT"
+
+others > "$WORK/others-after"
+(cd output && sha256sum frame-*.png) > "$WORK/actual"
+
+if ! cmp -s "$WORK/others-before" "$WORK/others-after"; then
+    echo "FAIL: resuming shard $VICTIM/$SHARDS touched the files of other shards" >&2
+    diff "$WORK/others-before" "$WORK/others-after" >&2 || true
+    exit 1
+fi
+if ! cmp -s "$WORK/expected" "$WORK/actual"; then
+    echo "FAIL: the resumed shard differs from an uninterrupted run" >&2
+    diff "$WORK/expected" "$WORK/actual" >&2 || true
+    exit 1
+fi
+if [ "$(wc -l < "$MANIFEST")" -ne "$TOTAL" ]; then
+    echo "FAIL: the manifest of shard $VICTIM/$SHARDS has $(wc -l < "$MANIFEST") entries, expected $TOTAL" >&2
+    exit 1
+fi
+echo "shard-resume: ok ($((TOTAL - KEEP)) of $TOTAL outputs of shard $VICTIM/$SHARDS redone)"